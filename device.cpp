@@ -6,16 +6,95 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <charconv>
+#include <unordered_map>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <utility>
+#include <coroutine>
+#include <span>
+#include <stdexcept>
 
 using namespace std; //
 
-int streamcounter; ///< Global variable to keep track of stream creation.
+/**
+ * @class IdAllocator
+ * @brief Numbers the generated stream names of one owner, such as a flowsheet.
+ *
+ * Not synchronized: an allocator belongs to one thread at a time, so owners built on
+ * different threads never contend.
+ */
+class IdAllocator
+{
+private:
+    int last = 0; ///< Last number handed out.
+
+public:
+    IdAllocator& operator=(int value) {last = value; return *this;}
+    int operator++() {return ++last;}
+    int next() {return ++last;}
+    int current() const {return last;}
+};
+
+/**
+ * @class AtomicIdAllocator
+ * @brief IdAllocator that any number of threads may draw from at once, without locking.
+ */
+class AtomicIdAllocator
+{
+private:
+    atomic<int> last{0}; ///< Last number handed out.
+
+public:
+    AtomicIdAllocator& operator=(int value) {last.store(value, memory_order_relaxed); return *this;}
+    int operator++() {return next();}
+    int next() {return last.fetch_add(1, memory_order_relaxed) + 1;}
+    int current() const {return last.load(memory_order_relaxed);}
+};
+
+AtomicIdAllocator streamcounter; ///< Numbers of free-standing streams created with Stream(++streamcounter).
 
 const int MIXER_OUTPUTS = 1;
 const float POSSIBLE_ERROR = 0.01;
+const size_t SCENARIO_TILE = 64; ///< Scenario lanes a column kernel keeps in a local buffer.
+
+/**
+ * @brief Lanes of a column-kernel tile for scalar type T: the bytes of SCENARIO_TILE doubles.
+ */
+template <class T>
+constexpr size_t tileLanes() {return SCENARIO_TILE * sizeof(double) / sizeof(T);}
+const uint32_t MIXER_TYPE = 1;   ///< Snapshot type id of Mixer.
+const uint32_t REACTOR_TYPE = 2; ///< Snapshot type id of Reactor.
+const uint32_t SPLITTER_TYPE = 3; ///< Snapshot type id of Splitter.
+const size_t DUAL_DIRECTIONS = 8; ///< Feeds differentiated by one sensitivity sweep.
 
 /**
  * @class Stream
@@ -64,253 +143,8205 @@ public:
     void print() { cout << "Stream " << getName() << " flow = " << getMassFlow() << endl; }
 };
 
+using StreamHandle = uint32_t; ///< Index of a stream in a StreamTable.
+using DeviceHandle = uint32_t; ///< Index of a device in a Flowsheet.
+
 /**
- * @class Device
- * @brief Represents a device that manipulates chemical streams.
+ * @class Arena
+ * @brief Monotonic bump allocator: memory is handed out from large blocks and released all at once.
+ *
+ * Objects allocated here are never freed one by one; destroying the arena frees every
+ * block. Everything allocated from an arena must be destroyed before the arena.
  */
-class Device
+class Arena
 {
-protected:
-    vector<shared_ptr<Stream>> inputs;  ///< Input streams connected to the device.
-    vector<shared_ptr<Stream>> outputs; ///< Output streams produced by the device.
-    int inputAmount;
-    int outputAmount;
+private:
+    size_t blockSize;
+    vector<unique_ptr<char[]>> blocks;
+    char* cursor = nullptr;
+    size_t left = 0;
+
 public:
     /**
-     * @brief Add an input stream to the device.
-     * @param s A shared pointer to the input stream.
+     * @brief Create an empty arena.
+     * @param bytesPerBlock Size of the blocks requested from the heap.
      */
-    void addInput(shared_ptr<Stream> s){
-      if(inputs.size() < inputAmount) inputs.push_back(s);
-      else throw"INPUT STREAM LIMIT!";
-    }
+    explicit Arena(size_t bytesPerBlock = 1 << 16) : blockSize(bytesPerBlock) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
     /**
-     * @brief Add an output stream to the device.
-     * @param s A shared pointer to the output stream.
+     * @brief Allocate memory with the given alignment; larger requests get a block of their own.
      */
-    void addOutput(shared_ptr<Stream> s){
-      if(outputs.size() < outputAmount) outputs.push_back(s);
-      else throw "OUTPUT STREAM LIMIT!";
+    void* allocate(size_t size, size_t align) {
+        size_t padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+        if (cursor == nullptr || padding + size > left) {
+          size_t bytes = max(blockSize, size + align);
+          blocks.emplace_back(new char[bytes]);
+          cursor = blocks.back().get();
+          left = bytes;
+          padding = (align - reinterpret_cast<uintptr_t>(cursor) % align) % align;
+        }
+        void* result = cursor + padding;
+        cursor += padding + size;
+        left -= padding + size;
+        return result;
     }
 
     /**
-     * @brief Update the output streams of the device (to be implemented by derived classes).
+     * @brief Get the number of blocks requested from the heap so far.
      */
-    virtual void updateOutputs() = 0;
+    size_t blockCount() const {return blocks.size();}
+
+    template <class T, class... Args>
+    shared_ptr<T> makeShared(Args&&... args);
 };
 
-class Mixer: public Device
+/**
+ * @class ArenaAllocator
+ * @brief Standard allocator adaptor over an Arena; deallocation is a no-op.
+ */
+template <class T>
+class ArenaAllocator
 {
-    private:
-      int _inputs_count = 0;
-    public:
-      Mixer(int inputs_count): Device() {
-        _inputs_count = inputs_count;
-      }
-      void addInput(shared_ptr<Stream> s) {
-        if (inputs.size() == _inputs_count) {
-          throw "Too much inputs"s;
-        }
-        inputs.push_back(s);
-      }
-      void addOutput(shared_ptr<Stream> s) {
-        if (outputs.size() == MIXER_OUTPUTS) {
-          throw "Too much outputs"s;
-        }
-        outputs.push_back(s);
-      }
-      void updateOutputs() override {
-        double sum_mass_flow = 0;
-        for (const auto& input_stream : inputs) {
-          sum_mass_flow += input_stream -> getMassFlow();
-        }
+public:
+    using value_type = T;
 
-        if (outputs.empty()) {
-          throw "Should set outputs before update"s;
-        }
+    Arena* arena;
 
-        double output_mass = sum_mass_flow / outputs.size(); // divide 0
+    explicit ArenaAllocator(Arena& a) : arena(&a) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
 
-        for (auto& output_stream : outputs) {
-          output_stream -> setMassFlow(output_mass);
-        }
-      }
+    T* allocate(size_t n) {return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));}
+    void deallocate(T*, size_t) {}
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const {return arena == other.arena;}
 };
 
-void shouldSetOutputsCorrectlyWithOneOutput() {
-    streamcounter=0;
-    Mixer d1 = Mixer(2);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s2(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
+/**
+ * @brief Construct an object and its shared_ptr control block in one arena allocation.
+ */
+template <class T, class... Args>
+shared_ptr<T> Arena::makeShared(Args&&... args) {
+    return allocate_shared<T>(ArenaAllocator<T>(*this), std::forward<Args>(args)...);
+}
 
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
+/**
+ * @class StreamTable
+ * @brief Structure-of-arrays store of streams addressed by integer handles.
+ *
+ * Mass flows live in one contiguous array so a full-plant solve walks linear memory.
+ * Names are interned into one character buffer and found through an open-addressing
+ * hash table, so adding a stream allocates nothing beyond amortized array growth.
+ */
+class StreamTable
+{
+private:
+    static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
 
-    d1.updateOutputs();
+    vector<double> flows;        ///< Mass flow of every stream, indexed by handle.
+    vector<uint32_t> nameIds;    ///< Interned name of every stream, indexed by handle.
+    string nameChars;            ///< Characters of all distinct names, back to back.
+    vector<uint32_t> nameStarts{0}; ///< Start of every distinct name in nameChars, plus the end.
+    vector<uint32_t> internedIds;  ///< Names reachable through the hash table.
+    vector<size_t> internedHashes; ///< Hash of every interned name, kept for cheap rehashing.
+    vector<uint32_t> slots;        ///< Hash table of indices into internedIds, EMPTY_SLOT where unused.
+    size_t components = 0;         ///< Length of every composition vector; 0 when only mass flows are tracked.
+    vector<double> compositions;   ///< Component flows, stream s at s * components.
 
-    if (abs(s3->getMassFlow()) - 15 < POSSIBLE_ERROR) {
-      cout << "Test 1 passed"s << endl;
-    } else {
-      cout << "Test 1 failed"s << endl;
+    string_view nameAt(uint32_t id) const {
+        return string_view(nameChars).substr(nameStarts[id], nameStarts[id + 1] - nameStarts[id]);
     }
-}
 
-void shouldCorrectOutputs() {
-    streamcounter=0;
-    Mixer d1 = Mixer(2);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s2(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    shared_ptr<Stream> s4(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
+    /**
+     * @brief Double the hash table and reinsert every name using its stored hash.
+     */
+    void growSlots() {
+        slots.assign(max<size_t>(16, slots.size() * 2), EMPTY_SLOT);
+        for (uint32_t i = 0; i < internedIds.size(); i++) {
+          size_t slot = internedHashes[i] & (slots.size() - 1);
+          while (slots[slot] != EMPTY_SLOT) slot = (slot + 1) & (slots.size() - 1);
+          slots[slot] = i;
+        }
+    }
 
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
+    uint32_t intern(string_view name) {
+        if (2 * internedIds.size() >= slots.size()) growSlots();
+        size_t h = hash<string_view>()(name);
+        size_t slot = h & (slots.size() - 1);
+        while (slots[slot] != EMPTY_SLOT) {
+          uint32_t i = slots[slot];
+          if (internedHashes[i] == h && nameAt(internedIds[i]) == name) return internedIds[i];
+          slot = (slot + 1) & (slots.size() - 1);
+        }
+        uint32_t id = nameCount();
+        nameChars.append(name);
+        nameStarts.push_back(nameChars.size());
+        slots[slot] = internedIds.size();
+        internedIds.push_back(id);
+        internedHashes.push_back(h);
+        return id;
+    }
 
-    try {
-      d1.addOutput(s4);
-    } catch (const string ex) {
-      if (ex == "Too much outputs"s) {
-        cout << "Test 2 passed"s << endl;
+public:
+    /**
+     * @brief Add a stream with zero mass flow.
+     * @param name The name of the stream.
+     * @return The handle of the new stream.
+     */
+    StreamHandle add(string_view name) {
+        nameIds.push_back(intern(name));
+        flows.push_back(0.0);
+        compositions.resize(flows.size() * components, 0.0);
+        return flows.size() - 1;
+    }
 
-        return;
-      }
+    /**
+     * @brief Add a stream whose name is known to be new, such as a generated one.
+     *
+     * The name is stored without a hash lookup, so it is not shared with later streams
+     * of the same name; use add() when sharing matters.
+     */
+    StreamHandle addUnique(string_view name) {
+        nameIds.push_back(nameCount());
+        nameChars.append(name);
+        nameStarts.push_back(nameChars.size());
+        flows.push_back(0.0);
+        compositions.resize(flows.size() * components, 0.0);
+        return flows.size() - 1;
     }
 
-    cout << "Test 2 failed"s << endl;
-}
+    /**
+     * @brief Replace the table with streams given as raw arrays, as stored in a snapshot.
+     * @param flowData Mass flow of every stream.
+     * @param count Number of streams.
+     * @param starts Start of every stream's name in chars, plus the end.
+     * @param chars Characters of all names, back to back.
+     */
+    void assign(const double* flowData, size_t count, const uint32_t* starts, const char* chars) {
+        flows.assign(flowData, flowData + count);
+        nameIds.resize(count);
+        for (size_t i = 0; i < count; i++) nameIds[i] = i;
+        nameStarts.assign(starts, starts + count + 1);
+        nameChars.assign(chars, starts[count]);
+        compositions.assign(count * components, 0.0);
+        internedIds.clear();
+        internedHashes.clear();
+        slots.clear();
+    }
 
-void shouldCorrectInputs() {
-    streamcounter=0;
-    Mixer d1 = Mixer(2);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s2(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    shared_ptr<Stream> s4(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
+    /**
+     * @brief Reserve room for a number of streams and name characters.
+     */
+    void reserve(size_t count, size_t nameBytes = 0) {
+        flows.reserve(count);
+        nameIds.reserve(count);
+        nameStarts.reserve(count + 1);
+        nameChars.reserve(nameBytes);
+        compositions.reserve(count * components);
+    }
 
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
+    /**
+     * @brief Track a composition vector of n component flows for every stream.
+     *
+     * Existing compositions are reset to zero; n = 0 switches back to mass flows only.
+     */
+    void setComponentCount(size_t n) {
+        components = n;
+        compositions.assign(flows.size() * n, 0.0);
+    }
 
-    try {
-      d1.addInput(s4);
-    } catch (const string ex) {
-      if (ex == "Too much inputs"s) {
-        cout << "Test 3 passed"s << endl;
+    size_t componentCount() const {return components;}
 
-        return;
-      }
+    /**
+     * @brief Get the component flows of a stream, contiguous and componentCount() long.
+     */
+    double* composition(StreamHandle s) {return compositions.data() + s * components;}
+    const double* composition(StreamHandle s) const {return compositions.data() + s * components;}
+
+    /**
+     * @brief Set the component flows of a stream; its mass flow becomes their sum.
+     */
+    void setComposition(StreamHandle s, const double* values) {
+        double total = 0;
+        for (size_t i = 0; i < components; i++) total += values[i];
+        memcpy(composition(s), values, components * sizeof(double));
+        flows[s] = total;
     }
 
-    cout << "Test 3 failed"s << endl;
-}
+    /**
+     * @brief Get all compositions back to back, indexed by stream handle times componentCount().
+     */
+    double* compositionData() {return compositions.data();}
 
-class Reactor : public Device{
-public:
-    Reactor(bool isDoubleReactor) {
-        inputAmount = 1;
-        if (isDoubleReactor) outputAmount = 2;
-        else inputAmount = 1;
-    }
-    
-    void updateOutputs() override{
-        double inputMass = inputs.at(0) -> getMassFlow();
-            for(int i = 0; i < outputAmount; i++){
-            double outputLocal = inputMass * (1/outputAmount);
-            outputs.at(i) -> setMassFlow(outputLocal);
-        }
-    }
+    size_t size() const {return flows.size();}
+
+    /**
+     * @brief Get the number of distinct names stored in the table.
+     */
+    size_t nameCount() const {return nameStarts.size() - 1;}
+
+    void setMassFlow(StreamHandle s, double m) {flows[s] = m;}
+    double getMassFlow(StreamHandle s) const {return flows[s];}
+    string_view getName(StreamHandle s) const {return nameAt(nameIds[s]);}
+
+    /**
+     * @brief Get the contiguous mass-flow array, indexed by stream handle.
+     */
+    double* data() {return flows.data();}
+    const double* data() const {return flows.data();}
+
+    /**
+     * @brief Print information about a stream.
+     */
+    void print(StreamHandle s) const { cout << "Stream " << getName(s) << " flow = " << getMassFlow(s) << endl; }
 };
 
-void testTooManyOutputStreams(){
-    streamcounter=0;
-    
-    Reactor dl = new Reactor(false);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s2(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
-    dl.addInput(s1);
-    dl.addOutput(s2);
-    try{
-        dl.addOutput(s3);
-    } catch(const string ex){
-         if (ex == "OUTPUT STREAM LIMIT!")
-            cout << "Test 1 passed" << endl;
+/**
+ * @brief Instruction sets the batched kernels can run on.
+ */
+enum class SimdPath
+{
+    Scalar, ///< Portable loops, left to the compiler to vectorize.
+    Avx2,   ///< 4 doubles per instruction.
+    Avx512  ///< 8 doubles per instruction.
+};
 
-        return;
+/**
+ * @brief Pick the widest instruction set supported by the running CPU.
+ */
+SimdPath bestSimdPath() {
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) return SimdPath::Avx512;
+    if (__builtin_cpu_supports("avx2")) return SimdPath::Avx2;
+#endif
+    return SimdPath::Scalar;
+}
+
+/**
+ * @brief out[i] = (in[0][i] + ... + in[rows-1][i]) / divisor for row-major rows of length n.
+ *
+ * The rows are added in order starting from zero, like Mixer::updateOutputs, so every
+ * path gives the same bits as the scalar mixer.
+ */
+void sumRowsScalar(const double* in, size_t rows, size_t n, double divisor, double* out) {
+    for (size_t i = 0; i < n; i++) out[i] = 0;
+    for (size_t k = 0; k < rows; k++) {
+      const double* row = in + k * n;
+      for (size_t i = 0; i < n; i++) out[i] += row[i];
     }
-    
-     cout << "Test 1 failed" << endl;
+    for (size_t i = 0; i < n; i++) out[i] /= divisor;
 }
 
-void testTooManyInputStreams(){
-    streamcounter=0;
-    
-    Reactor dl = new Reactor(false);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
-    dl.addInput(s1);
-    try{
-        dl.addInput(s3);
-    } catch(const string ex){
-         if (ex == "INPUT STREAM LIMIT!")
-            cout << "Test 2 passed" << endl;
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+void sumRowsAvx2(const double* in, size_t rows, size_t n, double divisor, double* out) {
+    __m256d div = _mm256_set1_pd(divisor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256d sum = _mm256_setzero_pd();
+      for (size_t k = 0; k < rows; k++) sum = _mm256_add_pd(sum, _mm256_loadu_pd(in + k * n + i));
+      _mm256_storeu_pd(out + i, _mm256_div_pd(sum, div));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t k = 0; k < rows; k++) sum += in[k * n + i];
+      out[i] = sum / divisor;
+    }
+}
 
-        return;
+__attribute__((target("avx512f")))
+void sumRowsAvx512(const double* in, size_t rows, size_t n, double divisor, double* out) {
+    __m512d div = _mm512_set1_pd(divisor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m512d sum = _mm512_setzero_pd();
+      for (size_t k = 0; k < rows; k++) sum = _mm512_add_pd(sum, _mm512_loadu_pd(in + k * n + i));
+      _mm512_storeu_pd(out + i, _mm512_div_pd(sum, div));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t k = 0; k < rows; k++) sum += in[k * n + i];
+      out[i] = sum / divisor;
     }
-    
-     cout << "Test 2 failed"s << endl;
 }
+#endif
 
-void testInputEqualOutput(){
-        streamcounter=0;
-    
-    Reactor dl = new Reactor(true);
-    
-    shared_ptr<Stream> s1(new Stream(++streamcounter));
-    shared_ptr<Stream> s2(new Stream(++streamcounter));
-    shared_ptr<Stream> s3(new Stream(++streamcounter));
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
-    dl.addInput(s1);
-    dl.addOutput(s2);
-    dl.addOutput(s3);
-    
-    dl.updateOutputs();
-    
-    if(dl.outputs.at(0).getMassFlow + dl.outputs.at(1).getMassFlow == dl.inputs.at(0).getMassFlow)
-        cout << "Test 3 passed" << endl;
-    else
-        cout << "Test 3 failed" << endl;
+/**
+ * @brief Dispatch sumRows to an instruction set, falling back to scalar code where it is unavailable.
+ */
+void sumRows(SimdPath path, const double* in, size_t rows, size_t n, double divisor, double* out) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (path == SimdPath::Avx512) return sumRowsAvx512(in, rows, n, divisor, out);
+    if (path == SimdPath::Avx2) return sumRowsAvx2(in, rows, n, divisor, out);
+#endif
+    sumRowsScalar(in, rows, n, divisor, out);
 }
 
-void tests(){
-    testInputEqualOutput();
+/**
+ * @brief out[j * n + i] = in[i] * ratios[j] for every output row j.
+ */
+void splitRowsScalar(const double* in, size_t n, const double* ratios, size_t rows, double* out) {
+    for (size_t j = 0; j < rows; j++) {
+      double* row = out + j * n;
+      for (size_t i = 0; i < n; i++) row[i] = in[i] * ratios[j];
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+void splitRowsAvx2(const double* in, size_t n, const double* ratios, size_t rows, double* out) {
+    for (size_t j = 0; j < rows; j++) {
+      double* row = out + j * n;
+      __m256d ratio = _mm256_set1_pd(ratios[j]);
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) _mm256_storeu_pd(row + i, _mm256_mul_pd(_mm256_loadu_pd(in + i), ratio));
+      for (; i < n; i++) row[i] = in[i] * ratios[j];
+    }
+}
+
+__attribute__((target("avx512f")))
+void splitRowsAvx512(const double* in, size_t n, const double* ratios, size_t rows, double* out) {
+    for (size_t j = 0; j < rows; j++) {
+      double* row = out + j * n;
+      __m512d ratio = _mm512_set1_pd(ratios[j]);
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8) _mm512_storeu_pd(row + i, _mm512_mul_pd(_mm512_loadu_pd(in + i), ratio));
+      for (; i < n; i++) row[i] = in[i] * ratios[j];
+    }
+}
+#endif
+
+/**
+ * @brief Dispatch splitRows to an instruction set, falling back to scalar code where it is unavailable.
+ */
+void splitRows(SimdPath path, const double* in, size_t n, const double* ratios, size_t rows, double* out) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (path == SimdPath::Avx512) return splitRowsAvx512(in, n, ratios, rows, out);
+    if (path == SimdPath::Avx2) return splitRowsAvx2(in, n, ratios, rows, out);
+#endif
+    splitRowsScalar(in, n, ratios, rows, out);
+}
+
+/**
+ * @brief The widest instruction set of the running CPU, detected once.
+ */
+SimdPath activeSimdPath() {
+    static const SimdPath path = bestSimdPath();
+    return path;
+}
+
+/**
+ * @brief out[i] = scale * (v[in[0]][i] + ... + v[in[count-1]][i]) for vectors of length n.
+ *
+ * Vector s starts at values[s * stride]. The vectors are added in port order starting
+ * from zero, so every path gives the same bits.
+ */
+void sumVectorsScalar(const double* values, size_t stride, const StreamHandle* in, size_t count, size_t n,
+                      double scale, double* out) {
+    for (size_t i = 0; i < n; i++) out[i] = 0;
+    for (size_t k = 0; k < count; k++) {
+      const double* row = values + in[k] * stride;
+      for (size_t i = 0; i < n; i++) out[i] += row[i];
+    }
+    for (size_t i = 0; i < n; i++) out[i] *= scale;
+}
+
+/**
+ * @brief out = scale * (m * x) for an n x n column-major matrix m.
+ *
+ * Column-major storage turns the product into n axpy passes over out, which vectorize
+ * without horizontal sums. Columns are accumulated in order on every path.
+ */
+void matVecScalar(const double* m, const double* x, size_t n, double scale, double* out) {
+    for (size_t i = 0; i < n; i++) out[i] = 0;
+    for (size_t c = 0; c < n; c++) {
+      const double* column = m + c * n;
+      for (size_t i = 0; i < n; i++) out[i] += column[i] * x[c];
+    }
+    for (size_t i = 0; i < n; i++) out[i] *= scale;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+void sumVectorsAvx2(const double* values, size_t stride, const StreamHandle* in, size_t count, size_t n,
+                    double scale, double* out) {
+    __m256d factor = _mm256_set1_pd(scale);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256d sum = _mm256_setzero_pd();
+      for (size_t k = 0; k < count; k++) sum = _mm256_add_pd(sum, _mm256_loadu_pd(values + in[k] * stride + i));
+      _mm256_storeu_pd(out + i, _mm256_mul_pd(sum, factor));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t k = 0; k < count; k++) sum += values[in[k] * stride + i];
+      out[i] = sum * scale;
+    }
+}
+
+__attribute__((target("avx512f")))
+void sumVectorsAvx512(const double* values, size_t stride, const StreamHandle* in, size_t count, size_t n,
+                      double scale, double* out) {
+    __m512d factor = _mm512_set1_pd(scale);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m512d sum = _mm512_setzero_pd();
+      for (size_t k = 0; k < count; k++) sum = _mm512_add_pd(sum, _mm512_loadu_pd(values + in[k] * stride + i));
+      _mm512_storeu_pd(out + i, _mm512_mul_pd(sum, factor));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t k = 0; k < count; k++) sum += values[in[k] * stride + i];
+      out[i] = sum * scale;
+    }
+}
+
+__attribute__((target("avx2")))
+void matVecAvx2(const double* m, const double* x, size_t n, double scale, double* out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m256d sum = _mm256_setzero_pd();
+      for (size_t c = 0; c < n; c++) {
+        sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(m + c * n + i), _mm256_set1_pd(x[c])));
+      }
+      _mm256_storeu_pd(out + i, _mm256_mul_pd(sum, _mm256_set1_pd(scale)));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t c = 0; c < n; c++) sum += m[c * n + i] * x[c];
+      out[i] = sum * scale;
+    }
+}
+
+__attribute__((target("avx512f")))
+void matVecAvx512(const double* m, const double* x, size_t n, double scale, double* out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m512d sum = _mm512_setzero_pd();
+      for (size_t c = 0; c < n; c++) {
+        sum = _mm512_add_pd(sum, _mm512_mul_pd(_mm512_loadu_pd(m + c * n + i), _mm512_set1_pd(x[c])));
+      }
+      _mm512_storeu_pd(out + i, _mm512_mul_pd(sum, _mm512_set1_pd(scale)));
+    }
+    for (; i < n; i++) {
+      double sum = 0;
+      for (size_t c = 0; c < n; c++) sum += m[c * n + i] * x[c];
+      out[i] = sum * scale;
+    }
+}
+#endif
+
+/**
+ * @brief Dispatch sumVectors to the instruction set of the running CPU.
+ */
+void sumVectors(const double* values, size_t stride, const StreamHandle* in, size_t count, size_t n,
+                double scale, double* out) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    SimdPath path = activeSimdPath();
+    if (path == SimdPath::Avx512) return sumVectorsAvx512(values, stride, in, count, n, scale, out);
+    if (path == SimdPath::Avx2) return sumVectorsAvx2(values, stride, in, count, n, scale, out);
+#endif
+    sumVectorsScalar(values, stride, in, count, n, scale, out);
+}
+
+/**
+ * @brief Dispatch matVec to the instruction set of the running CPU.
+ */
+void matVec(const double* m, const double* x, size_t n, double scale, double* out) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    SimdPath path = activeSimdPath();
+    if (path == SimdPath::Avx512) return matVecAvx512(m, x, n, scale, out);
+    if (path == SimdPath::Avx2) return matVecAvx2(m, x, n, scale, out);
+#endif
+    matVecScalar(m, x, n, scale, out);
+}
+
+/**
+ * @brief Reasons a connection, validation or update can fail.
+ */
+enum class DeviceError : uint8_t {
+    None,
+    InputLimit,
+    OutputLimit,
+    MixerInputLimit,
+    MixerOutputLimit,
+    NoInputs,
+    NoOutputs,
+    UnconnectedPorts,
+    UnknownStream,
+    UnknownDevice,
+    SeveralProducers,
+    NotLinear,
+    SingularBalance,
+    NegativeSplitRatio,
+    NoSplitShare,
+    SplitRatioCount,
+    StoichiometryShape,
+    StoichiometryComponents,
+    NoDerivativeKernel,
+    BatchMismatch,
+    CannotOpenSnapshot,
+    NotSnapshot,
+    CannotMapSnapshot,
+    SnapshotVersion,
+    CorruptSnapshot,
+    UnknownDeviceType,
+    UnsavableDevice,
+    CannotWriteSnapshot,
+    SnapshotTargetNotEmpty,
+    HistoryMismatch,
+    FeedSeriesShape,
+    CannotCreateHistory,
+    CannotWriteHistory,
+    NotHistory,
+    TruncatedHistory
+};
+
+/**
+ * @brief Get the message the throwing API reports for an error.
+ */
+constexpr const char* errorMessage(DeviceError e) {
+    switch (e) {
+      case DeviceError::None: return "";
+      case DeviceError::InputLimit: return "INPUT STREAM LIMIT!";
+      case DeviceError::OutputLimit: return "OUTPUT STREAM LIMIT!";
+      case DeviceError::MixerInputLimit: return "Too much inputs";
+      case DeviceError::MixerOutputLimit: return "Too much outputs";
+      case DeviceError::NoInputs: return "Should set inputs before update";
+      case DeviceError::NoOutputs: return "Should set outputs before update";
+      case DeviceError::UnconnectedPorts: return "Should connect all ports before update";
+      case DeviceError::UnknownStream: return "Unknown stream";
+      case DeviceError::UnknownDevice: return "Unknown device";
+      case DeviceError::SeveralProducers: return "Stream has several producers";
+      case DeviceError::NotLinear: return "Flowsheet is not a linear mass balance";
+      case DeviceError::SingularBalance: return "Mass balance is singular";
+      case DeviceError::NegativeSplitRatio: return "Split ratios must not be negative";
+      case DeviceError::NoSplitShare: return "Split ratios must sum to a positive value";
+      case DeviceError::SplitRatioCount: return "Need one split ratio per output";
+      case DeviceError::StoichiometryShape: return "Stoichiometry matrix must be n x n";
+      case DeviceError::StoichiometryComponents: return "Stoichiometry does not match the component count";
+      case DeviceError::NoDerivativeKernel: return "Device has no derivative kernel";
+      case DeviceError::BatchMismatch: return "Scenario batch does not match the flowsheet";
+      case DeviceError::CannotOpenSnapshot: return "Cannot open snapshot";
+      case DeviceError::NotSnapshot: return "Not a flowsheet snapshot";
+      case DeviceError::CannotMapSnapshot: return "Cannot map snapshot";
+      case DeviceError::SnapshotVersion: return "Unsupported snapshot version";
+      case DeviceError::CorruptSnapshot: return "Corrupt snapshot";
+      case DeviceError::UnknownDeviceType: return "Unknown device type in snapshot";
+      case DeviceError::UnsavableDevice: return "Device cannot be saved";
+      case DeviceError::CannotWriteSnapshot: return "Cannot write snapshot";
+      case DeviceError::SnapshotTargetNotEmpty: return "Snapshot must be loaded into an empty flowsheet";
+      case DeviceError::HistoryMismatch: return "Stream history does not match the flowsheet";
+      case DeviceError::FeedSeriesShape: return "Feed series must hold one value per feed and step";
+      case DeviceError::CannotCreateHistory: return "Cannot create stream history";
+      case DeviceError::CannotWriteHistory: return "Cannot write stream history";
+      case DeviceError::NotHistory: return "Not a stream history";
+      case DeviceError::TruncatedHistory: return "Truncated stream history";
+    }
+    return "";
+}
+
+/**
+ * @brief Throw an error as the std::string exception of the throwing API.
+ */
+[[noreturn]] void throwError(DeviceError e) {
+    throw string(errorMessage(e));
+}
+
+/**
+ * @class Status
+ * @brief Result of a non-throwing call: either success or a DeviceError.
+ *
+ * Converts to true on success, like std::expected<void, DeviceError>. Creating and
+ * checking a Status never allocates.
+ */
+class [[nodiscard]] Status
+{
+    DeviceError code = DeviceError::None;
+public:
+    constexpr Status() = default;
+    constexpr Status(DeviceError e): code(e) {}
+
+    constexpr explicit operator bool() const {return code == DeviceError::None;}
+    constexpr DeviceError error() const {return code;}
+    constexpr const char* message() const {return errorMessage(code);}
+
+    /**
+     * @brief Throw the error, if any, the way the throwing API does.
+     */
+    void orThrow() const {
+      if (code != DeviceError::None) throwError(code);
+    }
+};
+
+class Device;
+
+atomic<uint64_t> versionCounter{0}; ///< Last stamp handed out by nextVersion().
+
+/**
+ * @brief Get a stamp no other device parameters or cache scope of this process ever had.
+ *
+ * Stamps are never reused, so they also tell apart objects that reuse a freed address.
+ */
+uint64_t nextVersion() {return versionCounter.fetch_add(1, memory_order_relaxed) + 1;}
+
+/**
+ * @struct CacheStats
+ * @brief Counters of an EvaluationCache.
+ */
+struct CacheStats
+{
+    uint64_t hits = 0;      ///< Evaluations answered from the cache.
+    uint64_t misses = 0;    ///< Evaluations that had to run the device.
+    uint64_t evictions = 0; ///< Entries replaced by a different evaluation.
+
+    double hitRate() const {return hits + misses ? double(hits) / (hits + misses) : 0.0;}
+};
+
+/**
+ * @class EvaluationCache
+ * @brief Bounded cache of device results keyed on the device and its input flows.
+ *
+ * The key holds the device, the version of its parameters and a scope chosen by the
+ * caller, so re-parameterising a device or invalidating a scope makes old entries
+ * unreachable; they are evicted by later evaluations. Inputs are quantized relative to
+ * their magnitude: inputs whose binary mantissas fall in the same bucket of width
+ * tolerance reuse one result, so outputs may be off by up to twice the tolerance,
+ * relative to the inputs, times the device's gain. A tolerance of 0 keys on the exact
+ * bits. The cache is direct-mapped with a fixed number of entries, so its memory is
+ * bounded; a colliding evaluation evicts the old one. Lookups from several threads are safe.
+ */
+class EvaluationCache
+{
+private:
+    static constexpr size_t STRIPES = 64; ///< Locks shared by the entries, by entry index.
+
+    struct Entry
+    {
+        const Device* device = nullptr;
+        uint64_t version = 0;   ///< Parameter version of the device when the entry was made.
+        uint64_t scope = 0;
+        uint64_t hash = 0;
+        vector<uint64_t> key;   ///< Quantized inputs.
+        vector<double> outputs;
+    };
+
+    vector<Entry> entries;
+    double tolerance;
+    mutable mutex locks[STRIPES];
+    atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+
+    /**
+     * @brief Key of an input: its binary exponent and the bucket of its mantissa.
+     */
+    uint64_t quantize(double x) const {
+        if (tolerance <= 0) {
+          if (x == 0) x = 0; // -0.0 and 0.0 share a key
+          uint64_t bits;
+          memcpy(&bits, &x, sizeof(bits));
+          return bits;
+        }
+        int exponent = 0;
+        double mantissa = frexp(x, &exponent); // 0.5 <= |mantissa| < 1, or 0
+        int64_t bucket = int64_t(floor(mantissa / tolerance));
+        return uint64_t(uint32_t(exponent)) << 32 ^ uint64_t(bucket);
+    }
+
+    uint64_t hashOf(const Device* d, uint64_t version, uint64_t scope, const double* in, size_t inCount,
+                    size_t outCount) const {
+        uint64_t h = (reinterpret_cast<uintptr_t>(d) ^ version * 0xBF58476D1CE4E5B9ull ^ scope) * 0x9E3779B97F4A7C15ull
+                     ^ outCount;
+        for (size_t i = 0; i < inCount; i++) h = (h ^ quantize(in[i])) * 0x100000001B3ull;
+        return h ^ (h >> 29);
+    }
+
+    bool matches(const Entry& e, const Device* d, uint64_t version, uint64_t scope, uint64_t h, const double* in,
+                 size_t inCount, size_t outCount) const {
+        if (e.device != d || e.version != version || e.scope != scope || e.hash != h || e.key.size() != inCount
+            || e.outputs.size() != outCount) {
+          return false;
+        }
+        for (size_t i = 0; i < inCount; i++) {
+          if (e.key[i] != quantize(in[i])) return false;
+        }
+        return true;
+    }
+
+public:
+    /**
+     * @param capacity Number of entries, rounded up to a power of two.
+     * @param tol Width of the input buckets, relative to the magnitude of the inputs.
+     */
+    explicit EvaluationCache(size_t capacity = 4096, double tol = POSSIBLE_ERROR): tolerance(tol) {
+        size_t size = 1;
+        while (size < capacity) size *= 2;
+        entries.resize(size);
+    }
+
+    EvaluationCache(const EvaluationCache&) = delete;
+    EvaluationCache& operator=(const EvaluationCache&) = delete;
+
+    /**
+     * @brief Look up the outputs of a device for some inputs.
+     * @param out Receives outCount outputs on a hit.
+     * @param scope Owner of the entry, such as a flowsheet; 0 for devices used on their own.
+     * @return Whether the outputs were found.
+     */
+    bool find(const Device* d, const double* in, size_t inCount, double* out, size_t outCount, uint64_t scope = 0);
+
+    /**
+     * @brief Remember the outputs of a device for some inputs.
+     */
+    void insert(const Device* d, const double* in, size_t inCount, const double* out, size_t outCount,
+                uint64_t scope = 0);
+
+    /**
+     * @brief find() for a device whose parameter version is already known.
+     */
+    bool find(const Device* d, uint64_t version, uint64_t scope, const double* in, size_t inCount, double* out,
+              size_t outCount) {
+        uint64_t h = hashOf(d, version, scope, in, inCount, outCount);
+        size_t index = h & (entries.size() - 1);
+        lock_guard<mutex> lock(locks[index % STRIPES]);
+        const Entry& e = entries[index];
+        if (!matches(e, d, version, scope, h, in, inCount, outCount)) {
+          misses.fetch_add(1, memory_order_relaxed);
+          return false;
+        }
+        copy(e.outputs.begin(), e.outputs.end(), out);
+        hits.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief insert() for a device whose parameter version is already known.
+     */
+    void insert(const Device* d, uint64_t version, uint64_t scope, const double* in, size_t inCount,
+                const double* out, size_t outCount) {
+        uint64_t h = hashOf(d, version, scope, in, inCount, outCount);
+        size_t index = h & (entries.size() - 1);
+        lock_guard<mutex> lock(locks[index % STRIPES]);
+        Entry& e = entries[index];
+        if (e.device && !matches(e, d, version, scope, h, in, inCount, outCount)) {
+          evictions.fetch_add(1, memory_order_relaxed);
+        }
+        e.device = d;
+        e.version = version;
+        e.scope = scope;
+        e.hash = h;
+        e.key.resize(inCount);
+        for (size_t i = 0; i < inCount; i++) e.key[i] = quantize(in[i]);
+        e.outputs.assign(out, out + outCount);
+    }
+
+    CacheStats stats() const {
+        return CacheStats{hits.load(), misses.load(), evictions.load()};
+    }
+
+    size_t capacity() const {return entries.size();}
+
+    /**
+     * @brief Drop every entry and zero the statistics.
+     */
+    void clear() {
+        for (size_t i = 0; i < STRIPES; i++) locks[i].lock();
+        for (Entry& e : entries) e.device = nullptr;
+        for (size_t i = 0; i < STRIPES; i++) locks[i].unlock();
+        hits = 0;
+        misses = 0;
+        evictions = 0;
+    }
+};
+
+/**
+ * @struct Dual
+ * @brief Forward-mode dual number: a value with its derivatives along N directions.
+ *
+ * Device kernels written for a generic scalar type propagate derivatives when run on
+ * duals; N directions are carried at once, so one sweep differentiates by N feeds.
+ */
+template <size_t N>
+struct Dual
+{
+    double value = 0;
+    array<double, N> d{}; ///< Derivative along every direction.
+
+    Dual() = default;
+    Dual(double v): value(v) {}
+
+    Dual& operator+=(const Dual& o) {
+        value += o.value;
+        for (size_t k = 0; k < N; k++) d[k] += o.d[k];
+        return *this;
+    }
+    Dual& operator-=(const Dual& o) {
+        value -= o.value;
+        for (size_t k = 0; k < N; k++) d[k] -= o.d[k];
+        return *this;
+    }
+    Dual& operator*=(double s) {
+        value *= s;
+        for (size_t k = 0; k < N; k++) d[k] *= s;
+        return *this;
+    }
+    Dual& operator/=(double s) {
+        value /= s;
+        for (size_t k = 0; k < N; k++) d[k] /= s;
+        return *this;
+    }
+
+    friend Dual operator+(Dual a, const Dual& b) {return a += b;}
+    friend Dual operator-(Dual a, const Dual& b) {return a -= b;}
+    friend Dual operator*(Dual a, double s) {return a *= s;}
+    friend Dual operator*(double s, Dual a) {return a *= s;}
+    friend Dual operator/(Dual a, double s) {return a /= s;}
+    friend Dual operator*(const Dual& a, const Dual& b) {
+        Dual r(a.value * b.value);
+        for (size_t k = 0; k < N; k++) r.d[k] = a.d[k] * b.value + a.value * b.d[k];
+        return r;
+    }
+    friend Dual operator/(const Dual& a, const Dual& b) {
+        Dual r(a.value / b.value);
+        for (size_t k = 0; k < N; k++) r.d[k] = (a.d[k] - r.value * b.d[k]) / b.value;
+        return r;
+    }
+};
+
+using FlowDual = Dual<DUAL_DIRECTIONS>; ///< Scalar of the sensitivity kernels.
+
+/**
+ * @class PortList
+ * @brief Streams of the ports of a device, the first N held inline in the device itself.
+ *
+ * Devices with few ports read their streams without a hop to a separate vector buffer;
+ * wider devices spill to one heap array that grows like a vector.
+ */
+template <size_t N>
+class PortList
+{
+private:
+    using Port = shared_ptr<Stream>;
+
+    uint32_t count = 0;
+    uint32_t capacity = N; ///< Inline while capacity == N.
+    union {
+        alignas(Port) unsigned char local[N * sizeof(Port)];
+        Port* heap;
+    };
+
+    bool spilled() const {return capacity > N;}
+    Port* ports() {return spilled() ? heap : reinterpret_cast<Port*>(local);}
+    const Port* ports() const {return spilled() ? heap : reinterpret_cast<const Port*>(local);}
+
+    void release() {
+        clear();
+        if (spilled()) ::operator delete(heap);
+        capacity = N;
+    }
+
+    /**
+     * @brief Move the streams of another list into this empty, inline one.
+     */
+    void take(PortList& other) {
+        if (other.spilled()) {
+          heap = other.heap;
+          capacity = other.capacity;
+          count = other.count;
+          other.capacity = N;
+          other.count = 0;
+        } else {
+          for (Port& p : other) new (ports() + count++) Port(std::move(p));
+          other.clear();
+        }
+    }
+
+public:
+    PortList() {}
+    PortList(const PortList& other) {append(other.begin(), other.end());}
+    PortList(PortList&& other) noexcept {take(other);}
+    PortList& operator=(const PortList& other) {
+        if (this != &other) {
+          clear();
+          append(other.begin(), other.end());
+        }
+        return *this;
+    }
+    PortList& operator=(PortList&& other) noexcept {
+        if (this != &other) {
+          release();
+          take(other);
+        }
+        return *this;
+    }
+    ~PortList() {release();}
+
+    size_t size() const {return count;}
+    bool empty() const {return count == 0;}
+
+    Port* begin() {return ports();}
+    Port* end() {return ports() + count;}
+    const Port* begin() const {return ports();}
+    const Port* end() const {return ports() + count;}
+
+    Port& operator[](size_t i) {return ports()[i];}
+    const Port& operator[](size_t i) const {return ports()[i];}
+    const Port& at(size_t i) const {
+        if (i >= count) throw out_of_range("PortList::at");
+        return ports()[i];
+    }
+
+    /**
+     * @brief Make room for n streams; lists of up to N streams never allocate.
+     */
+    void reserve(size_t n) {
+        if (n <= capacity) return;
+        Port* grown = static_cast<Port*>(::operator new(n * sizeof(Port)));
+        Port* old = ports();
+        for (uint32_t i = 0; i < count; i++) {
+          new (grown + i) Port(std::move(old[i]));
+          old[i].~Port();
+        }
+        if (spilled()) ::operator delete(heap);
+        heap = grown;
+        capacity = n;
+    }
+
+    void push_back(Port p) {
+        if (count == capacity) reserve(2 * capacity);
+        new (ports() + count++) Port(std::move(p));
+    }
+
+    /**
+     * @brief Append copies of a range of streams.
+     */
+    void append(const Port* first, const Port* last) {
+        reserve(count + (last - first));
+        for (; first != last; first++) new (ports() + count++) Port(*first);
+    }
+
+    void clear() {
+        for (Port& p : *this) p.~Port();
+        count = 0;
+    }
+};
+
+/**
+ * @class Device
+ * @brief Represents a device that manipulates chemical streams.
+ */
+class Device
+{
+private:
+    uint64_t version = nextVersion(); ///< Changes with every change of the parameters.
+protected:
+    PortList<3> inputs;  ///< Input streams connected to the device.
+    PortList<2> outputs; ///< Output streams produced by the device.
+    int inputAmount = 0;
+    int outputAmount = 0;
+
+    /**
+     * @brief Record a change of the parameters; every parameter setter must call it.
+     *
+     * Cached results and linear factors made with the old parameters are then not reused.
+     */
+    void markChanged() {version = nextVersion();}
+public:
+    virtual ~Device() = default;
+
+    /**
+     * @brief Add an input stream to the device without throwing on a full device.
+     * @param s A shared pointer to the input stream.
+     */
+    Status tryAddInput(shared_ptr<Stream> s){
+      if(inputs.size() >= inputAmount) return inputLimitError();
+      if(inputs.empty()) inputs.reserve(inputAmount);
+      inputs.push_back(std::move(s));
+      return {};
+    }
+    /**
+     * @brief Add an output stream to the device without throwing on a full device.
+     * @param s A shared pointer to the output stream.
+     */
+    Status tryAddOutput(shared_ptr<Stream> s){
+      if(outputs.size() >= outputAmount) return outputLimitError();
+      if(outputs.empty()) outputs.reserve(outputAmount);
+      outputs.push_back(std::move(s));
+      return {};
+    }
+    /**
+     * @brief Add several input streams with one limit check; nothing is added if they do not fit.
+     * @param s Shared pointers to the input streams, in port order.
+     */
+    Status tryAddInputs(span<const shared_ptr<Stream>> s){
+      if(inputs.size() + s.size() > inputAmount) return inputLimitError();
+      inputs.reserve(inputAmount);
+      inputs.append(s.data(), s.data() + s.size());
+      return {};
+    }
+    /**
+     * @brief Add several output streams with one limit check; nothing is added if they do not fit.
+     * @param s Shared pointers to the output streams, in port order.
+     */
+    Status tryAddOutputs(span<const shared_ptr<Stream>> s){
+      if(outputs.size() + s.size() > outputAmount) return outputLimitError();
+      outputs.reserve(outputAmount);
+      outputs.append(s.data(), s.data() + s.size());
+      return {};
+    }
+    /**
+     * @brief Add an input stream to the device.
+     * @param s A shared pointer to the input stream.
+     */
+    void addInput(shared_ptr<Stream> s){
+      tryAddInput(std::move(s)).orThrow();
+    }
+    /**
+     * @brief Add an output stream to the device.
+     * @param s A shared pointer to the output stream.
+     */
+    void addOutput(shared_ptr<Stream> s){
+      tryAddOutput(std::move(s)).orThrow();
+    }
+    /**
+     * @brief Add several input streams at once.
+     * @param s Shared pointers to the input streams, in port order.
+     */
+    void addInputs(span<const shared_ptr<Stream>> s){
+      tryAddInputs(s).orThrow();
+    }
+    /**
+     * @brief Add several output streams at once.
+     * @param s Shared pointers to the output streams, in port order.
+     */
+    void addOutputs(span<const shared_ptr<Stream>> s){
+      tryAddOutputs(s).orThrow();
+    }
+
+    /**
+     * @brief Check whether the given port counts are enough to update the device.
+     * @param inCount Number of connected input streams.
+     * @param outCount Number of connected output streams.
+     */
+    virtual Status checkPorts(size_t inCount, size_t outCount) const {return {};}
+
+    /**
+     * @brief Check the streams connected to the device without updating it.
+     */
+    Status validate() const {return checkPorts(inputs.size(), outputs.size());}
+
+    /**
+     * @brief Update the outputs, or report why the device cannot be updated.
+     */
+    Status tryUpdateOutputs(){
+      Status status = validate();
+      if (status) updateOutputs();
+      return status;
+    }
+
+    /**
+     * @brief Get the input streams connected to the device.
+     * @return The input streams in connection order.
+     */
+    const PortList<3>& getInputs() const {return inputs;}
+
+    /**
+     * @brief Get the output streams produced by the device.
+     * @return The output streams in connection order.
+     */
+    const PortList<2>& getOutputs() const {return outputs;}
+
+    /**
+     * @brief Get the error reported when a device is offered more inputs than maxInputs().
+     */
+    virtual DeviceError inputLimitError() const {return DeviceError::InputLimit;}
+
+    /**
+     * @brief Get the error reported when a device is offered more outputs than maxOutputs().
+     */
+    virtual DeviceError outputLimitError() const {return DeviceError::OutputLimit;}
+
+    /**
+     * @brief Get the maximum number of input streams the device accepts.
+     */
+    virtual size_t maxInputs() const {return inputAmount;}
+
+    /**
+     * @brief Get the maximum number of output streams the device accepts.
+     */
+    virtual size_t maxOutputs() const {return outputAmount;}
+
+    /**
+     * @brief Identify built-in device types in snapshots; 0 for types that cannot be saved.
+     */
+    virtual uint32_t typeId() const {return 0;}
+
+    /**
+     * @brief Whether the outputs depend on nothing but the input flows, so results may be cached.
+     */
+    virtual bool isDeterministic() const {return false;}
+
+    /**
+     * @brief Get the version of the parameters, unique to this device and its current parameters.
+     */
+    uint64_t parameterVersion() const {return version;}
+
+    /**
+     * @brief Update the outputs, skipping updateOutputs() when the cache knows the inputs.
+     *
+     * Devices that are not deterministic always run updateOutputs().
+     */
+    void updateOutputsCached(EvaluationCache& cache){
+      if (!isDeterministic()) {
+        updateOutputs();
+        return;
+      }
+      thread_local vector<double> in, out;
+      in.resize(inputs.size());
+      out.resize(outputs.size());
+      for (size_t i = 0; i < inputs.size(); i++) in[i] = inputs[i]->getMassFlow();
+      if (cache.find(this, in.data(), in.size(), out.data(), out.size())) {
+        for (size_t i = 0; i < outputs.size(); i++) outputs[i]->setMassFlow(out[i]);
+        return;
+      }
+      updateOutputs();
+      for (size_t i = 0; i < outputs.size(); i++) out[i] = outputs[i]->getMassFlow();
+      cache.insert(this, in.data(), in.size(), out.data(), out.size());
+    }
+
+    /**
+     * @brief The constructor argument that recreates the device from its typeId.
+     */
+    virtual uint32_t typeParameter() const {return 0;}
+
+    /**
+     * @brief Append the parameters beyond typeParameter() that a snapshot must store, such as ratios.
+     */
+    virtual void saveParameters(vector<double>& values) const {}
+
+    /**
+     * @brief Update the output streams of the device (to be implemented by derived classes).
+     */
+    virtual void updateOutputs() = 0;
+
+    /**
+     * @brief Evaluate the device on streams stored in a StreamTable.
+     * @param flows Mass flows of the table, indexed by stream handle.
+     * @param in Handles of the input streams.
+     * @param inCount Number of input streams.
+     * @param out Handles of the output streams.
+     * @param outCount Number of output streams.
+     */
+    virtual void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                          const StreamHandle* out, size_t outCount) const = 0;
+
+    /**
+     * @brief Evaluate the device for many scenarios at once.
+     *
+     * Stream s holds lanes values starting at values[s * stride]. Every lane must give
+     * the same result as evaluate() on that scenario alone.
+     * @param values Scenario columns, indexed by stream handle times stride.
+     * @param stride Distance between the columns of consecutive streams.
+     * @param lanes Number of scenarios to evaluate.
+     */
+    virtual void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                                 const StreamHandle* out, size_t outCount) const = 0;
+
+    /**
+     * @brief evaluateColumns() on float columns, for reduced-precision screening runs.
+     *
+     * By default every tile of lanes is promoted to double, evaluated with evaluateColumns()
+     * and rounded back; devices with float kernels override it to stay in float.
+     */
+    virtual void evaluateColumnsReduced(float* values, size_t stride, size_t lanes, const StreamHandle* in,
+                                        size_t inCount, const StreamHandle* out, size_t outCount) const {
+        thread_local vector<double> promoted;
+        thread_local vector<StreamHandle> ports;
+        size_t portCount = inCount + outCount;
+        promoted.resize(portCount * SCENARIO_TILE);
+        ports.resize(portCount);
+        for (size_t p = 0; p < portCount; p++) ports[p] = p;
+        for (size_t tile = 0; tile < lanes; tile += SCENARIO_TILE) {
+          size_t width = min(SCENARIO_TILE, lanes - tile);
+          for (size_t i = 0; i < inCount; i++) {
+            const float* column = values + in[i] * stride + tile;
+            for (size_t j = 0; j < width; j++) promoted[i * SCENARIO_TILE + j] = column[j];
+          }
+          evaluateColumns(promoted.data(), SCENARIO_TILE, width, ports.data(), inCount, ports.data() + inCount, outCount);
+          for (size_t o = 0; o < outCount; o++) {
+            float* column = values + out[o] * stride + tile;
+            for (size_t j = 0; j < width; j++) column[j] = promoted[(inCount + o) * SCENARIO_TILE + j];
+          }
+        }
+    }
+
+    /**
+     * @brief Evaluate the device on ports that already passed checkPorts().
+     *
+     * Kernels of frozen flowsheets: no port checks and no exceptions. Devices that split
+     * their feed evenly use split instead of dividing by outCount.
+     * @param split Precomputed 1 / outCount.
+     */
+    virtual void evaluateValidated(double* flows, const StreamHandle* in, size_t inCount,
+                                   const StreamHandle* out, size_t outCount, double split) const {
+        evaluate(flows, in, inCount, out, outCount);
+    }
+
+    /**
+     * @brief evaluateColumns() on ports that already passed checkPorts().
+     * @param split Precomputed 1 / outCount.
+     */
+    virtual void evaluateColumnsValidated(double* values, size_t stride, size_t lanes, const StreamHandle* in,
+                                          size_t inCount, const StreamHandle* out, size_t outCount,
+                                          double split) const {
+        evaluateColumns(values, stride, lanes, in, inCount, out, outCount);
+    }
+
+    /**
+     * @brief Evaluate the device on the composition vectors of a StreamTable.
+     *
+     * The composition of stream s holds n component flows starting at values[s * n].
+     * By default every component goes through the device like an independent scenario.
+     * @param values Compositions of all streams, back to back.
+     * @param n Number of components.
+     */
+    virtual void evaluateComponents(double* values, size_t n, const StreamHandle* in, size_t inCount,
+                                    const StreamHandle* out, size_t outCount) const {
+        evaluateColumns(values, n, n, in, inCount, out, outCount);
+    }
+
+    /**
+     * @brief Describe the output mass flows as a fixed linear function of the input flows.
+     *
+     * Entry a[j * inCount + i] is the share of input i that leaves through output j.
+     * Devices that are not linear return false and leave a untouched.
+     * @param a Row-major outCount x inCount matrix to fill.
+     */
+    virtual bool linearCoefficients(size_t inCount, size_t outCount, double* a) const {return false;}
+
+    /**
+     * @brief Run evaluate() on dual numbers, propagating the derivatives of the inputs.
+     *
+     * Devices with a kernel generic over the scalar type override it with that kernel.
+     * @param flows Dual mass flows of the table, indexed by stream handle.
+     */
+    virtual void evaluateDual(FlowDual* flows, const StreamHandle* in, size_t inCount,
+                              const StreamHandle* out, size_t outCount) const {
+        throwError(DeviceError::NoDerivativeKernel);
+    }
+};
+
+static_assert(sizeof(Device) <= 128, "A device and its inline ports should fit in two cache lines");
+
+bool EvaluationCache::find(const Device* d, const double* in, size_t inCount, double* out, size_t outCount,
+                           uint64_t scope) {
+    return find(d, d->parameterVersion(), scope, in, inCount, out, outCount);
+}
+
+void EvaluationCache::insert(const Device* d, const double* in, size_t inCount, const double* out, size_t outCount,
+                             uint64_t scope) {
+    insert(d, d->parameterVersion(), scope, in, inCount, out, outCount);
+}
+
+/**
+ * @brief Mixer column kernel for double or float scenario columns.
+ */
+template <class T>
+void mixColumns(T* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                const StreamHandle* out, size_t outCount) {
+    if (outCount == 0) {
+      throwError(DeviceError::NoOutputs);
+    }
+
+    constexpr size_t TILE = tileLanes<T>();
+    T sum_mass_flow[TILE];
+    for (size_t tile = 0; tile < lanes; tile += TILE) {
+      size_t width = min(TILE, lanes - tile);
+      for (size_t j = 0; j < width; j++) sum_mass_flow[j] = 0;
+      for (size_t i = 0; i < inCount; i++) {
+        const T* column = values + in[i] * stride + tile;
+        for (size_t j = 0; j < width; j++) sum_mass_flow[j] += column[j];
+      }
+      for (size_t i = 0; i < outCount; i++) {
+        T* column = values + out[i] * stride + tile;
+        for (size_t j = 0; j < width; j++) column[j] = sum_mass_flow[j] / T(outCount);
+      }
+    }
+}
+
+/**
+ * @brief Mixer kernel for any scalar type: the feed total, shared evenly by the outputs.
+ */
+template <class T>
+void mixFlows(T* flows, const StreamHandle* in, size_t inCount, const StreamHandle* out, size_t outCount) {
+    T sum_mass_flow = 0;
+    for (size_t i = 0; i < inCount; i++) {
+      sum_mass_flow += flows[in[i]];
+    }
+
+    if (outCount == 0) {
+      throwError(DeviceError::NoOutputs);
+    }
+
+    T output_mass = sum_mass_flow / double(outCount);
+
+    for (size_t i = 0; i < outCount; i++) {
+      flows[out[i]] = output_mass;
+    }
+}
+
+class Mixer: public Device
+{
+    public:
+      Mixer(int inputs_count): Device() {
+        inputAmount = inputs_count;
+        outputAmount = MIXER_OUTPUTS;
+      }
+      DeviceError inputLimitError() const override {
+        return DeviceError::MixerInputLimit;
+      }
+      DeviceError outputLimitError() const override {
+        return DeviceError::MixerOutputLimit;
+      }
+      Status checkPorts(size_t inCount, size_t outCount) const override {
+        if (outCount == 0) return DeviceError::NoOutputs;
+        return {};
+      }
+      void updateOutputs() override {
+        if (outputs.empty()) {
+          throwError(DeviceError::NoOutputs);
+        }
+
+        double sum_mass_flow = 0;
+        for (const auto& input_stream : inputs) {
+          sum_mass_flow += input_stream -> getMassFlow();
+        }
+
+        double output_mass = sum_mass_flow / outputs.size();
+
+        for (auto& output_stream : outputs) {
+          output_stream -> setMassFlow(output_mass);
+        }
+      }
+      uint32_t typeId() const override {
+        return MIXER_TYPE;
+      }
+      bool isDeterministic() const override {
+        return true;
+      }
+      bool linearCoefficients(size_t inCount, size_t outCount, double* a) const override {
+        for (size_t i = 0; i < inCount * outCount; i++) a[i] = 1.0 / outCount;
+        return true;
+      }
+      uint32_t typeParameter() const override {
+        return inputAmount;
+      }
+      void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                    const StreamHandle* out, size_t outCount) const override {
+        mixFlows(flows, in, inCount, out, outCount);
+      }
+      void evaluateDual(FlowDual* flows, const StreamHandle* in, size_t inCount,
+                        const StreamHandle* out, size_t outCount) const override {
+        mixFlows(flows, in, inCount, out, outCount);
+      }
+      void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                           const StreamHandle* out, size_t outCount) const override {
+        mixColumns(values, stride, lanes, in, inCount, out, outCount);
+      }
+      void evaluateColumnsReduced(float* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                                  const StreamHandle* out, size_t outCount) const override {
+        mixColumns(values, stride, lanes, in, inCount, out, outCount);
+      }
+      void evaluateComponents(double* values, size_t n, const StreamHandle* in, size_t inCount,
+                              const StreamHandle* out, size_t outCount) const override {
+        if (outCount == 0) {
+          throwError(DeviceError::NoOutputs);
+        }
+
+        double* first = values + out[0] * n;
+        sumVectors(values, n, in, inCount, n, 1.0 / outCount, first);
+        for (size_t i = 1; i < outCount; i++) {
+          memcpy(values + out[i] * n, first, n * sizeof(double));
+        }
+      }
+      void evaluateValidated(double* flows, const StreamHandle* in, size_t inCount,
+                             const StreamHandle* out, size_t outCount, double split) const override {
+        double sum_mass_flow = 0;
+        for (size_t i = 0; i < inCount; i++) {
+          sum_mass_flow += flows[in[i]];
+        }
+
+        double output_mass = sum_mass_flow * split;
+
+        for (size_t i = 0; i < outCount; i++) {
+          flows[out[i]] = output_mass;
+        }
+      }
+      void evaluateColumnsValidated(double* values, size_t stride, size_t lanes, const StreamHandle* in,
+                                    size_t inCount, const StreamHandle* out, size_t outCount,
+                                    double split) const override {
+        double sum_mass_flow[SCENARIO_TILE];
+        for (size_t tile = 0; tile < lanes; tile += SCENARIO_TILE) {
+          size_t width = min(SCENARIO_TILE, lanes - tile);
+          for (size_t j = 0; j < width; j++) sum_mass_flow[j] = 0;
+          for (size_t i = 0; i < inCount; i++) {
+            const double* column = values + in[i] * stride + tile;
+            for (size_t j = 0; j < width; j++) sum_mass_flow[j] += column[j];
+          }
+          for (size_t j = 0; j < width; j++) sum_mass_flow[j] *= split;
+          for (size_t i = 0; i < outCount; i++) {
+            memcpy(values + out[i] * stride + tile, sum_mass_flow, width * sizeof(double));
+          }
+        }
+      }
+};
+
+void shouldSetOutputsCorrectlyWithOneOutput() {
+    streamcounter=0;
+    Mixer d1 = Mixer(2);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    d1.updateOutputs();
+
+    if (abs(s3->getMassFlow()) - 15 < POSSIBLE_ERROR) {
+      cout << "Test 1 passed"s << endl;
+    } else {
+      cout << "Test 1 failed"s << endl;
+    }
+}
+
+void shouldCorrectOutputs() {
+    streamcounter=0;
+    Mixer d1 = Mixer(2);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    shared_ptr<Stream> s4(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    try {
+      d1.addOutput(s4);
+    } catch (const string ex) {
+      if (ex == "Too much outputs"s) {
+        cout << "Test 2 passed"s << endl;
+
+        return;
+      }
+    }
+
+    cout << "Test 2 failed"s << endl;
+}
+
+void shouldCorrectInputs() {
+    streamcounter=0;
+    Mixer d1 = Mixer(2);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    shared_ptr<Stream> s4(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    try {
+      d1.addInput(s4);
+    } catch (const string ex) {
+      if (ex == "Too much inputs"s) {
+        cout << "Test 3 passed"s << endl;
+
+        return;
+      }
+    }
+
+    cout << "Test 3 failed"s << endl;
+}
+
+/**
+ * @brief Check split ratios and scale them to sum to 1; invalid ratios are left unchanged.
+ */
+Status normalizeRatios(vector<double>& ratios) {
+    double total = 0;
+    for (double r : ratios) {
+      if (r < 0) return DeviceError::NegativeSplitRatio;
+      total += r;
+    }
+    if (ratios.empty() || total <= 0) return DeviceError::NoSplitShare;
+    if (total != 1.0) {
+      for (double& r : ratios) r /= total;
+    }
+    return {};
+}
+
+/**
+ * @brief Check split ratios and scale them to sum to 1, throwing on invalid ratios.
+ */
+vector<double> normalizedRatios(vector<double> ratios) {
+    normalizeRatios(ratios).orThrow();
+    return ratios;
+}
+
+/**
+ * @brief Write feed * ratios[i] to every output stream; one multiply per output.
+ */
+template <class T>
+void splitFlow(T feed, const double* ratios, T* flows, const StreamHandle* out, size_t outCount) {
+    for (size_t i = 0; i < outCount; i++) flows[out[i]] = feed * ratios[i];
+}
+
+/**
+ * @brief splitFlow() for every lane of the scenario columns.
+ */
+template <class T>
+void splitColumns(T* values, size_t stride, size_t lanes, StreamHandle in, const double* ratios,
+                  const StreamHandle* out, size_t outCount) {
+    const T* column = values + in * stride;
+    for (size_t i = 0; i < outCount; i++) {
+      T* target = values + out[i] * stride;
+      T ratio = ratios[i];
+      for (size_t j = 0; j < lanes; j++) target[j] = column[j] * ratio;
+    }
+}
+
+/**
+ * @brief Write source * ratios[i] to the composition vector of every output stream.
+ */
+void splitVector(const double* source, size_t n, const double* ratios, double* values,
+                 const StreamHandle* out, size_t outCount) {
+    for (size_t i = 0; i < outCount; i++) {
+      double* target = values + out[i] * n;
+      double ratio = ratios[i];
+      for (size_t j = 0; j < n; j++) target[j] = source[j] * ratio;
+    }
+}
+
+class Reactor : public Device{
+    vector<double> ratios; ///< Share of the feed sent to every output.
+    bool customRatios = false;
+    vector<double> stoichiometry; ///< Column-major conversion matrix; empty for no reaction.
+    size_t stoichiometryComponents = 0;
+
+    /**
+     * @brief Mass-flow kernel of evaluate() for any scalar type.
+     */
+    template <class T>
+    void react(T* flows, const StreamHandle* in, size_t inCount, const StreamHandle* out, size_t outCount) const{
+        if (inCount == 0) throwError(DeviceError::NoInputs);
+        if (outCount == ratios.size()) {
+            splitFlow(flows[in[0]], ratios.data(), flows, out, outCount);
+            return;
+        }
+        T outputLocal = flows[in[0]] * (1.0/outCount);
+        for(size_t i = 0; i < outCount; i++){
+            flows[out[i]] = outputLocal;
+        }
+    }
+
+    /**
+     * @brief Mass-flow kernel of evaluateColumns() for double or float columns.
+     */
+    template <class T>
+    void reactColumns(T* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                      const StreamHandle* out, size_t outCount) const{
+        if (inCount == 0) throwError(DeviceError::NoInputs);
+        if (outCount == ratios.size()) {
+            splitColumns(values, stride, lanes, in[0], ratios.data(), out, outCount);
+            return;
+        }
+        constexpr size_t TILE = tileLanes<T>();
+        T share = 1.0/outCount;
+        T outputLocal[TILE];
+        for (size_t tile = 0; tile < lanes; tile += TILE) {
+            size_t width = min(TILE, lanes - tile);
+            const T* column = values + in[0] * stride + tile;
+            for (size_t j = 0; j < width; j++) outputLocal[j] = column[j] * share;
+            for (size_t i = 0; i < outCount; i++) {
+                memcpy(values + out[i] * stride + tile, outputLocal, width * sizeof(T));
+            }
+        }
+    }
+public:
+    Reactor(bool isDoubleReactor) {
+        inputAmount = 1;
+        if (isDoubleReactor) outputAmount = 2;
+        else outputAmount = 1;
+        ratios.assign(outputAmount, 1.0 / outputAmount);
+    }
+
+    /**
+     * @brief Split the product by fixed ratios instead of evenly, or report invalid ratios.
+     * @param r One ratio per output; scaled to sum to 1.
+     */
+    Status trySetSplitRatios(vector<double> r){
+        if (r.size() != outputAmount) return DeviceError::SplitRatioCount;
+        Status status = normalizeRatios(r);
+        if (!status) return status;
+        ratios = std::move(r);
+        customRatios = true;
+        markChanged();
+        return {};
+    }
+
+    /**
+     * @brief Split the product by fixed ratios instead of evenly.
+     * @param r One ratio per output; scaled to sum to 1.
+     */
+    void setSplitRatios(vector<double> r){
+        trySetSplitRatios(std::move(r)).orThrow();
+    }
+
+    const vector<double>& getSplitRatios() const {return ratios;}
+
+    /**
+     * @brief Set the conversion of feed components into product components.
+     *
+     * Entry (r, c), stored at matrix[c * n + r], is the flow of component r produced by a
+     * unit flow of component c in the feed. Columns summing to 1 conserve mass. The product
+     * is split between the outputs like the mass flow.
+     * @param matrix Column-major n x n matrix.
+     * @param n Number of components.
+     */
+    Status trySetStoichiometry(vector<double> matrix, size_t n){
+        if (matrix.size() != n * n) return DeviceError::StoichiometryShape;
+        stoichiometry = std::move(matrix);
+        stoichiometryComponents = n;
+        markChanged();
+        return {};
+    }
+
+    /**
+     * @brief trySetStoichiometry(), throwing when the matrix is not n x n.
+     */
+    void setStoichiometry(vector<double> matrix, size_t n){
+        trySetStoichiometry(std::move(matrix), n).orThrow();
+    }
+
+    uint32_t typeId() const override{ return REACTOR_TYPE; }
+    bool isDeterministic() const override{ return true; }
+    uint32_t typeParameter() const override{ return outputAmount; }
+
+    /**
+     * @brief Store nothing for an even split without reaction, else the ratios and the stoichiometry.
+     */
+    void saveParameters(vector<double>& values) const override{
+        if (!customRatios && stoichiometry.empty()) return;
+        values.insert(values.end(), ratios.begin(), ratios.end());
+        values.insert(values.end(), stoichiometry.begin(), stoichiometry.end());
+    }
+
+    bool linearCoefficients(size_t inCount, size_t outCount, double* a) const override{
+        fill(a, a + inCount * outCount, 0.0);
+        for (size_t j = 0; j < outCount; j++) a[j * inCount] = outCount == ratios.size() ? ratios[j] : 1.0/outCount;
+        return true;
+    }
+
+    Status checkPorts(size_t inCount, size_t outCount) const override{
+        if (inCount == 0) return DeviceError::NoInputs;
+        if (outCount < outputAmount) return DeviceError::UnconnectedPorts;
+        return {};
+    }
+    
+    void updateOutputs() override{
+        double inputMass = inputs.at(0) -> getMassFlow();
+        for(int i = 0; i < outputAmount; i++){
+            outputs.at(i) -> setMassFlow(inputMass * ratios[i]);
+        }
+    }
+
+    void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                  const StreamHandle* out, size_t outCount) const override{
+        react(flows, in, inCount, out, outCount);
+    }
+
+    void evaluateDual(FlowDual* flows, const StreamHandle* in, size_t inCount,
+                      const StreamHandle* out, size_t outCount) const override{
+        react(flows, in, inCount, out, outCount);
+    }
+
+    void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                         const StreamHandle* out, size_t outCount) const override{
+        reactColumns(values, stride, lanes, in, inCount, out, outCount);
+    }
+
+    void evaluateColumnsReduced(float* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                                const StreamHandle* out, size_t outCount) const override{
+        reactColumns(values, stride, lanes, in, inCount, out, outCount);
+    }
+
+    void evaluateComponents(double* values, size_t n, const StreamHandle* in, size_t inCount,
+                            const StreamHandle* out, size_t outCount) const override{
+        if (inCount == 0) throwError(DeviceError::NoInputs);
+        if (outCount == 0) return;
+        vector<double> even;
+        const double* shares = ratios.data();
+        if (outCount != ratios.size()) {
+            even.assign(outCount, 1.0/outCount);
+            shares = even.data();
+        }
+        const double* feed = values + in[0] * n;
+        if (stoichiometry.empty()) {
+            splitVector(feed, n, shares, values, out, outCount);
+            return;
+        }
+        if (stoichiometryComponents != n) throwError(DeviceError::StoichiometryComponents);
+        thread_local vector<double> product;
+        product.resize(n);
+        matVec(stoichiometry.data(), feed, n, 1.0, product.data());
+        splitVector(product.data(), n, shares, values, out, outCount);
+    }
+
+    void evaluateValidated(double* flows, const StreamHandle* in, size_t inCount,
+                           const StreamHandle* out, size_t outCount, double split) const override{
+        splitFlow(flows[in[0]], ratios.data(), flows, out, outCount);
+    }
+
+    void evaluateColumnsValidated(double* values, size_t stride, size_t lanes, const StreamHandle* in,
+                                  size_t inCount, const StreamHandle* out, size_t outCount,
+                                  double split) const override{
+        splitColumns(values, stride, lanes, in[0], ratios.data(), out, outCount);
+    }
+};
+
+void testTooManyOutputStreams(){
+    streamcounter=0;
+    
+    Reactor dl(false);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+    dl.addInput(s1);
+    dl.addOutput(s2);
+    try{
+        dl.addOutput(s3);
+    } catch(const string ex){
+         if (ex == "OUTPUT STREAM LIMIT!")
+            cout << "Test 1 passed" << endl;
+
+        return;
+    }
+    
+     cout << "Test 1 failed" << endl;
+}
+
+void testTooManyInputStreams(){
+    streamcounter=0;
+    
+    Reactor dl(false);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    dl.addInput(s1);
+    try{
+        dl.addInput(s3);
+    } catch(const string ex){
+         if (ex == "INPUT STREAM LIMIT!")
+            cout << "Test 2 passed" << endl;
+
+        return;
+    }
+    
+     cout << "Test 2 failed"s << endl;
+}
+
+void testInputEqualOutput(){
+        streamcounter=0;
+    
+    Reactor dl(true);
+    
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+    dl.addInput(s1);
+    dl.addOutput(s2);
+    dl.addOutput(s3);
+    
+    dl.updateOutputs();
+    
+    if(abs(s2->getMassFlow() + s3->getMassFlow() - s1->getMassFlow()) < POSSIBLE_ERROR)
+        cout << "Test 3 passed" << endl;
+    else
+        cout << "Test 3 failed" << endl;
+}
+
+/**
+ * @class Splitter
+ * @brief Splits one feed into several outputs by fixed ratios.
+ */
+class Splitter : public Device
+{
+private:
+    vector<double> ratios; ///< Share of the feed sent to every output, summing to 1.
+
+public:
+    /**
+     * @param r One ratio per output; scaled to sum to 1.
+     */
+    explicit Splitter(vector<double> r): ratios(normalizedRatios(std::move(r))) {
+        inputAmount = 1;
+        outputAmount = ratios.size();
+    }
+
+    const vector<double>& getSplitRatios() const {return ratios;}
+
+    uint32_t typeId() const override {return SPLITTER_TYPE;}
+    uint32_t typeParameter() const override {return ratios.size();}
+    void saveParameters(vector<double>& values) const override {values.insert(values.end(), ratios.begin(), ratios.end());}
+
+    bool isDeterministic() const override {return true;}
+
+    bool linearCoefficients(size_t inCount, size_t outCount, double* a) const override {
+        fill(a, a + inCount * outCount, 0.0);
+        for (size_t j = 0; j < outCount; j++) a[j * inCount] = ratios[j];
+        return true;
+    }
+
+    Status checkPorts(size_t inCount, size_t outCount) const override {
+        if (inCount == 0) return DeviceError::NoInputs;
+        if (outCount != ratios.size()) return DeviceError::UnconnectedPorts;
+        return {};
+    }
+
+    void updateOutputs() override {
+        validate().orThrow();
+        double feed = inputs[0]->getMassFlow();
+        for (size_t i = 0; i < outputs.size(); i++) outputs[i]->setMassFlow(feed * ratios[i]);
+    }
+
+    void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                  const StreamHandle* out, size_t outCount) const override {
+        checkPorts(inCount, outCount).orThrow();
+        splitFlow(flows[in[0]], ratios.data(), flows, out, outCount);
+    }
+
+    void evaluateDual(FlowDual* flows, const StreamHandle* in, size_t inCount,
+                      const StreamHandle* out, size_t outCount) const override {
+        checkPorts(inCount, outCount).orThrow();
+        splitFlow(flows[in[0]], ratios.data(), flows, out, outCount);
+    }
+
+    void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                         const StreamHandle* out, size_t outCount) const override {
+        checkPorts(inCount, outCount).orThrow();
+        splitColumns(values, stride, lanes, in[0], ratios.data(), out, outCount);
+    }
+
+    void evaluateColumnsReduced(float* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                                const StreamHandle* out, size_t outCount) const override {
+        checkPorts(inCount, outCount).orThrow();
+        splitColumns(values, stride, lanes, in[0], ratios.data(), out, outCount);
+    }
+
+    void evaluateComponents(double* values, size_t n, const StreamHandle* in, size_t inCount,
+                            const StreamHandle* out, size_t outCount) const override {
+        checkPorts(inCount, outCount).orThrow();
+        splitVector(values + in[0] * n, n, ratios.data(), values, out, outCount);
+    }
+
+    void evaluateValidated(double* flows, const StreamHandle* in, size_t inCount,
+                           const StreamHandle* out, size_t outCount, double split) const override {
+        splitFlow(flows[in[0]], ratios.data(), flows, out, outCount);
+    }
+
+    void evaluateColumnsValidated(double* values, size_t stride, size_t lanes, const StreamHandle* in,
+                                  size_t inCount, const StreamHandle* out, size_t outCount,
+                                  double split) const override {
+        splitColumns(values, stride, lanes, in[0], ratios.data(), out, outCount);
+    }
+};
+
+void shouldSplitByRatios() {
+    streamcounter=0;
+    Splitter splitter({1.0, 3.0});
+    shared_ptr<Stream> feed(new Stream(++streamcounter));
+    shared_ptr<Stream> small(new Stream(++streamcounter));
+    shared_ptr<Stream> large(new Stream(++streamcounter));
+    feed->setMassFlow(8.0);
+    splitter.addInput(feed);
+    splitter.addOutput(small);
+    Status partial = splitter.tryUpdateOutputs();
+    splitter.addOutput(large);
+    splitter.updateOutputs();
+
+    Reactor reactor(true);
+    reactor.setSplitRatios({0.2, 0.8});
+    reactor.addInput(feed);
+    reactor.addOutput(small);
+    reactor.addOutput(large);
+    reactor.updateOutputs();
+
+    if (partial.error() == DeviceError::UnconnectedPorts && small->getMassFlow() == 8.0 * 0.2
+        && large->getMassFlow() == 8.0 * 0.8 && splitter.getSplitRatios()[1] == 0.75 && reactor.typeId() == REACTOR_TYPE) {
+      cout << "Splitter test 1 passed"s << endl;
+    } else {
+      cout << "Splitter test 1 failed"s << endl;
+    }
+}
+
+class AsyncScheduler;
+
+/**
+ * @class DeviceTask
+ * @brief Coroutine of one asynchronous device evaluation.
+ *
+ * Created suspended; whoever runs it sets the scheduler in its promise first. Without a
+ * scheduler every external call runs inline and the task never suspends.
+ */
+class DeviceTask
+{
+public:
+    struct promise_type
+    {
+        AsyncScheduler* scheduler = nullptr; ///< Runs external calls; null to run them inline.
+        uint32_t entry = 0;                  ///< Plan entry being evaluated.
+        exception_ptr error;                 ///< Exception that ended the evaluation.
+
+        DeviceTask get_return_object() {return DeviceTask(coroutine_handle<promise_type>::from_promise(*this));}
+        suspend_always initial_suspend() noexcept {return {};}
+        suspend_always final_suspend() noexcept {return {};}
+        void return_void() {}
+        void unhandled_exception() {error = current_exception();}
+    };
+
+    DeviceTask() = default;
+    explicit DeviceTask(coroutine_handle<promise_type> h): handle(h) {}
+    DeviceTask(DeviceTask&& other) noexcept: handle(exchange(other.handle, {})) {}
+    DeviceTask& operator=(DeviceTask&& other) noexcept {
+        if (this != &other) {
+          if (handle) handle.destroy();
+          handle = exchange(other.handle, {});
+        }
+        return *this;
+    }
+    ~DeviceTask() {
+        if (handle) handle.destroy();
+    }
+
+    coroutine_handle<promise_type> get() const {return handle;}
+
+    /**
+     * @brief Run the evaluation to completion on the calling thread.
+     */
+    void runInline() {
+        handle.resume();
+        if (handle.promise().error) rethrow_exception(handle.promise().error);
+    }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+/**
+ * @class ExternalCall
+ * @brief Awaitable running slow work, such as a property service request, off the solver thread.
+ *
+ * The awaiting device suspends until the work is done; the solver meanwhile evaluates
+ * other devices. Exceptions of the work are rethrown in the device.
+ */
+struct ExternalCall
+{
+    function<void()> work;
+    exception_ptr error;
+
+    bool await_ready() const noexcept {return false;}
+    bool await_suspend(coroutine_handle<DeviceTask::promise_type> h);
+    void await_resume() {
+        if (error) rethrow_exception(error);
+    }
+};
+
+/**
+ * @brief Await work outside the solver thread: co_await callExternal([&]{ ... });
+ */
+ExternalCall callExternal(function<void()> work) {return ExternalCall{std::move(work), nullptr};}
+
+/**
+ * @class AsyncScheduler
+ * @brief Runs external calls on a fixed set of worker threads and hands finished devices back to the solver.
+ *
+ * The workers are started once and wait for calls in between, so a recycle that sweeps
+ * the plan many times does not create a thread per call. Calls beyond the worker count
+ * queue until a worker is free.
+ */
+class AsyncScheduler
+{
+private:
+    struct PendingCall
+    {
+        ExternalCall* call;
+        coroutine_handle<DeviceTask::promise_type> device;
+    };
+
+    mutex lock;
+    condition_variable callsChanged;
+    condition_variable completedChanged;
+    deque<PendingCall> calls;
+    vector<coroutine_handle<DeviceTask::promise_type>> completed;
+    vector<thread> workers;
+    bool stopping = false;
+
+    void workerLoop() {
+        while (true) {
+          PendingCall next;
+          {
+            unique_lock<mutex> guard(lock);
+            callsChanged.wait(guard, [&]{ return stopping || !calls.empty(); });
+            if (calls.empty()) return;
+            next = calls.front();
+            calls.pop_front();
+          }
+          try {
+            next.call->work();
+          } catch (...) {
+            next.call->error = current_exception();
+          }
+          lock_guard<mutex> guard(lock);
+          completed.push_back(next.device);
+          completedChanged.notify_one();
+        }
+    }
+
+public:
+    /**
+     * @brief Start the workers.
+     * @param workerCount Number of external calls that run at the same time.
+     */
+    explicit AsyncScheduler(size_t workerCount) {
+        for (size_t i = 0; i < max<size_t>(1, workerCount); i++) workers.emplace_back(&AsyncScheduler::workerLoop, this);
+    }
+
+    AsyncScheduler(const AsyncScheduler&) = delete;
+    AsyncScheduler& operator=(const AsyncScheduler&) = delete;
+
+    /**
+     * @brief Finish the queued calls and stop the workers.
+     */
+    ~AsyncScheduler() {
+        {
+          lock_guard<mutex> guard(lock);
+          stopping = true;
+        }
+        callsChanged.notify_all();
+        for (thread& t : workers) t.join();
+    }
+
+    size_t workerCount() const {return workers.size();}
+
+    /**
+     * @brief Queue the work of a call; the device is resumed by whoever waits for it.
+     */
+    void launch(ExternalCall* call, coroutine_handle<DeviceTask::promise_type> h) {
+        {
+          lock_guard<mutex> guard(lock);
+          calls.push_back(PendingCall{call, h});
+        }
+        callsChanged.notify_one();
+    }
+
+    /**
+     * @brief Block until a device's external call finishes and return the device to resume.
+     */
+    coroutine_handle<DeviceTask::promise_type> wait() {
+        unique_lock<mutex> guard(lock);
+        completedChanged.wait(guard, [&]{ return !completed.empty(); });
+        auto h = completed.back();
+        completed.pop_back();
+        return h;
+    }
+};
+
+bool ExternalCall::await_suspend(coroutine_handle<DeviceTask::promise_type> h) {
+    AsyncScheduler* scheduler = h.promise().scheduler;
+    if (scheduler) {
+      scheduler->launch(this, h);
+      return true;
+    }
+    try {
+      work();
+    } catch (...) {
+      error = current_exception();
+    }
+    return false;
+}
+
+/**
+ * @class AsyncDevice
+ * @brief A device whose evaluation may wait on external models without blocking the solver.
+ *
+ * Derived classes write evaluateAsync() as a coroutine that co_awaits callExternal().
+ * Flowsheet::solveAsync() overlaps suspended devices with the rest of the plant; every
+ * other caller of evaluate() runs the coroutine to completion inline.
+ */
+class AsyncDevice : public Device
+{
+public:
+    /**
+     * @brief Evaluate the device like evaluate(), suspending on external calls.
+     */
+    virtual DeviceTask evaluateAsync(double* flows, const StreamHandle* in, size_t inCount,
+                                     const StreamHandle* out, size_t outCount) const = 0;
+
+    void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                  const StreamHandle* out, size_t outCount) const override {
+        evaluateAsync(flows, in, inCount, out, outCount).runInline();
+    }
+};
+
+/**
+ * @brief Methods for converging the tear streams of recycle loops.
+ */
+enum class ConvergenceMethod
+{
+    SuccessiveSubstitution, ///< Next guess is the last evaluated value.
+    Wegstein,               ///< Per-stream secant extrapolation with bounded acceleration factor.
+    Anderson                ///< Least-squares mixing of the last few iterates.
+};
+
+/**
+ * @struct ConvergenceReport
+ * @brief Outcome of a flowsheet solve.
+ */
+struct ConvergenceReport
+{
+    size_t iterations = 0;     ///< Number of evaluation sweeps.
+    double residual = 0;       ///< Largest tear-stream change in the last sweep.
+    bool converged = false;    ///< Whether the residual reached the tolerance.
+    vector<double> residuals;  ///< Residual of every sweep, to spot slow loops.
+};
+
+/**
+ * @struct Jacobian
+ * @brief Derivatives of every stream flow with respect to a set of feed flows.
+ */
+struct Jacobian
+{
+    size_t feedCount = 0;
+    vector<double> values;  ///< d flow(s) / d feed j at values[s * feedCount + j].
+    size_t sweeps = 0;      ///< Dual sweeps over the plan, for all feeds together.
+    bool converged = false; ///< Whether the derivatives of every tear stream settled.
+
+    double derivative(StreamHandle s, size_t feed) const {return values[s * feedCount + feed];}
+};
+
+/**
+ * @struct BalanceReport
+ * @brief Outcome of a flowsheet mass-balance audit.
+ */
+struct BalanceReport
+{
+    double worstResidual = 0; ///< Largest |inputs - outputs| over all devices.
+    size_t violations = 0;    ///< Devices whose residual exceeds the tolerance.
+    vector<pair<DeviceHandle, double>> offenders; ///< Worst violating devices and their signed residual, worst first.
+};
+
+/**
+ * @brief Solve a small dense system in place by Gaussian elimination with partial pivoting.
+ * @param a Row-major n x n matrix, destroyed.
+ * @param b Right-hand side, replaced by the solution.
+ * @return False if the matrix is singular.
+ */
+bool solveDense(vector<double>& a, vector<double>& b, size_t n) {
+    for (size_t col = 0; col < n; col++) {
+      size_t pivot = col;
+      for (size_t row = col + 1; row < n; row++) {
+        if (abs(a[row * n + col]) > abs(a[pivot * n + col])) pivot = row;
+      }
+      if (abs(a[pivot * n + col]) < 1e-300) return false;
+      if (pivot != col) {
+        for (size_t k = 0; k < n; k++) swap(a[col * n + k], a[pivot * n + k]);
+        swap(b[col], b[pivot]);
+      }
+      for (size_t row = col + 1; row < n; row++) {
+        double factor = a[row * n + col] / a[col * n + col];
+        for (size_t k = col; k < n; k++) a[row * n + k] -= factor * a[col * n + k];
+        b[row] -= factor * b[col];
+      }
+    }
+    for (size_t col = n; col-- > 0;) {
+      for (size_t k = col + 1; k < n; k++) b[col] -= a[col * n + k] * b[k];
+      b[col] /= a[col * n + col];
+    }
+    return true;
+}
+
+/**
+ * @class TearAccelerator
+ * @brief Chooses the next tear-stream guess from the last guess x and its evaluation g(x).
+ */
+class TearAccelerator
+{
+private:
+    static constexpr double WEGSTEIN_MIN_Q = -5.0; ///< Bound on extrapolation.
+    static constexpr double WEGSTEIN_MAX_Q = 0.0;  ///< No damping below plain substitution.
+    static constexpr size_t ANDERSON_DEPTH = 5;    ///< Number of past iterates mixed.
+
+    ConvergenceMethod method = ConvergenceMethod::SuccessiveSubstitution;
+    vector<double> previousX;
+    vector<double> previousG;
+    vector<vector<double>> historyF; ///< Recent residuals g(x) - x, oldest first.
+    vector<vector<double>> historyG; ///< Recent evaluations g(x), oldest first.
+    bool started = false;
+
+    void wegstein(vector<double>& x, const vector<double>& g) {
+        for (size_t i = 0; i < x.size(); i++) {
+          double next = g[i];
+          double dx = x[i] - previousX[i];
+          if (started && abs(dx) > 1e-12) {
+            double slope = (g[i] - previousG[i]) / dx;
+            double q = slope == 1.0 ? WEGSTEIN_MIN_Q : slope / (slope - 1.0);
+            q = min(max(q, WEGSTEIN_MIN_Q), WEGSTEIN_MAX_Q);
+            next = q * x[i] + (1.0 - q) * g[i];
+          }
+          previousX[i] = x[i];
+          previousG[i] = g[i];
+          x[i] = next;
+        }
+        started = true;
+    }
+
+    void anderson(vector<double>& x, const vector<double>& g) {
+        size_t n = x.size();
+        vector<double> f(n);
+        for (size_t i = 0; i < n; i++) f[i] = g[i] - x[i];
+        historyF.push_back(f);
+        historyG.push_back(g);
+        if (historyF.size() > ANDERSON_DEPTH + 1) {
+          historyF.erase(historyF.begin());
+          historyG.erase(historyG.begin());
+        }
+
+        size_t m = historyF.size() - 1;
+        x = g;
+        if (m == 0) return;
+
+        // Least squares on the residual differences: (dF^T dF + eps I) gamma = dF^T f.
+        vector<double> normal(m * m, 0.0);
+        vector<double> gamma(m, 0.0);
+        for (size_t a = 0; a < m; a++) {
+          for (size_t i = 0; i < n; i++) {
+            double dfa = historyF[a + 1][i] - historyF[a][i];
+            gamma[a] += dfa * f[i];
+            for (size_t b = 0; b < m; b++) {
+              normal[a * m + b] += dfa * (historyF[b + 1][i] - historyF[b][i]);
+            }
+          }
+          normal[a * m + a] += 1e-12;
+        }
+        if (!solveDense(normal, gamma, m)) return;
+        for (size_t a = 0; a < m; a++) {
+          for (size_t i = 0; i < n; i++) x[i] -= gamma[a] * (historyG[a + 1][i] - historyG[a][i]);
+        }
+    }
+
+public:
+    /**
+     * @brief Forget the history and start a new convergence run.
+     * @param m The acceleration method.
+     * @param n The number of tear streams.
+     */
+    void reset(ConvergenceMethod m, size_t n) {
+        method = m;
+        previousX.assign(n, 0.0);
+        previousG.assign(n, 0.0);
+        historyF.clear();
+        historyG.clear();
+        started = false;
+    }
+
+    /**
+     * @brief Replace x with the next guess.
+     * @param x The last guess, overwritten with the next one.
+     * @param g The evaluation of the last guess.
+     */
+    void next(vector<double>& x, const vector<double>& g) {
+        switch (method) {
+          case ConvergenceMethod::SuccessiveSubstitution: x = g; break;
+          case ConvergenceMethod::Wegstein: wegstein(x, g); break;
+          case ConvergenceMethod::Anderson: anderson(x, g); break;
+        }
+    }
+};
+
+/**
+ * @class SparseLU
+ * @brief LU factors of a sparse square matrix, reused for any number of right-hand sides.
+ *
+ * Rows are eliminated in their given order, without pivoting and without a
+ * fill-reducing ordering, so the factors are only reliable for column diagonally
+ * dominant matrices, such as the mass balances of plants that let mass out of every
+ * recycle. Fill-in is kept, so solve() is exact rather than an approximation. A pivot
+ * that is tiny relative to its row, as for a near-total recycle, makes factor() fail
+ * instead of returning inaccurate factors.
+ */
+class SparseLU
+{
+private:
+    static constexpr double PIVOT_TOLERANCE = 1e-10; ///< Smallest pivot relative to the largest entry of its row.
+
+    size_t n = 0;
+    vector<uint32_t> lowerOffsets; ///< Start of every row of L in lowerColumns.
+    vector<uint32_t> lowerColumns;
+    vector<double> lowerValues;    ///< Multipliers below the unit diagonal of L.
+    vector<uint32_t> upperOffsets; ///< Start of every row of U in upperColumns, diagonal excluded.
+    vector<uint32_t> upperColumns;
+    vector<double> upperValues;
+    vector<double> inverseDiagonal; ///< 1 / diagonal of U.
+
+public:
+    /**
+     * @brief Factor a matrix given as compressed rows; repeated columns in a row are added.
+     * @param size Number of rows and columns.
+     * @param offsets Start of every row in columns and values, size + 1 entries.
+     * @return false if a pivot is below PIVOT_TOLERANCE times the largest entry of its row,
+     *         leaving no usable factors.
+     */
+    bool factor(size_t size, const vector<uint32_t>& offsets, const vector<uint32_t>& columns,
+                const vector<double>& values) {
+        n = size;
+        lowerOffsets.assign(1, 0);
+        upperOffsets.assign(1, 0);
+        lowerColumns.clear();
+        lowerValues.clear();
+        upperColumns.clear();
+        upperValues.clear();
+        inverseDiagonal.resize(n);
+
+        vector<double> work(n, 0.0);
+        vector<uint8_t> used(n, 0);
+        vector<uint32_t> touched, pending, upper;
+        for (uint32_t i = 0; i < n; i++) {
+          auto add = [&](uint32_t c, double v) {
+            if (!used[c]) {
+              used[c] = 1;
+              touched.push_back(c);
+              if (c < i) {
+                pending.push_back(c);
+                push_heap(pending.begin(), pending.end(), greater<uint32_t>());
+              } else if (c > i) {
+                upper.push_back(c);
+              }
+            }
+            work[c] += v;
+          };
+          add(i, 0.0);
+          for (uint32_t e = offsets[i]; e < offsets[i + 1]; e++) add(columns[e], values[e]);
+          double scale = 0;
+          for (uint32_t c : touched) scale = max(scale, abs(work[c]));
+
+          // Eliminate the entries left of the diagonal in increasing column order, so fill-in
+          // created by one row of U is eliminated in turn.
+          while (!pending.empty()) {
+            pop_heap(pending.begin(), pending.end(), greater<uint32_t>());
+            uint32_t k = pending.back();
+            pending.pop_back();
+            double m = work[k] * inverseDiagonal[k];
+            if (m == 0) continue;
+            lowerColumns.push_back(k);
+            lowerValues.push_back(m);
+            for (uint32_t e = upperOffsets[k]; e < upperOffsets[k + 1]; e++) add(upperColumns[e], -m * upperValues[e]);
+          }
+
+          for (uint32_t c : upper) scale = max(scale, abs(work[c]));
+          if (!(abs(work[i]) > PIVOT_TOLERANCE * scale)) return false;
+          inverseDiagonal[i] = 1.0 / work[i];
+          sort(upper.begin(), upper.end());
+          for (uint32_t c : upper) {
+            if (work[c] == 0) continue;
+            upperColumns.push_back(c);
+            upperValues.push_back(work[c]);
+          }
+          lowerOffsets.push_back(lowerColumns.size());
+          upperOffsets.push_back(upperColumns.size());
+
+          for (uint32_t c : touched) {
+            used[c] = 0;
+            work[c] = 0;
+          }
+          touched.clear();
+          upper.clear();
+        }
+        return true;
+    }
+
+    size_t size() const {return n;}
+
+    /**
+     * @brief Number of stored entries of L and U, diagonal included.
+     */
+    size_t nonZeros() const {return lowerColumns.size() + upperColumns.size() + n;}
+
+    /**
+     * @brief Solve in place for several right-hand sides at once.
+     *
+     * Row i of the right-hand sides holds lanes values starting at x[i * stride]; they are
+     * replaced by the solution.
+     */
+    void solve(double* x, size_t stride, size_t lanes) const {
+        for (size_t i = 0; i < n; i++) {
+          double* row = x + i * stride;
+          for (uint32_t e = lowerOffsets[i]; e < lowerOffsets[i + 1]; e++) {
+            const double* source = x + lowerColumns[e] * stride;
+            double m = lowerValues[e];
+            for (size_t j = 0; j < lanes; j++) row[j] -= m * source[j];
+          }
+        }
+        for (size_t i = n; i-- > 0;) {
+          double* row = x + i * stride;
+          for (uint32_t e = upperOffsets[i]; e < upperOffsets[i + 1]; e++) {
+            const double* source = x + upperColumns[e] * stride;
+            double u = upperValues[e];
+            for (size_t j = 0; j < lanes; j++) row[j] -= u * source[j];
+          }
+          for (size_t j = 0; j < lanes; j++) row[j] *= inverseDiagonal[i];
+        }
+    }
+
+    /**
+     * @brief Solve in place for one right-hand side.
+     */
+    void solve(double* x) const {solve(x, 1, 1);}
+};
+
+/**
+ * @class WorkStealingPool
+ * @brief Fixed set of worker threads that run parallel loops with per-worker task deques.
+ *
+ * A loop is cut into chunks that are dealt round-robin onto the workers' deques. Each
+ * worker pops from the back of its own deque and steals from the front of the others
+ * once it runs dry. The calling thread takes part as worker 0.
+ */
+class WorkStealingPool
+{
+private:
+    struct WorkerQueue
+    {
+        mutex lock;
+        deque<pair<size_t, size_t>> tasks;
+    };
+
+    vector<thread> threads;
+    vector<unique_ptr<WorkerQueue>> queues; ///< One deque per worker, index 0 is the caller.
+    const function<void(size_t, size_t)>* job = nullptr;
+    atomic<size_t> remaining{0};            ///< Chunks of the current loop not yet finished.
+    exception_ptr error;
+    mutex stateLock;
+    condition_variable wake;
+    condition_variable done;
+    unsigned long generation = 0;
+    bool stopping = false;
+
+    bool popTask(size_t self, pair<size_t, size_t>& task) {
+        {
+          lock_guard<mutex> guard(queues[self]->lock);
+          if (!queues[self]->tasks.empty()) {
+            task = queues[self]->tasks.back();
+            queues[self]->tasks.pop_back();
+            return true;
+          }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+          WorkerQueue& victim = *queues[(self + i) % queues.size()];
+          lock_guard<mutex> guard(victim.lock);
+          if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+          }
+        }
+        return false;
+    }
+
+    void runTasks(size_t self) {
+        pair<size_t, size_t> task;
+        while (popTask(self, task)) {
+          try {
+            (*job)(task.first, task.second);
+          } catch (...) {
+            lock_guard<mutex> guard(stateLock);
+            if (!error) error = current_exception();
+          }
+          if (remaining.fetch_sub(1) == 1) {
+            lock_guard<mutex> guard(stateLock);
+            done.notify_all();
+          }
+        }
+    }
+
+    void workerLoop(size_t self) {
+        unsigned long seen = 0;
+        while (true) {
+          {
+            unique_lock<mutex> guard(stateLock);
+            wake.wait(guard, [&]{ return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+          }
+          runTasks(self);
+        }
+    }
+
+public:
+    /**
+     * @brief Start the pool.
+     * @param threadCount Total number of threads including the caller; 0 means one per core.
+     */
+    explicit WorkStealingPool(size_t threadCount = 0) {
+        if (threadCount == 0) threadCount = max(1u, thread::hardware_concurrency());
+        for (size_t i = 0; i < threadCount; i++) queues.push_back(make_unique<WorkerQueue>());
+        for (size_t i = 1; i < threadCount; i++) threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool() {
+        {
+          lock_guard<mutex> guard(stateLock);
+          stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    size_t size() const {return queues.size();}
+
+    /**
+     * @brief Run body(begin, end) over [0, count) in chunks of about grain items and wait for all of them.
+     *
+     * Rethrows the first exception thrown by the body.
+     */
+    void parallelFor(size_t count, size_t grain, const function<void(size_t, size_t)>& body) {
+        if (count == 0) return;
+        grain = max<size_t>(grain, 1);
+        if (threads.empty() || count <= grain) {
+          body(0, count);
+          return;
+        }
+
+        size_t chunks = (count + grain - 1) / grain;
+        {
+          lock_guard<mutex> guard(stateLock);
+          job = &body;
+          error = nullptr;
+          remaining = chunks;
+        }
+        for (size_t c = 0; c < chunks; c++) {
+          WorkerQueue& queue = *queues[c % queues.size()];
+          lock_guard<mutex> guard(queue.lock);
+          queue.tasks.emplace_back(c * grain, min(count, (c + 1) * grain));
+        }
+        {
+          lock_guard<mutex> guard(stateLock);
+          generation++;
+        }
+        wake.notify_all();
+
+        runTasks(0);
+        unique_lock<mutex> guard(stateLock);
+        done.wait(guard, [&]{ return remaining.load() == 0; });
+        if (error) rethrow_exception(error);
+    }
+};
+
+/**
+ * @class BasicScenarioBatch
+ * @brief Mass flows of every stream of a flowsheet for many scenarios.
+ *
+ * Each stream owns a contiguous column with one value per scenario, so device
+ * kernels sweep whole columns instead of being called once per scenario. Batches of
+ * float hold twice the scenarios in the same memory, for screening runs.
+ */
+template <class T>
+class BasicScenarioBatch
+{
+private:
+    size_t streamTotal;
+    size_t width;
+    vector<T> values; ///< Column of stream s starts at s * width.
+
+public:
+    BasicScenarioBatch(size_t streamCount, size_t scenarios)
+        : streamTotal(streamCount), width(scenarios), values(streamCount * scenarios, T(0)) {}
+
+    size_t streamCount() const {return streamTotal;}
+    size_t scenarios() const {return width;}
+
+    T* column(StreamHandle s) {return values.data() + s * width;}
+    const T* column(StreamHandle s) const {return values.data() + s * width;}
+    void setMassFlow(StreamHandle s, size_t scenario, double m) {values[s * width + scenario] = m;}
+    double getMassFlow(StreamHandle s, size_t scenario) const {return values[s * width + scenario];}
+    T* data() {return values.data();}
+
+    /**
+     * @brief Copy the batch with its values converted, e.g. to verify a float screening in double.
+     */
+    template <class U>
+    BasicScenarioBatch<U> converted() const {
+        BasicScenarioBatch<U> copy(streamTotal, width);
+        copy_n(values.data(), values.size(), copy.data());
+        return copy;
+    }
+};
+
+using ScenarioBatch = BasicScenarioBatch<double>;
+using ScreeningBatch = BasicScenarioBatch<float>; ///< Reduced-precision batch of screening runs.
+
+/**
+ * @brief Recreate a built-in device from its snapshot type id, parameter and saveParameters() values.
+ * @param arena Storage of the new device.
+ * @param device Receives the device on success.
+ * @return UnknownDeviceType for an unknown type, CorruptSnapshot for values that do not fit it.
+ */
+Status makeBuiltinDevice(Arena& arena, uint32_t type, uint32_t parameter, span<const double> values,
+                         shared_ptr<Device>& device) {
+    if (type == MIXER_TYPE) {
+      if (!values.empty()) return DeviceError::CorruptSnapshot;
+      device = arena.makeShared<Mixer>(parameter);
+      return {};
+    }
+    if (type == REACTOR_TYPE && (parameter == 1 || parameter == 2)) {
+      shared_ptr<Reactor> reactor = arena.makeShared<Reactor>(parameter == 2);
+      if (!values.empty()) {
+        if (values.size() < parameter) return DeviceError::CorruptSnapshot;
+        Status status = reactor->trySetSplitRatios(vector<double>(values.begin(), values.begin() + parameter));
+        if (!status) return DeviceError::CorruptSnapshot;
+        size_t n = llround(sqrt(double(values.size() - parameter)));
+        if (n && !reactor->trySetStoichiometry(vector<double>(values.begin() + parameter, values.end()), n)) {
+          return DeviceError::CorruptSnapshot;
+        }
+        if (!n && values.size() != parameter) return DeviceError::CorruptSnapshot;
+      }
+      device = std::move(reactor);
+      return {};
+    }
+    if (type == SPLITTER_TYPE) {
+      vector<double> ratios(values.begin(), values.end());
+      if (ratios.size() != parameter || !normalizeRatios(ratios)) return DeviceError::CorruptSnapshot;
+      device = arena.makeShared<Splitter>(std::move(ratios));
+      return {};
+    }
+    return DeviceError::UnknownDeviceType;
+}
+
+/**
+ * @struct SnapshotHeader
+ * @brief Fixed header of a binary flowsheet snapshot.
+ *
+ * The header is followed by these arrays, each starting on an 8-byte boundary:
+ * flows, name starts and name characters of every stream; type, parameter and plan
+ * order of every device; input offsets and handles; output offsets and handles; tears;
+ * consumer offsets and consumers of every stream; level offsets and entries; and,
+ * when componentCount is not 0, the composition of every stream back to back; and the
+ * offsets and values of the saveParameters() of every device.
+ * All values are stored in the native byte order of the machine that wrote them.
+ */
+struct SnapshotHeader
+{
+    static constexpr char MAGIC[8] = {'L', 'A', 'B', 'F', 'L', 'O', 'W', '\0'};
+    static constexpr uint32_t VERSION = 3;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;   ///< 0x01020304 as written, to reject foreign byte order.
+    uint64_t streamCount;
+    uint64_t deviceCount;
+    uint64_t inPortCount;
+    uint64_t outPortCount;
+    uint64_t tearCount;
+    uint64_t nameBytes;
+    uint64_t levelCount;
+    uint64_t componentCount; ///< Components tracked per stream; 0 for mass flows only.
+    uint64_t parameterCount; ///< Values saved by saveParameters() over all devices.
+};
+
+/**
+ * @struct SnapshotLayout
+ * @brief Byte offsets of the snapshot arrays, derived from the header counts.
+ */
+struct SnapshotLayout
+{
+    uint64_t flows, nameStarts, nameChars, types, parameters, order;
+    uint64_t inOffsets, inHandles, outOffsets, outHandles, tears;
+    uint64_t consumerOffsets, consumers, levelOffsets, levelEntries, compositions;
+    uint64_t parameterOffsets, parameterValues, total;
+
+    explicit SnapshotLayout(const SnapshotHeader& h) {
+        uint64_t at = sizeof(SnapshotHeader);
+        auto take = [&](uint64_t bytes) {
+          uint64_t start = at;
+          at = (at + bytes + 7) / 8 * 8;
+          return start;
+        };
+        flows = take(h.streamCount * sizeof(double));
+        nameStarts = take((h.streamCount + 1) * sizeof(uint32_t));
+        nameChars = take(h.nameBytes);
+        types = take(h.deviceCount * sizeof(uint32_t));
+        parameters = take(h.deviceCount * sizeof(uint32_t));
+        order = take(h.deviceCount * sizeof(uint32_t));
+        inOffsets = take((h.deviceCount + 1) * sizeof(uint32_t));
+        inHandles = take(h.inPortCount * sizeof(uint32_t));
+        outOffsets = take((h.deviceCount + 1) * sizeof(uint32_t));
+        outHandles = take(h.outPortCount * sizeof(uint32_t));
+        tears = take(h.tearCount * sizeof(uint32_t));
+        consumerOffsets = take((h.streamCount + 1) * sizeof(uint32_t));
+        consumers = take(h.inPortCount * sizeof(uint32_t));
+        levelOffsets = take((h.levelCount + 1) * sizeof(uint32_t));
+        levelEntries = take(h.deviceCount * sizeof(uint32_t));
+        compositions = take(h.streamCount * h.componentCount * sizeof(double));
+        parameterOffsets = take((h.deviceCount + 1) * sizeof(uint32_t));
+        parameterValues = take(h.parameterCount * sizeof(double));
+        total = at;
+    }
+};
+
+/**
+ * @class MappedSnapshot
+ * @brief A flowsheet snapshot mapped into memory and validated before any array is used.
+ *
+ * The constructor checks every count, offset array and index, so a corrupt file is
+ * rejected instead of being read out of bounds later. The mapping is private, so flows
+ * can be changed through flows() without touching the file.
+ */
+class MappedSnapshot
+{
+private:
+    char* base = nullptr;
+    size_t length = 0;
+    SnapshotLayout arrays{SnapshotHeader{}}; ///< Offsets of the arrays, valid once the header is checked.
+
+    template <class T>
+    T* at(uint64_t offset) const {return reinterpret_cast<T*>(base + offset);}
+
+    /**
+     * @brief Check that offsets start at 0, never decrease and end at end.
+     */
+    static bool isOffsets(const uint32_t* offsets, uint64_t count, uint64_t end) {
+        if (offsets[0] != 0 || offsets[count] != end) return false;
+        for (uint64_t i = 0; i < count; i++) {
+          if (offsets[i] > offsets[i + 1]) return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Check that every value is below limit.
+     */
+    static bool isBelow(const uint32_t* values, uint64_t count, uint64_t limit) {
+        for (uint64_t i = 0; i < count; i++) {
+          if (values[i] >= limit) return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Check the counts against the file size, then every offset array and index.
+     */
+    bool isConsistent() {
+        const SnapshotHeader& h = header();
+        // Every entry takes at least one byte, so counts above the file size are corrupt; this
+        // also keeps the layout sums far from overflowing.
+        for (uint64_t count : {h.streamCount, h.deviceCount, h.inPortCount, h.outPortCount,
+                               h.tearCount, h.nameBytes, h.levelCount, h.parameterCount}) {
+          if (count > length || count >= UINT32_MAX) return false;
+        }
+        if (h.componentCount > length || (h.componentCount && h.streamCount > length / h.componentCount)) return false;
+        arrays = SnapshotLayout(h);
+        if (arrays.total > length) return false;
+        if (!isOffsets(nameStarts(), h.streamCount, h.nameBytes) || !isOffsets(inOffsets(), h.deviceCount, h.inPortCount)
+            || !isOffsets(outOffsets(), h.deviceCount, h.outPortCount)
+            || !isOffsets(consumerOffsets(), h.streamCount, h.inPortCount)
+            || !isOffsets(levelOffsets(), h.levelCount, h.deviceCount)
+            || !isOffsets(parameterOffsets(), h.deviceCount, h.parameterCount)) {
+          return false;
+        }
+        if (!isBelow(inHandles(), h.inPortCount, h.streamCount) || !isBelow(outHandles(), h.outPortCount, h.streamCount)
+            || !isBelow(tears(), h.tearCount, h.streamCount) || !isBelow(consumers(), h.inPortCount, h.deviceCount)
+            || !isBelow(levelEntries(), h.deviceCount, h.deviceCount) || !isBelow(order(), h.deviceCount, h.deviceCount)) {
+          return false;
+        }
+        vector<char> seen(h.deviceCount, 0);
+        for (uint64_t k = 0; k < h.deviceCount; k++) {
+          if (seen[order()[k]]++) return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Check the magic, byte order and version of the mapped file, then its arrays.
+     */
+    DeviceError checkHeader() {
+        const SnapshotHeader& h = header();
+        if (memcmp(h.magic, SnapshotHeader::MAGIC, sizeof(h.magic)) != 0 || h.byteOrder != 0x01020304) {
+          return DeviceError::NotSnapshot;
+        }
+        if (h.version != SnapshotHeader::VERSION) return DeviceError::SnapshotVersion;
+        if (!isConsistent()) return DeviceError::CorruptSnapshot;
+        return DeviceError::None;
+    }
+
+    void unmap() {
+        if (base) munmap(base, length);
+        base = nullptr;
+        length = 0;
+    }
+
+public:
+    /**
+     * @brief Create an empty snapshot; map() a file before using it.
+     */
+    MappedSnapshot() = default;
+
+    /**
+     * @brief Map a snapshot file and check its header, size and arrays, throwing on failure.
+     * @param path The snapshot file.
+     */
+    explicit MappedSnapshot(const string& path) {
+        map(path).orThrow();
+    }
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    ~MappedSnapshot() {unmap();}
+
+    /**
+     * @brief Map a snapshot file and check its header, size and arrays.
+     *
+     * Any file mapped before is released first; on failure nothing stays mapped.
+     * @param path The snapshot file.
+     */
+    Status map(const string& path) {
+        unmap();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return DeviceError::CannotOpenSnapshot;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(SnapshotHeader)) {
+          close(fd);
+          return DeviceError::NotSnapshot;
+        }
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) return DeviceError::CannotMapSnapshot;
+        base = static_cast<char*>(mapped);
+        length = info.st_size;
+
+        DeviceError error = checkHeader();
+        if (error != DeviceError::None) unmap();
+        return error;
+    }
+
+    /**
+     * @brief Check whether a snapshot is mapped.
+     */
+    bool isMapped() const {return base != nullptr;}
+
+    const SnapshotHeader& header() const {return *at<SnapshotHeader>(0);}
+
+    double* flows() const {return at<double>(arrays.flows);}
+    const uint32_t* nameStarts() const {return at<uint32_t>(arrays.nameStarts);}
+    const char* nameChars() const {return at<char>(arrays.nameChars);}
+    const uint32_t* types() const {return at<uint32_t>(arrays.types);}
+    const uint32_t* parameters() const {return at<uint32_t>(arrays.parameters);}
+    const DeviceHandle* order() const {return at<DeviceHandle>(arrays.order);}
+    const uint32_t* inOffsets() const {return at<uint32_t>(arrays.inOffsets);}
+    const StreamHandle* inHandles() const {return at<StreamHandle>(arrays.inHandles);}
+    const uint32_t* outOffsets() const {return at<uint32_t>(arrays.outOffsets);}
+    const StreamHandle* outHandles() const {return at<StreamHandle>(arrays.outHandles);}
+    const StreamHandle* tears() const {return at<StreamHandle>(arrays.tears);}
+    const uint32_t* consumerOffsets() const {return at<uint32_t>(arrays.consumerOffsets);}
+    const uint32_t* consumers() const {return at<uint32_t>(arrays.consumers);}
+    const uint32_t* levelOffsets() const {return at<uint32_t>(arrays.levelOffsets);}
+    const uint32_t* levelEntries() const {return at<uint32_t>(arrays.levelEntries);}
+    const double* compositions() const {return at<double>(arrays.compositions);}
+    const uint32_t* parameterOffsets() const {return at<uint32_t>(arrays.parameterOffsets);}
+    const double* parameterValues() const {return at<double>(arrays.parameterValues);}
+
+    /**
+     * @brief Get the saveParameters() values of a device.
+     */
+    span<const double> parametersOf(size_t d) const {
+        return span<const double>(parameterValues() + parameterOffsets()[d], parameterOffsets()[d + 1] - parameterOffsets()[d]);
+    }
+};
+
+/**
+ * @class PublishedStreams
+ * @brief Double-buffered, seqlock-protected copy of stream mass flows for concurrent readers.
+ *
+ * One writer (the solving thread) publishes whole tables; any number of readers copy a
+ * consistent table without locks. The writer never waits for readers: it fills the buffer
+ * readers are not directed to and then flips the buffer index. A reader that was still
+ * copying a buffer being overwritten sees its sequence number change and retries.
+ * The capacity is fixed at construction, so buffers never move under a reader.
+ */
+class PublishedStreams
+{
+private:
+    struct Buffer
+    {
+        atomic<uint64_t> sequence{0};        ///< Odd while the buffer is being written.
+        atomic<uint64_t> version{0};         ///< Publication the buffer holds.
+        atomic<size_t> count{0};             ///< Number of streams published.
+        unique_ptr<atomic<double>[]> flows;
+    };
+
+    size_t capacity;
+    Buffer buffers[2];
+    atomic<uint32_t> current{0}; ///< Buffer holding the latest publication.
+    uint64_t published = 0;      ///< Publications so far; written by the writer only.
+
+public:
+    /**
+     * @param streamCount Largest number of streams that will be published.
+     */
+    explicit PublishedStreams(size_t streamCount): capacity(streamCount) {
+        for (Buffer& b : buffers) {
+          b.flows = make_unique<atomic<double>[]>(capacity);
+          for (size_t i = 0; i < capacity; i++) b.flows[i].store(0.0, memory_order_relaxed);
+        }
+    }
+
+    PublishedStreams(const PublishedStreams&) = delete;
+    PublishedStreams& operator=(const PublishedStreams&) = delete;
+
+    size_t getCapacity() const {return capacity;}
+
+    /**
+     * @brief Publish mass flows; streams beyond the capacity are left out. Single writer only.
+     */
+    void publish(const double* flows, size_t count) {
+        count = min(count, capacity);
+        uint32_t next = 1 - current.load(memory_order_relaxed);
+        Buffer& b = buffers[next];
+        uint64_t sequence = b.sequence.load(memory_order_relaxed);
+        b.sequence.store(sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        for (size_t i = 0; i < count; i++) b.flows[i].store(flows[i], memory_order_relaxed);
+        b.count.store(count, memory_order_relaxed);
+        b.version.store(++published, memory_order_relaxed);
+        b.sequence.store(sequence + 2, memory_order_release);
+        current.store(next, memory_order_release);
+    }
+
+    /**
+     * @brief Copy the latest publication without blocking the writer.
+     * @param out Receives the mass flows; resized to the published stream count.
+     * @return The number of the publication that was copied, 0 if nothing was published yet.
+     */
+    uint64_t read(vector<double>& out) const {
+        while (true) {
+          const Buffer& b = buffers[current.load(memory_order_acquire)];
+          uint64_t before = b.sequence.load(memory_order_acquire);
+          if (before & 1) continue;
+          size_t count = b.count.load(memory_order_relaxed);
+          out.resize(count);
+          for (size_t i = 0; i < count; i++) out[i] = b.flows[i].load(memory_order_relaxed);
+          uint64_t version = b.version.load(memory_order_relaxed);
+          atomic_thread_fence(memory_order_acquire);
+          if (b.sequence.load(memory_order_relaxed) == before) return version;
+        }
+    }
+
+    /**
+     * @brief Read one mass flow of the latest publication.
+     */
+    double getMassFlow(StreamHandle s) const {
+        return buffers[current.load(memory_order_acquire)].flows[s].load(memory_order_relaxed);
+    }
+};
+
+/**
+ * @struct Partitioning
+ * @brief Assignment of the devices of a flowsheet to partitions, such as cluster nodes.
+ */
+struct Partitioning
+{
+    size_t parts = 0;
+    vector<uint32_t> partOf;         ///< Partition of every device, indexed by device handle.
+    vector<StreamHandle> cutStreams; ///< Streams produced in one partition and read in another.
+};
+
+/**
+ * @class BoundaryTransport
+ * @brief Carries boundary-stream values between partitions; implement it over MPI or sockets.
+ *
+ * Messages between two partitions must arrive in the order they were sent.
+ */
+class BoundaryTransport
+{
+public:
+    virtual ~BoundaryTransport() = default;
+
+    /**
+     * @brief Send values from one partition to another without waiting for the receiver.
+     */
+    virtual void send(uint32_t from, uint32_t to, vector<double> values) = 0;
+
+    /**
+     * @brief Wait for the next message sent from one partition to another.
+     */
+    virtual vector<double> receive(uint32_t to, uint32_t from) = 0;
+};
+
+/**
+ * @class LoopbackTransport
+ * @brief In-process BoundaryTransport for partitions running on threads of one machine.
+ */
+class LoopbackTransport : public BoundaryTransport
+{
+private:
+    mutex channelsMutex;
+    condition_variable channelsChanged;
+    unordered_map<uint64_t, deque<vector<double>>> channels; ///< Pending messages by (from, to).
+    atomic<uint64_t> messages{0};
+
+    static uint64_t channel(uint32_t from, uint32_t to) {return uint64_t(from) << 32 | to;}
+
+public:
+    void send(uint32_t from, uint32_t to, vector<double> values) override {
+        lock_guard<mutex> lock(channelsMutex);
+        channels[channel(from, to)].push_back(std::move(values));
+        messages++;
+        channelsChanged.notify_all();
+    }
+
+    vector<double> receive(uint32_t to, uint32_t from) override {
+        unique_lock<mutex> lock(channelsMutex);
+        deque<vector<double>>& pending = channels[channel(from, to)];
+        channelsChanged.wait(lock, [&]{ return !pending.empty(); });
+        vector<double> values = std::move(pending.front());
+        pending.pop_front();
+        return values;
+    }
+
+    /**
+     * @brief Get the number of messages sent so far.
+     */
+    uint64_t messageCount() const {return messages.load();}
+};
+
+#ifdef DEVICE_PROFILE
+/**
+ * @struct DeviceCounters
+ * @brief Profiling counters of one device.
+ */
+struct DeviceCounters
+{
+    uint64_t calls = 0;        ///< Evaluations of the device.
+    uint64_t nanoseconds = 0;  ///< Wall time spent in those evaluations.
+    uint64_t recycleCalls = 0; ///< Evaluations made while iterating on tear streams.
+};
+
+/**
+ * @class DeviceProfile
+ * @brief Per-thread device counters of one flowsheet, merged on demand.
+ *
+ * Every thread that evaluates devices gets its own table, found through a thread_local
+ * cache, so counting never contends. Only built with -DDEVICE_PROFILE; without it the
+ * flowsheet has no counters and no timing code at all.
+ */
+class DeviceProfile
+{
+private:
+    struct ThreadTable
+    {
+        vector<DeviceCounters> counters; ///< Indexed by device handle.
+    };
+
+    inline static atomic<uint64_t> nextSerial{1};
+    uint64_t serial = nextSerial++; ///< Distinguishes profiles reusing the address of a destroyed one.
+    mutable mutex tablesMutex;
+    vector<unique_ptr<ThreadTable>> tables;
+
+    ThreadTable& table() {
+        thread_local uint64_t cachedSerial = 0;
+        thread_local ThreadTable* cached = nullptr;
+        if (cachedSerial != serial) {
+          lock_guard<mutex> lock(tablesMutex);
+          tables.push_back(make_unique<ThreadTable>());
+          cached = tables.back().get();
+          cachedSerial = serial;
+        }
+        return *cached;
+    }
+
+public:
+    DeviceProfile() = default;
+    DeviceProfile(const DeviceProfile&) = delete;
+    DeviceProfile& operator=(const DeviceProfile&) = delete;
+
+    /**
+     * @brief Count one evaluation of a device in the calling thread's table.
+     */
+    void record(DeviceHandle d, uint64_t nanoseconds, bool recycling) {
+        ThreadTable& t = table();
+        if (d >= t.counters.size()) t.counters.resize(d + 1);
+        DeviceCounters& c = t.counters[d];
+        c.calls++;
+        c.nanoseconds += nanoseconds;
+        c.recycleCalls += recycling;
+    }
+
+    /**
+     * @brief Sum the tables of all threads; call it while no solve is running.
+     * @param deviceCount Number of devices to report.
+     */
+    vector<DeviceCounters> merge(size_t deviceCount) const {
+        vector<DeviceCounters> total(deviceCount);
+        lock_guard<mutex> lock(tablesMutex);
+        for (const auto& t : tables) {
+          for (size_t d = 0; d < min(deviceCount, t->counters.size()); d++) {
+            total[d].calls += t->counters[d].calls;
+            total[d].nanoseconds += t->counters[d].nanoseconds;
+            total[d].recycleCalls += t->counters[d].recycleCalls;
+          }
+        }
+        return total;
+    }
+
+    /**
+     * @brief Zero every counter; call it while no solve is running.
+     */
+    void reset() {
+        lock_guard<mutex> lock(tablesMutex);
+        for (auto& t : tables) t->counters.assign(t->counters.size(), DeviceCounters());
+    }
+};
+
+/**
+ * @class ProfileScope
+ * @brief Times one device evaluation and records it when the scope ends.
+ */
+class ProfileScope
+{
+    DeviceProfile& profile;
+    DeviceHandle device;
+    bool recycling;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+public:
+    ProfileScope(DeviceProfile& p, DeviceHandle d, bool inRecycle): profile(p), device(d), recycling(inRecycle) {}
+    ~ProfileScope() {
+        auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start);
+        profile.record(device, elapsed.count(), recycling);
+    }
+};
+#endif
+
+/**
+ * @struct SimulationReport
+ * @brief Outcome of a time-series simulation.
+ */
+struct SimulationReport
+{
+    size_t steps = 0;            ///< Time steps simulated.
+    size_t iterations = 0;       ///< Evaluation sweeps over all steps.
+    size_t unconvergedSteps = 0; ///< Steps whose recycles did not reach the tolerance.
+    double worstResidual = 0;    ///< Largest final residual of any step.
+};
+
+/**
+ * @struct HistoryChunkHeader
+ * @brief Header of one chunk of a stream history, a block of consecutive time steps.
+ *
+ * The header is followed by streamCount columns of steps doubles; column s holds the
+ * mass flow of stream s at every step of the chunk.
+ */
+struct HistoryChunkHeader
+{
+    static constexpr char MAGIC[8] = {'L', 'A', 'B', 'H', 'I', 'S', 'T', '\0'};
+    static constexpr uint64_t MAX_VALUES = uint64_t(1) << 27; ///< Largest chunk, 1 GiB of doubles.
+
+    char magic[8];
+    uint32_t byteOrder;   ///< 0x01020304 as written, to reject foreign byte order.
+    uint32_t steps;       ///< Time steps in the chunk.
+    uint64_t streamCount;
+    uint64_t firstStep;   ///< Index of the first time step of the chunk.
+};
+
+/**
+ * @class HistorySink
+ * @brief Destination of stream history chunks, such as a file or a socket.
+ */
+class HistorySink
+{
+public:
+    virtual ~HistorySink() = default;
+
+    /**
+     * @brief Write all bytes or throw.
+     */
+    virtual void write(const char* data, size_t bytes) = 0;
+};
+
+/**
+ * @class DescriptorSink
+ * @brief Writes history chunks to an open file descriptor, such as a connected socket.
+ */
+class DescriptorSink : public HistorySink
+{
+protected:
+    int fd;
+
+public:
+    explicit DescriptorSink(int descriptor): fd(descriptor) {}
+
+    void write(const char* data, size_t bytes) override {
+        while (bytes > 0) {
+          ssize_t written = ::write(fd, data, bytes);
+          if (written < 0 && errno == EINTR) continue;
+          if (written <= 0) throwError(DeviceError::CannotWriteHistory);
+          data += written;
+          bytes -= written;
+        }
+    }
+};
+
+/**
+ * @class FileSink
+ * @brief Writes history chunks to a new file that it owns.
+ */
+class FileSink : public DescriptorSink
+{
+public:
+    explicit FileSink(const string& path): DescriptorSink(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) {
+        if (fd < 0) throwError(DeviceError::CannotCreateHistory);
+    }
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+    ~FileSink() override {close(fd);}
+};
+
+/**
+ * @class HistoryWriter
+ * @brief Gathers the stream values of every step into columnar chunks and streams them to a sink.
+ *
+ * Chunks cycle through a fixed ring. A writer thread drains full chunks to the sink while
+ * the next ones fill, and append() only waits when every chunk of the ring is still
+ * queued, so memory stays at ring size times chunk size however long the run is.
+ */
+class HistoryWriter
+{
+private:
+    struct Chunk
+    {
+        HistoryChunkHeader header;
+        vector<double> values; ///< Column of stream s starts at s * chunkSteps while filling.
+    };
+
+    HistorySink& sink;
+    size_t streamTotal;
+    size_t chunkSteps;
+    vector<Chunk> ring;
+    size_t recorded = 0;  ///< Steps appended so far.
+    size_t fill = 0;      ///< Steps in the chunk being filled.
+    size_t queued = 0;    ///< Chunks handed to the writer thread; the next one fills ring[queued % size].
+    size_t written = 0;   ///< Chunks the writer thread is done with.
+    bool closing = false;
+    exception_ptr failure; ///< First error of the sink, rethrown to the producer.
+    mutex lock;
+    condition_variable changed;
+    thread writer;
+
+    void drain() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+          changed.wait(guard, [&]{ return written < queued || closing; });
+          if (written == queued) return;
+          Chunk& chunk = ring[written % ring.size()];
+          bool failed = failure != nullptr;
+          guard.unlock();
+          exception_ptr error;
+          if (!failed) {
+            try {
+              sink.write(reinterpret_cast<const char*>(&chunk.header), sizeof(chunk.header));
+              sink.write(reinterpret_cast<const char*>(chunk.values.data()),
+                         streamTotal * chunk.header.steps * sizeof(double));
+            } catch (...) {
+              error = current_exception();
+            }
+          }
+          guard.lock();
+          if (error) failure = error;
+          written++;
+          changed.notify_all();
+        }
+    }
+
+    /**
+     * @brief Hand the chunk being filled to the writer thread.
+     */
+    void submit() {
+        Chunk& chunk = ring[queued % ring.size()];
+        memcpy(chunk.header.magic, HistoryChunkHeader::MAGIC, sizeof(chunk.header.magic));
+        chunk.header.byteOrder = 0x01020304;
+        chunk.header.steps = fill;
+        chunk.header.streamCount = streamTotal;
+        chunk.header.firstStep = recorded - fill;
+        // A short last chunk is packed so its columns are fill values apart.
+        for (size_t s = 1; fill < chunkSteps && s < streamTotal; s++) {
+          memmove(chunk.values.data() + s * fill, chunk.values.data() + s * chunkSteps, fill * sizeof(double));
+        }
+        fill = 0;
+        lock_guard<mutex> guard(lock);
+        queued++;
+        changed.notify_all();
+    }
+
+public:
+    /**
+     * @param s Destination of the chunks; must outlive the writer.
+     * @param streamCount Values recorded per step.
+     * @param stepsPerChunk Time steps gathered before a chunk is written; lowered so a chunk
+     *        holds at most HistoryChunkHeader::MAX_VALUES values.
+     * @param ringSize Chunks that may be filled or queued at the same time.
+     */
+    HistoryWriter(HistorySink& s, size_t streamCount, size_t stepsPerChunk = 256, size_t ringSize = 4)
+        : sink(s), streamTotal(streamCount),
+          chunkSteps(clamp<size_t>(stepsPerChunk, 1, max<size_t>(1, HistoryChunkHeader::MAX_VALUES / max<size_t>(1, streamCount)))),
+          ring(max<size_t>(1, ringSize)) {
+        for (Chunk& chunk : ring) chunk.values.resize(streamTotal * chunkSteps);
+        writer = thread([this]{ drain(); });
+    }
+    HistoryWriter(const HistoryWriter&) = delete;
+    HistoryWriter& operator=(const HistoryWriter&) = delete;
+
+    /**
+     * @brief Write the last partial chunk and stop the writer thread; errors are dropped here.
+     */
+    ~HistoryWriter() {
+        if (fill) submit();
+        {
+          lock_guard<mutex> guard(lock);
+          closing = true;
+        }
+        changed.notify_all();
+        writer.join();
+    }
+
+    size_t streamCount() const {return streamTotal;}
+    size_t steps() const {return recorded;}
+
+    /**
+     * @brief Record the values of one time step.
+     * @param values One value per stream.
+     */
+    void append(const double* values) {
+        if (fill == 0) {
+          unique_lock<mutex> guard(lock);
+          changed.wait(guard, [&]{ return queued - written < ring.size(); });
+          if (failure) rethrow_exception(failure);
+        }
+        double* column = ring[queued % ring.size()].values.data() + fill;
+        for (size_t s = 0; s < streamTotal; s++) column[s * chunkSteps] = values[s];
+        recorded++;
+        if (++fill == chunkSteps) submit();
+    }
+
+    /**
+     * @brief Write everything recorded so far, including a partial chunk, and wait for the sink.
+     */
+    void flush() {
+        if (fill) submit();
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]{ return written == queued; });
+        if (failure) rethrow_exception(failure);
+    }
+};
+
+/**
+ * @brief Read the next chunk of a stream history written by a HistoryWriter.
+ * @param values Receives the columns of the chunk, stream after stream.
+ * @return false at the end of the history.
+ * @throws DeviceError::NotHistory if the header is foreign or sizes a chunk above
+ *         HistoryChunkHeader::MAX_VALUES, checked before anything is allocated.
+ */
+bool readHistoryChunk(istream& in, HistoryChunkHeader& header, vector<double>& values) {
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+    if (memcmp(header.magic, HistoryChunkHeader::MAGIC, sizeof(header.magic)) != 0 || header.byteOrder != 0x01020304) {
+      throwError(DeviceError::NotHistory);
+    }
+    if (header.steps && header.streamCount > HistoryChunkHeader::MAX_VALUES / header.steps) throwError(DeviceError::NotHistory);
+    values.resize(header.streamCount * header.steps);
+    if (!in.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(double))) throwError(DeviceError::TruncatedHistory);
+    return true;
+}
+
+/**
+ * @class Flowsheet
+ * @brief Owns the devices and streams of a plant and evaluates them in topological order.
+ *
+ * Streams live in a StreamTable and devices are wired with stream handles. A device
+ * depends on every device that produces one of its input streams. The topological
+ * order and the flattened port lists are compiled once and reused until the wiring changes.
+ */
+class Flowsheet
+{
+private:
+    static constexpr DeviceHandle NO_DEVICE = UINT32_MAX;
+    static constexpr size_t SCENARIO_BLOCK = 512; ///< Scenario lanes swept through the plan together.
+
+    Arena deviceArena;                  ///< Storage of the devices built by addDevice<T>; outlives them.
+    StreamTable streams;                ///< Streams owned by the flowsheet.
+    vector<shared_ptr<Device>> devices; ///< Devices owned by the flowsheet.
+    vector<uint32_t> inputCounts;       ///< Connected inputs of every device.
+    vector<uint32_t> outputCounts;      ///< Connected outputs of every device.
+    vector<pair<DeviceHandle, StreamHandle>> inputEdges;  ///< Input connections in connection order.
+    vector<pair<DeviceHandle, StreamHandle>> outputEdges; ///< Output connections in connection order.
+    bool edgesFromPlan = false;         ///< Edges are only held in the compiled plan, as after loading a snapshot.
+
+    // Compiled plan: devices in topological order with their ports flattened.
+    vector<DeviceHandle> order;     ///< Devices in evaluation order.
+    vector<Device*> planDevices;    ///< Device of every plan entry.
+    vector<uint32_t> inOffsets;     ///< Start of the inputs of every plan entry in inHandles.
+    vector<uint32_t> outOffsets;    ///< Start of the outputs of every plan entry in outHandles.
+    vector<StreamHandle> inHandles;
+    vector<StreamHandle> outHandles;
+    vector<StreamHandle> tears;     ///< Streams torn to break recycle loops.
+    vector<uint32_t> levelOffsets;  ///< Start of every level in levelEntries.
+    vector<uint32_t> levelEntries;  ///< Plan entries grouped by level; entries of one level are independent.
+    bool compiled = false;
+    vector<double> splits;          ///< 1 / output count of every plan entry, filled by freeze().
+    bool frozen = false;            ///< Wiring validated; the plan runs the unchecked kernels.
+
+    WorkStealingPool* pool = nullptr; ///< Executor for level-parallel sweeps, serial if null.
+    PublishedStreams* publisher = nullptr; ///< Receives the mass flows after every solve, if set.
+    EvaluationCache* cache = nullptr;      ///< Results of deterministic devices, if set.
+    uint64_t cacheScope = nextVersion();   ///< Scope of this flowsheet's entries in the cache.
+    IdAllocator streamIds;                 ///< Numbers the streams of addStream().
+    AtomicIdAllocator* sharedStreamIds = nullptr; ///< Used instead of streamIds when streams are shared, if set.
+
+    // Dataflow schedule of solveAsync(); built per call from the compiled plan.
+    size_t asyncLimit = 0;                  ///< Devices allowed to wait on external calls at once; 0 when not async.
+    unique_ptr<AsyncScheduler> asyncScheduler; ///< asyncLimit workers, kept between sweeps and solves.
+    vector<AsyncDevice*> asyncDevices;      ///< Async device of every plan entry, null for the others.
+    vector<uint32_t> asyncDependencies;     ///< Entries that must finish before each entry may start.
+    vector<uint32_t> successorOffsets;      ///< Start of the successors of every entry in successors.
+    vector<uint32_t> successors;            ///< Entries waiting on each entry.
+    size_t grain = 64;                ///< Devices per parallel task.
+
+    // Recycle convergence settings.
+    ConvergenceMethod method = ConvergenceMethod::Wegstein;
+    double tolerance = POSSIBLE_ERROR;
+    size_t maxIterations = 500;
+    TearAccelerator accelerator;
+    ConvergenceReport lastReport;
+
+    // Direct solve of linear flowsheets, built by factorLinear().
+    SparseLU balance;                 ///< Factored mass balance, one row per produced stream.
+    bool factored = false;
+    bool singular = false;            ///< factorLinear() found the balance singular.
+    uint64_t factoredVersions = 0;    ///< parameterVersions() when the balance was last factored.
+    vector<uint32_t> feedOffsets;     ///< Start of the feed terms of every balance row in feedStreams.
+    vector<StreamHandle> feedStreams; ///< Streams no device produces, read into the right-hand side.
+    vector<double> feedCoefficients;  ///< Share of every feed term in its row.
+    vector<double> rightHandSides;    ///< Scratch for solveLinear().
+
+    // Change tracking for incremental recomputation.
+    vector<uint32_t> consumerOffsets; ///< Start of the consumers of every stream in streamConsumers.
+    vector<uint32_t> streamConsumers; ///< Plan entries reading each stream.
+    vector<uint8_t> dirty;            ///< Plan entries waiting for recomputation.
+    vector<uint32_t> dirtyQueue;      ///< Min-heap of dirty plan entries, so they run in topological order.
+    vector<double> previousOutputs;   ///< Scratch for detecting which outputs actually changed.
+    bool allDirty = true;             ///< Nothing has been solved since the last wiring change.
+
+#ifdef DEVICE_PROFILE
+    mutable DeviceProfile profile;    ///< Evaluation counters of every device.
+    bool recycling = false;           ///< A solve is iterating on tear streams.
+#endif
+
+    /**
+     * @brief Evaluate one entry of the compiled plan.
+     */
+    void evaluateEntry(size_t k, double* flows) {
+#ifdef DEVICE_PROFILE
+        ProfileScope scope(profile, order[k], recycling);
+#endif
+        const StreamHandle* in = inHandles.data() + inOffsets[k];
+        const StreamHandle* out = outHandles.data() + outOffsets[k];
+        size_t inCount = inOffsets[k + 1] - inOffsets[k];
+        size_t outCount = outOffsets[k + 1] - outOffsets[k];
+        size_t n = streams.componentCount();
+        if (cache && !n && planDevices[k]->isDeterministic()) {
+          thread_local vector<double> inFlows, outFlows;
+          inFlows.resize(inCount);
+          outFlows.resize(outCount);
+          for (size_t i = 0; i < inCount; i++) inFlows[i] = flows[in[i]];
+          if (cache->find(planDevices[k], inFlows.data(), inCount, outFlows.data(), outCount, cacheScope)) {
+            for (size_t i = 0; i < outCount; i++) flows[out[i]] = outFlows[i];
+            return;
+          }
+          if (frozen) planDevices[k]->evaluateValidated(flows, in, inCount, out, outCount, splits[k]);
+          else planDevices[k]->evaluate(flows, in, inCount, out, outCount);
+          for (size_t i = 0; i < outCount; i++) outFlows[i] = flows[out[i]];
+          cache->insert(planDevices[k], inFlows.data(), inCount, outFlows.data(), outCount, cacheScope);
+        }
+        else if (n) {
+          double* values = streams.compositionData();
+          planDevices[k]->evaluateComponents(values, n, in, inCount, out, outCount);
+          for (size_t i = 0; i < outCount; i++) {
+            const double* c = values + out[i] * n;
+            double total = 0;
+            for (size_t j = 0; j < n; j++) total += c[j];
+            flows[out[i]] = total;
+          }
+        }
+        else if (frozen) planDevices[k]->evaluateValidated(flows, in, inCount, out, outCount, splits[k]);
+        else planDevices[k]->evaluate(flows, in, inCount, out, outCount);
+    }
+
+    /**
+     * @brief Evaluate every device once, level by level on the pool if one is set.
+     */
+    void sweep(double* flows) {
+        if (asyncLimit) {
+          sweepAsync(flows);
+          return;
+        }
+        if (!pool) {
+          for (size_t k = 0; k < planDevices.size(); k++) evaluateEntry(k, flows);
+          return;
+        }
+        function<void(size_t, size_t)> body;
+        for (size_t l = 0; l + 1 < levelOffsets.size(); l++) {
+          const uint32_t* entries = levelEntries.data() + levelOffsets[l];
+          body = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) evaluateEntry(entries[i], flows);
+          };
+          pool->parallelFor(levelOffsets[l + 1] - levelOffsets[l], grain, body);
+        }
+    }
+
+    /**
+     * @brief Order the plan entries as a dataflow graph for sweepAsync().
+     *
+     * An entry waits for the producers of its inputs that come earlier in the plan, and
+     * the producer of a tear stream waits for the earlier entries reading the old value,
+     * so every stream is read and written in the same order as in a serial sweep.
+     */
+    void prepareAsync() {
+        size_t count = planDevices.size();
+        asyncDevices.resize(count);
+        for (size_t k = 0; k < count; k++) asyncDevices[k] = dynamic_cast<AsyncDevice*>(planDevices[k]);
+
+        vector<uint32_t> producer(streams.size(), UINT32_MAX);
+        for (uint32_t k = 0; k < count; k++) {
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) producer[outHandles[i]] = k;
+        }
+        vector<pair<uint32_t, uint32_t>> edges;
+        for (uint32_t k = 0; k < count; k++) {
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) {
+            StreamHandle s = outHandles[i];
+            for (uint32_t c = consumerOffsets[s]; c < consumerOffsets[s + 1]; c++) {
+              if (streamConsumers[c] > k) edges.emplace_back(k, streamConsumers[c]);
+            }
+          }
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) {
+            uint32_t p = producer[inHandles[i]];
+            if (p != UINT32_MAX && p > k) edges.emplace_back(k, p);
+          }
+        }
+
+        asyncDependencies.assign(count, 0);
+        successorOffsets.assign(count + 1, 0);
+        for (auto [from, to] : edges) {
+          asyncDependencies[to]++;
+          successorOffsets[from + 1]++;
+        }
+        for (size_t k = 0; k < count; k++) successorOffsets[k + 1] += successorOffsets[k];
+        successors.resize(edges.size());
+        vector<uint32_t> next(successorOffsets.begin(), successorOffsets.end() - 1);
+        for (auto [from, to] : edges) successors[next[from]++] = to;
+    }
+
+    /**
+     * @brief Evaluate every device once, starting each as soon as its inputs are ready.
+     *
+     * Synchronous devices run on the calling thread. Async devices that suspend on an
+     * external call stay in flight, at most asyncLimit at a time, while independent
+     * devices keep running; they are resumed on the calling thread when the call ends.
+     */
+    void sweepAsync(double* flows) {
+        size_t count = planDevices.size();
+        AsyncScheduler& scheduler = *asyncScheduler;
+        vector<DeviceTask> tasks(count);
+        vector<uint32_t> waiting(asyncDependencies);
+        deque<uint32_t> ready;
+        deque<uint32_t> queued; ///< Async entries waiting for a free slot.
+        size_t inFlight = 0;
+        exception_ptr error;
+        for (uint32_t k = 0; k < count; k++) {
+          if (waiting[k] == 0) ready.push_back(k);
+        }
+
+        auto finish = [&](uint32_t k) {
+          for (uint32_t i = successorOffsets[k]; i < successorOffsets[k + 1]; i++) {
+            if (--waiting[successors[i]] == 0) ready.push_back(successors[i]);
+          }
+        };
+        auto settle = [&](uint32_t k) {
+          auto h = tasks[k].get();
+          if (h.promise().error) {
+            if (!error) error = h.promise().error;
+          } else {
+            finish(k);
+          }
+          tasks[k] = DeviceTask();
+        };
+
+        while (true) {
+          while (!error && (!ready.empty() || (!queued.empty() && inFlight < asyncLimit))) {
+            if (!queued.empty() && inFlight < asyncLimit) {
+              ready.push_front(queued.front());
+              queued.pop_front();
+            }
+            uint32_t k = ready.front();
+            ready.pop_front();
+            if (!asyncDevices[k]) {
+              try {
+                evaluateEntry(k, flows);
+              } catch (...) {
+                error = current_exception();
+                break;
+              }
+              finish(k);
+              continue;
+            }
+            if (inFlight >= asyncLimit) {
+              queued.push_back(k);
+              continue;
+            }
+            tasks[k] = asyncDevices[k]->evaluateAsync(flows, inHandles.data() + inOffsets[k], inOffsets[k + 1] - inOffsets[k],
+                                                      outHandles.data() + outOffsets[k], outOffsets[k + 1] - outOffsets[k]);
+            auto h = tasks[k].get();
+            h.promise().scheduler = &scheduler;
+            h.promise().entry = k;
+            h.resume();
+            if (h.done()) settle(k);
+            else inFlight++;
+          }
+          if (inFlight == 0) break;
+
+          auto h = scheduler.wait();
+          h.resume();
+          if (h.done()) {
+            inFlight--;
+            settle(h.promise().entry);
+          }
+        }
+        if (error) rethrow_exception(error);
+    }
+
+    /**
+     * @brief Converge one block of scenario lanes; every block runs its own recycle iteration.
+     */
+    template <class T>
+    ConvergenceReport solveBlock(T* values, size_t stride, size_t lanes) const {
+        ConvergenceReport report;
+        auto sweepBlock = [&]() {
+          for (size_t k = 0; k < planDevices.size(); k++) {
+#ifdef DEVICE_PROFILE
+            ProfileScope scope(profile, order[k], !tears.empty());
+#endif
+            const StreamHandle* in = inHandles.data() + inOffsets[k];
+            const StreamHandle* out = outHandles.data() + outOffsets[k];
+            size_t inCount = inOffsets[k + 1] - inOffsets[k];
+            size_t outCount = outOffsets[k + 1] - outOffsets[k];
+            if constexpr (is_same_v<T, float>) {
+              planDevices[k]->evaluateColumnsReduced(values, stride, lanes, in, inCount, out, outCount);
+            } else if (frozen) {
+              planDevices[k]->evaluateColumnsValidated(values, stride, lanes, in, inCount, out, outCount, splits[k]);
+            } else {
+              planDevices[k]->evaluateColumns(values, stride, lanes, in, inCount, out, outCount);
+            }
+          }
+        };
+        if (tears.empty()) {
+          sweepBlock();
+          report.iterations = 1;
+          report.converged = true;
+          return report;
+        }
+
+        vector<double> x(tears.size() * lanes);
+        vector<double> g(x.size());
+        for (size_t i = 0; i < tears.size(); i++) {
+          for (size_t j = 0; j < lanes; j++) x[i * lanes + j] = values[tears[i] * stride + j];
+        }
+        TearAccelerator blockAccelerator;
+        blockAccelerator.reset(method, x.size());
+        while (report.iterations < maxIterations) {
+          for (size_t i = 0; i < tears.size(); i++) {
+            for (size_t j = 0; j < lanes; j++) values[tears[i] * stride + j] = x[i * lanes + j];
+          }
+          sweepBlock();
+          report.iterations++;
+
+          double residual = 0;
+          for (size_t i = 0; i < tears.size(); i++) {
+            for (size_t j = 0; j < lanes; j++) {
+              g[i * lanes + j] = values[tears[i] * stride + j];
+              residual = max(residual, abs(g[i * lanes + j] - x[i * lanes + j]));
+            }
+          }
+          report.residual = residual;
+          report.residuals.push_back(residual);
+          if (residual <= tolerance) {
+            report.converged = true;
+            break;
+          }
+          blockAccelerator.next(x, g);
+        }
+        return report;
+    }
+
+    /**
+     * @brief Body of solveScenarios() for double and float batches.
+     */
+    template <class T>
+    const ConvergenceReport& solveBatch(BasicScenarioBatch<T>& batch) {
+        if (!compiled) compile();
+        if (batch.streamCount() != streams.size()) throwError(DeviceError::BatchMismatch);
+
+        // Blocks keep the same bytes in cache whatever the scalar type.
+        const size_t blockLanes = SCENARIO_BLOCK * sizeof(double) / sizeof(T);
+        size_t width = batch.scenarios();
+        size_t blocks = (width + blockLanes - 1) / blockLanes;
+        vector<ConvergenceReport> reports(blocks);
+        function<void(size_t, size_t)> body = [&](size_t begin, size_t end) {
+          for (size_t b = begin; b < end; b++) {
+            size_t lanes = min(blockLanes, width - b * blockLanes);
+            reports[b] = solveBlock(batch.data() + b * blockLanes, width, lanes);
+          }
+        };
+        if (pool) pool->parallelFor(blocks, 1, body);
+        else body(0, blocks);
+
+        lastReport = ConvergenceReport();
+        lastReport.converged = true;
+        for (ConvergenceReport& report : reports) {
+          lastReport.converged = lastReport.converged && report.converged;
+          lastReport.residual = max(lastReport.residual, report.residual);
+          if (report.iterations > lastReport.iterations) {
+            lastReport.iterations = report.iterations;
+            lastReport.residuals = std::move(report.residuals);
+          }
+        }
+        return lastReport;
+    }
+
+    /**
+     * @brief Sum the parameter versions of the devices; any re-parameterisation increases it.
+     */
+    uint64_t parameterVersions() const {
+        uint64_t sum = 0;
+        for (const auto& device : devices) sum += device->parameterVersion();
+        return sum;
+    }
+
+    /**
+     * @brief Mark every device reading a stream as dirty.
+     */
+    void markConsumers(StreamHandle s) {
+        if (allDirty || s + 1 >= consumerOffsets.size()) return;
+        for (uint32_t c = consumerOffsets[s]; c < consumerOffsets[s + 1]; c++) {
+          uint32_t k = streamConsumers[c];
+          if (!dirty[k]) {
+            dirty[k] = 1;
+            dirtyQueue.push_back(k);
+            push_heap(dirtyQueue.begin(), dirtyQueue.end(), greater<uint32_t>());
+          }
+        }
+    }
+
+    /**
+     * @brief Group connections by device with a counting sort that keeps the connection order.
+     */
+    void groupPorts(const vector<pair<DeviceHandle, StreamHandle>>& edges, vector<uint32_t>& starts,
+                    vector<StreamHandle>& ports) const {
+        starts.assign(devices.size() + 1, 0);
+        for (const auto& edge : edges) starts[edge.first + 1]++;
+        for (size_t d = 0; d < devices.size(); d++) starts[d + 1] += starts[d];
+        ports.resize(edges.size());
+        vector<uint32_t> next(starts.begin(), starts.end() - 1);
+        for (const auto& edge : edges) ports[next[edge.first]++] = edge.second;
+    }
+
+    struct PortRange
+    {
+        const StreamHandle* first;
+        const StreamHandle* last;
+        const StreamHandle* begin() const {return first;}
+        const StreamHandle* end() const {return last;}
+    };
+
+    /**
+     * @brief Sort the devices topologically (Kahn's algorithm) and flatten their ports.
+     *
+     * When the sort stalls on a recycle loop, the pending inputs of one device in the
+     * loop are chosen as tear streams and the sort continues as if they were feeds.
+     */
+    void compile() {
+        vector<uint32_t> inputStarts, outputStarts;
+        vector<StreamHandle> inputPorts, outputPorts;
+        groupPorts(inputEdges, inputStarts, inputPorts);
+        groupPorts(outputEdges, outputStarts, outputPorts);
+        auto inputsOf = [&](DeviceHandle d) {
+          return PortRange{inputPorts.data() + inputStarts[d], inputPorts.data() + inputStarts[d + 1]};
+        };
+        auto outputsOf = [&](DeviceHandle d) {
+          return PortRange{outputPorts.data() + outputStarts[d], outputPorts.data() + outputStarts[d + 1]};
+        };
+
+        vector<DeviceHandle> producer(streams.size(), NO_DEVICE);
+        for (DeviceHandle d = 0; d < devices.size(); d++) {
+          for (StreamHandle s : outputsOf(d)) {
+            if (producer[s] != NO_DEVICE) throwError(DeviceError::SeveralProducers);
+            producer[s] = d;
+          }
+        }
+
+        vector<uint32_t> readerOffsets(streams.size() + 1, 0);
+        vector<uint32_t> indegree(devices.size(), 0);
+        for (DeviceHandle d = 0; d < devices.size(); d++) {
+          for (StreamHandle s : inputsOf(d)) {
+            readerOffsets[s + 1]++;
+            if (producer[s] != NO_DEVICE) indegree[d]++;
+          }
+        }
+        for (size_t i = 0; i < streams.size(); i++) readerOffsets[i + 1] += readerOffsets[i];
+        vector<DeviceHandle> readers(readerOffsets.back());
+        vector<uint32_t> fill(readerOffsets.begin(), readerOffsets.end() - 1);
+        for (DeviceHandle d = 0; d < devices.size(); d++) {
+          for (StreamHandle s : inputsOf(d)) readers[fill[s]++] = d;
+        }
+
+        // A stream is released once its producer is placed or once it is torn.
+        vector<uint8_t> released(streams.size(), 0);
+        auto release = [&](StreamHandle s) {
+          released[s] = 1;
+          for (uint32_t r = readerOffsets[s]; r < readerOffsets[s + 1]; r++) {
+            if (--indegree[readers[r]] == 0) order.push_back(readers[r]);
+          }
+        };
+
+        order.clear();
+        order.reserve(devices.size());
+        tears.clear();
+        for (DeviceHandle d = 0; d < devices.size(); d++) {
+          if (indegree[d] == 0) order.push_back(d);
+        }
+        size_t head = 0;
+        while (true) {
+          for (; head < order.size(); head++) {
+            for (StreamHandle s : outputsOf(order[head])) {
+              if (!released[s]) release(s);
+            }
+          }
+          if (order.size() == devices.size()) break;
+
+          // Stalled on a recycle: tear the pending inputs of the device with the fewest of them.
+          DeviceHandle pick = NO_DEVICE;
+          for (DeviceHandle d = 0; d < devices.size(); d++) {
+            if (indegree[d] > 0 && (pick == NO_DEVICE || indegree[d] < indegree[pick])) pick = d;
+          }
+          for (StreamHandle s : inputsOf(pick)) {
+            if (producer[s] != NO_DEVICE && !released[s]) {
+              tears.push_back(s);
+              release(s);
+            }
+          }
+        }
+
+        planDevices.clear();
+        inOffsets.assign(1, 0);
+        outOffsets.assign(1, 0);
+        inHandles.clear();
+        outHandles.clear();
+        for (DeviceHandle d : order) {
+          planDevices.push_back(devices[d].get());
+          inHandles.insert(inHandles.end(), inputsOf(d).begin(), inputsOf(d).end());
+          outHandles.insert(outHandles.end(), outputsOf(d).begin(), outputsOf(d).end());
+          inOffsets.push_back(inHandles.size());
+          outOffsets.push_back(outHandles.size());
+        }
+
+        indexPlan();
+        compiled = true;
+        frozen = false;
+        factored = false;
+        singular = false;
+    }
+
+    /**
+     * @brief Recreate the connection lists from the compiled plan before the wiring is changed.
+     */
+    void materializeEdges() {
+        if (!edgesFromPlan) return;
+        inputEdges.clear();
+        outputEdges.clear();
+        for (size_t k = 0; k < order.size(); k++) {
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) inputEdges.emplace_back(order[k], inHandles[i]);
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) outputEdges.emplace_back(order[k], outHandles[i]);
+        }
+        edgesFromPlan = false;
+    }
+
+    /**
+     * @brief Build the per-stream consumer index and the levels of the flattened plan.
+     */
+    void indexPlan() {
+        vector<uint32_t> fill;
+        consumerOffsets.assign(streams.size() + 1, 0);
+        for (StreamHandle s : inHandles) consumerOffsets[s + 1]++;
+        for (size_t i = 0; i < streams.size(); i++) consumerOffsets[i + 1] += consumerOffsets[i];
+        streamConsumers.resize(inHandles.size());
+        fill.assign(consumerOffsets.begin(), consumerOffsets.end() - 1);
+        for (uint32_t k = 0; k < planDevices.size(); k++) {
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) {
+            streamConsumers[fill[inHandles[i]]++] = k;
+          }
+        }
+        // Level of an entry: after the writers of its inputs and after the earlier readers of
+        // its outputs, so every level can run in parallel with the serial reads and writes.
+        vector<uint32_t> level(planDevices.size(), 0);
+        vector<int64_t> writerLevel(streams.size(), -1);
+        vector<int64_t> readerLevel(streams.size(), -1);
+        uint32_t levelCount = 0;
+        for (uint32_t k = 0; k < planDevices.size(); k++) {
+          int64_t l = 0;
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) l = max(l, writerLevel[inHandles[i]] + 1);
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) l = max(l, readerLevel[outHandles[i]] + 1);
+          level[k] = l;
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) readerLevel[inHandles[i]] = max(readerLevel[inHandles[i]], l);
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) writerLevel[outHandles[i]] = l;
+          levelCount = max<uint32_t>(levelCount, l + 1);
+        }
+        levelOffsets.assign(levelCount + 1, 0);
+        for (uint32_t l : level) levelOffsets[l + 1]++;
+        for (uint32_t l = 0; l < levelCount; l++) levelOffsets[l + 1] += levelOffsets[l];
+        levelEntries.resize(planDevices.size());
+        fill.assign(levelOffsets.begin(), levelOffsets.end() - 1);
+        for (uint32_t k = 0; k < planDevices.size(); k++) levelEntries[fill[level[k]]++] = k;
+
+        dirty.assign(planDevices.size(), 0);
+        dirtyQueue.clear();
+        allDirty = true;
+    }
+
+    /**
+     * @brief Append a span of connections of one device to its input or output connections.
+     *
+     * A full device reports its own inputLimitError() or outputLimitError().
+     */
+    Status connect(DeviceHandle d, span<const StreamHandle> s, bool input) {
+        if (d >= devices.size()) return DeviceError::UnknownDevice;
+        if (s.empty()) return {};
+        if (*max_element(s.begin(), s.end()) >= streams.size()) return DeviceError::UnknownStream;
+        vector<uint32_t>& counts = input ? inputCounts : outputCounts;
+        vector<pair<DeviceHandle, StreamHandle>>& edges = input ? inputEdges : outputEdges;
+        const Device& device = *devices[d];
+        if (counts[d] + s.size() > (input ? device.maxInputs() : device.maxOutputs())) {
+          return input ? device.inputLimitError() : device.outputLimitError();
+        }
+        materializeEdges();
+        size_t needed = edges.size() + s.size();
+        if (needed > edges.capacity()) edges.reserve(max(needed, 2 * edges.capacity()));
+        for (StreamHandle h : s) edges.emplace_back(d, h);
+        counts[d] += s.size();
+        compiled = false;
+        return {};
+    }
+
+    /**
+     * @brief Factor the balance unless the factors, or the singular verdict, of the last
+     *        factorLinear() still hold.
+     * @return false if the balance is singular and the caller has to iterate instead.
+     */
+    bool prepareLinear() {
+        if (compiled && parameterVersions() == factoredVersions && (factored || singular)) return factored;
+        Status status = factorLinear();
+        if (status.error() == DeviceError::SingularBalance) return false;
+        status.orThrow();
+        return true;
+    }
+
+public:
+    /**
+     * @brief Create a new stream owned by the flowsheet.
+     *
+     * The compiled plan indexes every stream, so it is rebuilt by the next solve.
+     * @return The handle of the new stream.
+     */
+    StreamHandle addStream() {
+        materializeEdges();
+        compiled = false;
+        int id = sharedStreamIds ? sharedStreamIds->next() : streamIds.next();
+        return streams.addUnique("s"+std::to_string(id));
+    }
+
+    /**
+     * @brief Create a new named stream owned by the flowsheet.
+     * @param name The name of the stream.
+     * @return The handle of the new stream.
+     */
+    StreamHandle addStream(string_view name) {
+        materializeEdges();
+        compiled = false;
+        return streams.add(name);
+    }
+
+    /**
+     * @brief Take ownership of a device.
+     * @param d A shared pointer to the device.
+     * @return The handle of the device.
+     */
+    DeviceHandle addDevice(shared_ptr<Device> d) {
+        materializeEdges();
+        devices.push_back(d);
+        inputCounts.push_back(0);
+        outputCounts.push_back(0);
+        compiled = false;
+        return devices.size() - 1;
+    }
+
+    /**
+     * @brief Construct a device in the flowsheet's arena and take ownership of it.
+     * @return The handle of the new device.
+     */
+    template <class T, class... Args>
+    DeviceHandle addDevice(Args&&... args) {
+        return addDevice(shared_ptr<Device>(deviceArena.makeShared<T>(std::forward<Args>(args)...)));
+    }
+
+    /**
+     * @brief Reserve room for a plant of known size so that building it does not reallocate.
+     */
+    void reserve(size_t streamCount, size_t deviceCount, size_t portCount) {
+        streams.reserve(streamCount, streamCount * 8);
+        devices.reserve(deviceCount);
+        inputCounts.reserve(deviceCount);
+        outputCounts.reserve(deviceCount);
+        inputEdges.reserve(portCount);
+        outputEdges.reserve(portCount);
+    }
+
+    /**
+     * @brief Get the number of blocks the device arena requested from the heap.
+     */
+    size_t arenaBlockCount() const {return deviceArena.blockCount();}
+
+    /**
+     * @brief Connect a stream to an input port of a device without throwing.
+     * @param d The handle of the device.
+     * @param s The handle of the input stream.
+     */
+    Status tryAddInput(DeviceHandle d, StreamHandle s) {
+        if (d >= devices.size()) return DeviceError::UnknownDevice;
+        if (s >= streams.size()) return DeviceError::UnknownStream;
+        if (inputCounts[d] >= devices[d]->maxInputs()) return devices[d]->inputLimitError();
+        materializeEdges();
+        inputCounts[d]++;
+        inputEdges.emplace_back(d, s);
+        compiled = false;
+        return {};
+    }
+
+    /**
+     * @brief Connect a stream to an output port of a device without throwing.
+     * @param d The handle of the device.
+     * @param s The handle of the output stream.
+     */
+    Status tryAddOutput(DeviceHandle d, StreamHandle s) {
+        if (d >= devices.size()) return DeviceError::UnknownDevice;
+        if (s >= streams.size()) return DeviceError::UnknownStream;
+        if (outputCounts[d] >= devices[d]->maxOutputs()) return devices[d]->outputLimitError();
+        materializeEdges();
+        outputCounts[d]++;
+        outputEdges.emplace_back(d, s);
+        compiled = false;
+        return {};
+    }
+
+    /**
+     * @brief Connect streams to the next input ports of a device in one call.
+     *
+     * The limit and the handles are checked once for the whole span and the connection
+     * list grows at most once, so wide devices are wired without per-port checks.
+     * Nothing is connected if a check fails.
+     * @param d The handle of the device.
+     * @param s The handles of the input streams, in port order.
+     */
+    Status tryAddInputs(DeviceHandle d, span<const StreamHandle> s) {
+        return connect(d, s, true);
+    }
+
+    /**
+     * @brief Connect streams to the next output ports of a device in one call, like tryAddInputs().
+     * @param d The handle of the device.
+     * @param s The handles of the output streams, in port order.
+     */
+    Status tryAddOutputs(DeviceHandle d, span<const StreamHandle> s) {
+        return connect(d, s, false);
+    }
+
+    /**
+     * @brief Connect a stream to an input port of a device.
+     * @param d The handle of the device.
+     * @param s The handle of the input stream.
+     */
+    void addInput(DeviceHandle d, StreamHandle s) {tryAddInput(d, s).orThrow();}
+
+    /**
+     * @brief Connect streams to the next input ports of a device.
+     * @param d The handle of the device.
+     * @param s The handles of the input streams, in port order.
+     */
+    void addInputs(DeviceHandle d, span<const StreamHandle> s) {tryAddInputs(d, s).orThrow();}
+
+    /**
+     * @brief Connect streams to the next output ports of a device.
+     * @param d The handle of the device.
+     * @param s The handles of the output streams, in port order.
+     */
+    void addOutputs(DeviceHandle d, span<const StreamHandle> s) {tryAddOutputs(d, s).orThrow();}
+
+    /**
+     * @brief Connect a stream to an output port of a device.
+     * @param d The handle of the device.
+     * @param s The handle of the output stream.
+     */
+    void addOutput(DeviceHandle d, StreamHandle s) {tryAddOutput(d, s).orThrow();}
+
+    /**
+     * @brief Check the wiring without compiling or throwing.
+     *
+     * Reports the first device whose ports cannot be updated, or the first stream
+     * written by several devices.
+     * @param offender If not null, receives the handle of the failing device.
+     */
+    Status validate(DeviceHandle* offender = nullptr) const {
+        for (DeviceHandle d = 0; d < devices.size(); d++) {
+          Status status = devices[d]->checkPorts(inputCounts[d], outputCounts[d]);
+          if (!status) {
+            if (offender) *offender = d;
+            return status;
+          }
+        }
+        if (edgesFromPlan) return {};
+        vector<DeviceHandle> producer(streams.size(), NO_DEVICE);
+        for (auto [d, s] : outputEdges) {
+          if (producer[s] != NO_DEVICE) {
+            if (offender) *offender = d;
+            return DeviceError::SeveralProducers;
+          }
+          producer[s] = d;
+        }
+        return {};
+    }
+
+    /**
+     * @brief Compile the plan unless the wiring is invalid.
+     */
+    Status tryCompile() {
+        Status status = validate();
+        if (status && !compiled) compile();
+        return status;
+    }
+
+    /**
+     * @brief Validate and compile the wiring once, then solve with the unchecked kernels.
+     *
+     * The split of every device is precomputed here, so evaluations neither check ports
+     * nor divide. Any change of the wiring thaws the flowsheet again.
+     */
+    Status freeze() {
+        Status status = tryCompile();
+        if (!status) return status;
+        splits.resize(planDevices.size());
+        for (size_t k = 0; k < planDevices.size(); k++) splits[k] = 1.0 / (outOffsets[k + 1] - outOffsets[k]);
+        frozen = true;
+        return status;
+    }
+
+    /**
+     * @brief Check whether the flowsheet still runs the validated plan of freeze().
+     */
+    bool isFrozen() const {return frozen && compiled;}
+
+    Device& getDevice(DeviceHandle d) {return *devices.at(d);}
+    size_t deviceCount() const {return devices.size();}
+    StreamTable& getStreams() {return streams;}
+    const StreamTable& getStreams() const {return streams;}
+
+    /**
+     * @brief Set the mass flow of a stream and mark the devices reading it as dirty.
+     * @param s The handle of the stream.
+     * @param m The new mass flow rate value.
+     */
+    void setMassFlow(StreamHandle s, double m) {
+        streams.setMassFlow(s, m);
+        markConsumers(s);
+    }
+
+    double getMassFlow(StreamHandle s) const {return streams.getMassFlow(s);}
+
+    /**
+     * @brief Track n component flows per stream; solve() then runs on compositions.
+     *
+     * Devices evaluate composition vectors and the mass flow of every output becomes the
+     * sum of its components. Recycles converge on the tear compositions and snapshots
+     * store the compositions. Scenario solves still cover mass flows only.
+     */
+    void setComponentCount(size_t n) {
+        streams.setComponentCount(n);
+        allDirty = true;
+    }
+
+    size_t componentCount() const {return streams.componentCount();}
+
+    /**
+     * @brief Set the component flows of a stream and mark the devices reading it as dirty.
+     */
+    void setComposition(StreamHandle s, const double* values) {
+        streams.setComposition(s, values);
+        markConsumers(s);
+    }
+
+    const double* getComposition(StreamHandle s) const {return streams.composition(s);}
+
+    /**
+     * @brief Get the devices in evaluation order, compiling the plan only if the wiring changed.
+     */
+    const vector<DeviceHandle>& getOrder() {
+        if (!compiled) compile();
+        return order;
+    }
+
+    /**
+     * @brief Check whether the compiled plan is valid for the current wiring.
+     */
+    bool isCompiled() const {return compiled;}
+
+    /**
+     * @brief Get the streams torn to break recycle loops in the compiled plan.
+     */
+    const vector<StreamHandle>& getTearStreams() {
+        if (!compiled) compile();
+        return tears;
+    }
+
+    /**
+     * @brief Configure how recycle loops are converged.
+     * @param m The acceleration method for the tear streams.
+     * @param tol Largest tear-stream change accepted as converged.
+     * @param iterations Upper bound on evaluation sweeps.
+     */
+    void setConvergence(ConvergenceMethod m, double tol = POSSIBLE_ERROR, size_t iterations = 500) {
+        method = m;
+        tolerance = tol;
+        maxIterations = iterations;
+    }
+
+    /**
+     * @brief Run full sweeps level-parallel on a thread pool.
+     *
+     * Devices of one level never touch the same stream, and levels keep the serial
+     * read/write order of every stream, so the results match the serial path bit for bit.
+     * @param p The pool, or nullptr for serial evaluation. The pool must outlive its use here.
+     * @param devicesPerTask Number of devices handed out per task.
+     */
+    void setExecutor(WorkStealingPool* p, size_t devicesPerTask = 64) {
+        pool = p;
+        grain = devicesPerTask;
+    }
+
+    /**
+     * @brief Publish the mass flows to concurrent readers after every solve and update.
+     * @param p The published copy, or nullptr to stop publishing. It must outlive its use here.
+     */
+    void setPublisher(PublishedStreams* p) {publisher = p;}
+
+    /**
+     * @brief Reuse results of deterministic devices whose inputs were seen before.
+     *
+     * One cache may be shared by several flowsheets, for instance one per scenario: the
+     * entries of each flowsheet are kept in a scope of their own, and devices that change
+     * their parameters, or reuse the address of a destroyed device, never see old results.
+     * Composition solves and scenario batches do not use it.
+     * @param c The cache, or nullptr to evaluate every device. It must outlive its use here.
+     */
+    void setCache(EvaluationCache* c) {cache = c;}
+
+    /**
+     * @brief Stop reusing every cached result of this flowsheet, e.g. after changing a
+     * device whose setters do not call markChanged(). Other flowsheets keep theirs.
+     */
+    void invalidateCache() {cacheScope = nextVersion();}
+
+    /**
+     * @brief Get the allocator numbering the streams of addStream(); each flowsheet has its own.
+     */
+    IdAllocator& getStreamIds() {return streamIds;}
+
+    /**
+     * @brief Number the streams of addStream() from an allocator shared with other flowsheets.
+     *
+     * Flowsheets built concurrently on different threads then still get distinct names.
+     * @param ids The allocator, or nullptr for the flowsheet's own. It must outlive its use here.
+     */
+    void shareStreamIds(AtomicIdAllocator* ids) {sharedStreamIds = ids;}
+
+    /**
+     * @brief Get the number of dependency levels of the compiled plan.
+     */
+    size_t levelCount() {
+        if (!compiled) compile();
+        return levelOffsets.size() - 1;
+    }
+
+#ifdef DEVICE_PROFILE
+    /**
+     * @brief Get the evaluation counters of every device, summed over all threads.
+     *
+     * Only available with -DDEVICE_PROFILE. Call it between solves.
+     * @return Counters indexed by device handle.
+     */
+    vector<DeviceCounters> getProfile() const {return profile.merge(devices.size());}
+
+    /**
+     * @brief Zero the evaluation counters of every device.
+     */
+    void resetProfile() {profile.reset();}
+#endif
+
+    /**
+     * @brief Check mass conservation of every device: sum of inputs minus sum of outputs.
+     *
+     * Residuals of all devices are reduced in one pass over the flattened plan, split
+     * across the pool when an executor is set. Offenders are only collected, in a second
+     * pass, when there are violations; a balanced plant costs a single sweep of additions.
+     * @param worst Maximum number of offenders to report.
+     * @param tolerance Largest accepted |residual|.
+     */
+    BalanceReport auditMassBalance(size_t worst = 5, double tolerance = POSSIBLE_ERROR) {
+        if (!compiled) compile();
+        const double* flows = streams.data();
+        size_t count = planDevices.size();
+        auto residual = [&](size_t k) {
+          double balance = 0;
+          for (uint32_t i = inOffsets[k]; i < inOffsets[k + 1]; i++) balance += flows[inHandles[i]];
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) balance -= flows[outHandles[i]];
+          return balance;
+        };
+        atomic<size_t> violations{0};
+        atomic<double> largest{0.0};
+
+        function<void(size_t, size_t)> body = [&](size_t begin, size_t end) {
+          size_t localViolations = 0;
+          double localLargest = 0;
+          for (size_t k = begin; k < end; k++) {
+            double balance = abs(residual(k));
+            localViolations += balance > tolerance;
+            localLargest = max(localLargest, balance);
+          }
+          violations += localViolations;
+          double seen = largest.load();
+          while (seen < localLargest && !largest.compare_exchange_weak(seen, localLargest)) {}
+        };
+        if (pool) pool->parallelFor(count, max<size_t>(grain, 4096), body);
+        else body(0, count);
+
+        BalanceReport report;
+        report.worstResidual = largest.load();
+        report.violations = violations.load();
+        if (report.violations == 0) return report;
+
+        vector<pair<double, uint32_t>> offenders;
+        offenders.reserve(report.violations);
+        for (uint32_t k = 0; k < count; k++) {
+          double balance = residual(k);
+          if (abs(balance) > tolerance) offenders.emplace_back(balance, k);
+        }
+        size_t shown = min(worst, offenders.size());
+        partial_sort(offenders.begin(), offenders.begin() + shown, offenders.end(), [](const auto& a, const auto& b) {
+          return abs(a.first) > abs(b.first);
+        });
+        for (size_t i = 0; i < shown; i++) report.offenders.emplace_back(order[offenders[i].second], offenders[i].first);
+        return report;
+    }
+
+    /**
+     * @brief Get the report of the last solve.
+     */
+    const ConvergenceReport& getLastReport() const {return lastReport;}
+
+    /**
+     * @brief Evaluate the whole plant, iterating over the tear streams until recycles converge.
+     *
+     * Without recycles this is a single topological pass. Otherwise every sweep takes the
+     * tear-stream guesses x, evaluates the plant to get g(x) and lets the accelerator pick
+     * the next guess, until max|g(x) - x| is within tolerance.
+     * @return Iteration count, residuals and whether the tear streams converged.
+     */
+    const ConvergenceReport& solve() {
+        if (!compiled) compile();
+        double* flows = streams.data();
+        lastReport = ConvergenceReport();
+
+        if (tears.empty()) {
+          sweep(flows);
+          lastReport.iterations = 1;
+          lastReport.converged = true;
+        } else {
+          // Tear values are the mass flows, or the composition vectors when components are tracked.
+          size_t width = max<size_t>(1, streams.componentCount());
+          double* values = streams.componentCount() ? streams.compositionData() : flows;
+          vector<double> x(tears.size() * width);
+          vector<double> g(x.size());
+          for (size_t i = 0; i < tears.size(); i++) {
+            memcpy(x.data() + i * width, values + tears[i] * width, width * sizeof(double));
+          }
+          accelerator.reset(method, x.size());
+#ifdef DEVICE_PROFILE
+          recycling = true;
+#endif
+
+          while (lastReport.iterations < maxIterations) {
+            for (size_t i = 0; i < tears.size(); i++) {
+              memcpy(values + tears[i] * width, x.data() + i * width, width * sizeof(double));
+            }
+            sweep(flows);
+            lastReport.iterations++;
+
+            double residual = 0;
+            for (size_t i = 0; i < tears.size(); i++) {
+              for (size_t j = 0; j < width; j++) {
+                g[i * width + j] = values[tears[i] * width + j];
+                residual = max(residual, abs(g[i * width + j] - x[i * width + j]));
+              }
+            }
+            lastReport.residual = residual;
+            lastReport.residuals.push_back(residual);
+            if (residual <= tolerance) {
+              lastReport.converged = true;
+              break;
+            }
+            accelerator.next(x, g);
+          }
+#ifdef DEVICE_PROFILE
+          recycling = false;
+#endif
+        }
+
+        for (uint32_t k : dirtyQueue) dirty[k] = 0;
+        dirtyQueue.clear();
+        allDirty = false;
+        if (publisher) publisher->publish(flows, streams.size());
+        return lastReport;
+    }
+
+    /**
+     * @brief Solve like solve(), overlapping devices that wait on external calls.
+     *
+     * Every sweep schedules the plan as a dataflow graph: a device starts once the devices
+     * it depends on are done, async devices that suspend leave the thread free for the
+     * rest of the plant, and at most maxInFlight of them wait at the same time. Results
+     * are the same as a serial solve. The executor set with setExecutor() is not used.
+     * External calls run on maxInFlight worker threads, started on first use and kept
+     * until the flowsheet is destroyed or solveAsync() is called with another limit.
+     * @param maxInFlight Largest number of suspended async devices.
+     */
+    const ConvergenceReport& solveAsync(size_t maxInFlight) {
+        if (!compiled) compile();
+        prepareAsync();
+        asyncLimit = max<size_t>(1, maxInFlight);
+        if (!asyncScheduler || asyncScheduler->workerCount() != asyncLimit) {
+          asyncScheduler = make_unique<AsyncScheduler>(asyncLimit);
+        }
+        try {
+          solve();
+        } catch (...) {
+          asyncLimit = 0;
+          throw;
+        }
+        asyncLimit = 0;
+        return lastReport;
+    }
+
+    /**
+     * @brief Split the devices into partitions of similar size with few cut streams.
+     *
+     * Devices are ordered depth-first along the stream connections, so chains of devices
+     * stay together, and the order is cut into contiguous chunks of equal device count.
+     * @param parts Number of partitions.
+     */
+    Partitioning partition(size_t parts) {
+        if (!compiled) compile();
+        size_t count = planDevices.size();
+        parts = max<size_t>(1, min(parts, max<size_t>(1, count)));
+
+        // Readers of every device's outputs, then a depth-first order along them.
+        vector<uint32_t> nextOffsets(count + 1, 0), nexts;
+        for (uint32_t k = 0; k < count; k++) {
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) {
+            StreamHandle s = outHandles[i];
+            nexts.insert(nexts.end(), streamConsumers.begin() + consumerOffsets[s], streamConsumers.begin() + consumerOffsets[s + 1]);
+          }
+          nextOffsets[k + 1] = nexts.size();
+        }
+        vector<uint32_t> dfsOrder;
+        dfsOrder.reserve(count);
+        vector<uint8_t> visited(count, 0);
+        vector<pair<uint32_t, uint32_t>> stack; ///< Plan entry and its next reader to visit.
+        for (uint32_t root = 0; root < count; root++) {
+          if (visited[root]) continue;
+          visited[root] = 1;
+          dfsOrder.push_back(root);
+          stack.emplace_back(root, nextOffsets[root]);
+          while (!stack.empty()) {
+            auto& [k, i] = stack.back();
+            if (i == nextOffsets[k + 1]) {
+              stack.pop_back();
+              continue;
+            }
+            uint32_t next = nexts[i++];
+            if (visited[next]) continue;
+            visited[next] = 1;
+            dfsOrder.push_back(next);
+            stack.emplace_back(next, nextOffsets[next]);
+          }
+        }
+
+        Partitioning result;
+        result.parts = parts;
+        result.partOf.assign(devices.size(), 0);
+        for (size_t i = 0; i < count; i++) result.partOf[order[dfsOrder[i]]] = i * parts / count;
+
+        vector<uint32_t> producer(streams.size(), UINT32_MAX);
+        for (uint32_t k = 0; k < count; k++) {
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) producer[outHandles[i]] = result.partOf[order[k]];
+        }
+        for (StreamHandle s = 0; s < streams.size(); s++) {
+          if (producer[s] == UINT32_MAX) continue;
+          for (uint32_t c = consumerOffsets[s]; c < consumerOffsets[s + 1]; c++) {
+            if (result.partOf[order[streamConsumers[c]]] != producer[s]) {
+              result.cutStreams.push_back(s);
+              break;
+            }
+          }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Run one partition of a distributed solve; every partition calls this with its rank.
+     *
+     * The partition sweeps its own devices on a private copy of the mass flows. After each
+     * sweep it sends the cut streams it produces to the partitions reading them and
+     * receives the ones it reads. Values received from other partitions and the tear
+     * streams inside the partition are the iteration variables of the recycle solver;
+     * partitions agree on convergence through a max-reduction over the transport, so all
+     * of them stop after the same sweep.
+     * @param rank This partition.
+     * @param parts The partitioning shared by all partitions.
+     * @param transport Carries the boundary values.
+     * @param report Receives the convergence report, the same on every partition.
+     * @return The mass flows as seen by this partition; streams it produces are final.
+     */
+    vector<double> solvePartition(uint32_t rank, const Partitioning& parts, BoundaryTransport& transport,
+                                  ConvergenceReport& report) const {
+        size_t count = planDevices.size();
+        vector<double> flows(streams.data(), streams.data() + streams.size());
+        auto partOf = [&](uint32_t k) {return parts.partOf[order[k]];};
+
+        vector<uint32_t> local;
+        for (uint32_t k = 0; k < count; k++) {
+          if (partOf(k) == rank) local.push_back(k);
+        }
+        vector<uint32_t> producer(streams.size(), UINT32_MAX);
+        for (uint32_t k = 0; k < count; k++) {
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) producer[outHandles[i]] = k;
+        }
+
+        // Cut streams to send to and receive from every other partition, in stream order.
+        vector<vector<StreamHandle>> sendTo(parts.parts), receiveFrom(parts.parts);
+        for (StreamHandle s : parts.cutStreams) {
+          uint32_t from = partOf(producer[s]);
+          vector<uint8_t> readers(parts.parts, 0);
+          for (uint32_t c = consumerOffsets[s]; c < consumerOffsets[s + 1]; c++) readers[partOf(streamConsumers[c])] = 1;
+          for (uint32_t to = 0; to < parts.parts; to++) {
+            if (to == from || !readers[to]) continue;
+            if (from == rank) sendTo[to].push_back(s);
+            if (to == rank) receiveFrom[from].push_back(s);
+          }
+        }
+
+        vector<StreamHandle> variables;
+        for (uint32_t from = 0; from < parts.parts; from++) {
+          variables.insert(variables.end(), receiveFrom[from].begin(), receiveFrom[from].end());
+        }
+        for (StreamHandle t : tears) {
+          if (partOf(producer[t]) != rank) continue;
+          bool readHere = false;
+          for (uint32_t c = consumerOffsets[t]; c < consumerOffsets[t + 1]; c++) readHere = readHere || partOf(streamConsumers[c]) == rank;
+          if (readHere) variables.push_back(t);
+        }
+
+        vector<double> x(variables.size()), g(variables.size());
+        for (size_t i = 0; i < variables.size(); i++) x[i] = flows[variables[i]];
+        TearAccelerator partAccelerator;
+        partAccelerator.reset(method, variables.size());
+        report = ConvergenceReport();
+
+        while (report.iterations < maxIterations) {
+          for (size_t i = 0; i < variables.size(); i++) flows[variables[i]] = x[i];
+          for (uint32_t k : local) {
+            planDevices[k]->evaluate(flows.data(), inHandles.data() + inOffsets[k], inOffsets[k + 1] - inOffsets[k],
+                                     outHandles.data() + outOffsets[k], outOffsets[k + 1] - outOffsets[k]);
+          }
+          report.iterations++;
+
+          for (uint32_t to = 0; to < parts.parts; to++) {
+            if (sendTo[to].empty()) continue;
+            vector<double> values(sendTo[to].size());
+            for (size_t i = 0; i < values.size(); i++) values[i] = flows[sendTo[to][i]];
+            transport.send(rank, to, std::move(values));
+          }
+          for (uint32_t from = 0; from < parts.parts; from++) {
+            if (receiveFrom[from].empty()) continue;
+            vector<double> values = transport.receive(rank, from);
+            for (size_t i = 0; i < values.size(); i++) flows[receiveFrom[from][i]] = values[i];
+          }
+
+          double residual = 0;
+          for (size_t i = 0; i < variables.size(); i++) {
+            g[i] = flows[variables[i]];
+            residual = max(residual, abs(g[i] - x[i]));
+          }
+          if (rank == 0) {
+            for (uint32_t from = 1; from < parts.parts; from++) residual = max(residual, transport.receive(0, from)[0]);
+            for (uint32_t to = 1; to < parts.parts; to++) transport.send(0, to, {residual});
+          } else {
+            transport.send(rank, 0, {residual});
+            residual = transport.receive(rank, 0)[0];
+          }
+
+          report.residual = residual;
+          report.residuals.push_back(residual);
+          if (residual <= tolerance) {
+            report.converged = true;
+            break;
+          }
+          partAccelerator.next(x, g);
+        }
+        return flows;
+    }
+
+    /**
+     * @brief Solve with every partition on its own thread, exchanging values over a transport.
+     *
+     * The in-process counterpart of running solvePartition() on every node. Afterwards
+     * each stream holds the value computed by the partition that produces it.
+     */
+    const ConvergenceReport& solvePartitioned(const Partitioning& parts, BoundaryTransport& transport) {
+        validate().orThrow();
+        if (!compiled) compile();
+        vector<vector<double>> results(parts.parts);
+        vector<ConvergenceReport> reports(parts.parts);
+        vector<exception_ptr> errors(parts.parts);
+        vector<thread> nodes;
+        for (uint32_t rank = 0; rank < parts.parts; rank++) {
+          nodes.emplace_back([&, rank] {
+            try {
+              results[rank] = solvePartition(rank, parts, transport, reports[rank]);
+            } catch (...) {
+              errors[rank] = current_exception();
+            }
+          });
+        }
+        for (thread& node : nodes) node.join();
+        for (const exception_ptr& e : errors) {
+          if (e) rethrow_exception(e);
+        }
+
+        double* flows = streams.data();
+        for (uint32_t k = 0; k < planDevices.size(); k++) {
+          const vector<double>& partFlows = results[parts.partOf[order[k]]];
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) flows[outHandles[i]] = partFlows[outHandles[i]];
+        }
+        allDirty = true;
+        lastReport = reports[0];
+        if (publisher) publisher->publish(flows, streams.size());
+        return lastReport;
+    }
+
+    /**
+     * @brief Create a scenario batch with every column filled with the current stream values.
+     * @param scenarios Number of scenarios.
+     * @tparam T double, or float for a ScreeningBatch.
+     */
+    template <class T = double>
+    BasicScenarioBatch<T> makeScenarios(size_t scenarios) const {
+        BasicScenarioBatch<T> batch(streams.size(), scenarios);
+        for (StreamHandle s = 0; s < streams.size(); s++) {
+          T* column = batch.column(s);
+          for (size_t j = 0; j < scenarios; j++) column[j] = streams.getMassFlow(s);
+        }
+        return batch;
+    }
+
+    /**
+     * @brief Solve the flowsheet for every scenario of a batch.
+     *
+     * Scenarios are processed in blocks of SCENARIO_BLOCK lanes that go through the whole
+     * plan while they are still in cache; blocks run in parallel when an executor is set.
+     * Each block converges its recycles on its own.
+     * @return Largest iteration count and residual over the blocks; residuals holds the
+     *         per-sweep history of the slowest block.
+     */
+    const ConvergenceReport& solveScenarios(ScenarioBatch& batch) {return solveBatch(batch);}
+
+    /**
+     * @brief Solve a reduced-precision screening batch like solveScenarios().
+     *
+     * Values stay float from end to end, so blocks hold twice the lanes in the same cache
+     * footprint and the column kernels run at twice the vector width. The tolerance must
+     * stay above float resolution; verify picked scenarios in double by solving
+     * batch.converted<double>(), which starts from the screened values.
+     */
+    const ConvergenceReport& solveScenarios(ScreeningBatch& batch) {return solveBatch(batch);}
+
+    /**
+     * @brief Assemble the mass balances of a linear flowsheet into a sparse matrix and factor it.
+     *
+     * Every produced stream is one unknown, numbered in plan output order, so the matrix is
+     * triangular apart from the recycles and fills in only there. Flows of the streams no
+     * device produces go to the right-hand side. The factors are reused by solveLinear()
+     * until the wiring or the parameters of a device change.
+     * @return NotLinear if a device is not linear or components are tracked, SingularBalance
+     *         if a recycle never lets mass out, or lets out so little that a pivot falls
+     *         below the relative threshold of SparseLU::factor().
+     */
+    Status factorLinear() {
+        factored = false;
+        singular = false;
+        Status status = tryCompile();
+        if (!status) return status;
+        if (streams.componentCount()) return DeviceError::NotLinear;
+
+        vector<uint32_t> row(streams.size(), UINT32_MAX);
+        for (uint32_t r = 0; r < outHandles.size(); r++) row[outHandles[r]] = r;
+        vector<uint32_t> offsets(1, 0), columns;
+        vector<double> values, a;
+        feedOffsets.assign(1, 0);
+        feedStreams.clear();
+        feedCoefficients.clear();
+        for (size_t k = 0; k < planDevices.size(); k++) {
+          size_t inCount = inOffsets[k + 1] - inOffsets[k];
+          size_t outCount = outOffsets[k + 1] - outOffsets[k];
+          a.resize(inCount * outCount);
+          if (!planDevices[k]->linearCoefficients(inCount, outCount, a.data())) return DeviceError::NotLinear;
+          for (size_t j = 0; j < outCount; j++) {
+            columns.push_back(outOffsets[k] + j);
+            values.push_back(1.0);
+            for (size_t i = 0; i < inCount; i++) {
+              double c = a[j * inCount + i];
+              if (c == 0) continue;
+              StreamHandle s = inHandles[inOffsets[k] + i];
+              if (row[s] != UINT32_MAX) {
+                columns.push_back(row[s]);
+                values.push_back(-c);
+              } else {
+                feedStreams.push_back(s);
+                feedCoefficients.push_back(c);
+              }
+            }
+            offsets.push_back(columns.size());
+            feedOffsets.push_back(feedStreams.size());
+          }
+        }
+        factoredVersions = parameterVersions();
+        if (!balance.factor(outHandles.size(), offsets, columns, values)) {
+          singular = true;
+          return DeviceError::SingularBalance;
+        }
+        factored = true;
+        return {};
+    }
+
+    /**
+     * @brief Check whether solveLinear() can reuse the factors of factorLinear().
+     *
+     * Re-parameterising a device, e.g. with Reactor::setSplitRatios(), makes the factors
+     * stale; this costs one pass over the devices.
+     */
+    bool isFactored() const {return factored && compiled && parameterVersions() == factoredVersions;}
+
+    /**
+     * @brief Solve a linear flowsheet directly instead of iterating on its recycles.
+     *
+     * Factors the balance on first use; later calls only rebuild the right-hand side from
+     * the current feeds, so scanning feed changes costs two triangular solves each. A
+     * balance the factor rejects as singular, such as a near-total recycle, is solved with
+     * solve() instead until the wiring or the parameters change.
+     * @return A report of one converged iteration, or the report of solve().
+     * @throws DeviceError::NotLinear if a device is not linear or components are tracked.
+     */
+    const ConvergenceReport& solveLinear() {
+        if (!prepareLinear()) return solve();
+        double* flows = streams.data();
+        rightHandSides.resize(outHandles.size());
+        for (size_t r = 0; r < outHandles.size(); r++) {
+          double b = 0;
+          for (uint32_t t = feedOffsets[r]; t < feedOffsets[r + 1]; t++) b += feedCoefficients[t] * flows[feedStreams[t]];
+          rightHandSides[r] = b;
+        }
+        balance.solve(rightHandSides.data());
+        for (size_t r = 0; r < outHandles.size(); r++) flows[outHandles[r]] = rightHandSides[r];
+
+        lastReport = ConvergenceReport();
+        lastReport.iterations = 1;
+        lastReport.converged = true;
+        for (uint32_t k : dirtyQueue) dirty[k] = 0;
+        dirtyQueue.clear();
+        allDirty = false;
+        if (publisher) publisher->publish(flows, streams.size());
+        return lastReport;
+    }
+
+    /**
+     * @brief Solve every scenario of a batch with one pass through the linear factors.
+     *
+     * The scenarios are the right-hand sides of a single block solve, so the factors are
+     * read once for the whole batch. A singular balance falls back to solveScenarios(),
+     * as in solveLinear().
+     */
+    const ConvergenceReport& solveLinearScenarios(ScenarioBatch& batch) {
+        if (batch.streamCount() != streams.size()) throwError(DeviceError::BatchMismatch);
+        if (!prepareLinear()) return solveScenarios(batch);
+
+        size_t width = batch.scenarios();
+        rightHandSides.assign(outHandles.size() * width, 0.0);
+        for (size_t r = 0; r < outHandles.size(); r++) {
+          double* b = rightHandSides.data() + r * width;
+          for (uint32_t t = feedOffsets[r]; t < feedOffsets[r + 1]; t++) {
+            const double* column = batch.column(feedStreams[t]);
+            double c = feedCoefficients[t];
+            for (size_t j = 0; j < width; j++) b[j] += c * column[j];
+          }
+        }
+        balance.solve(rightHandSides.data(), width, width);
+        for (size_t r = 0; r < outHandles.size(); r++) {
+          memcpy(batch.column(outHandles[r]), rightHandSides.data() + r * width, width * sizeof(double));
+        }
+
+        lastReport = ConvergenceReport();
+        lastReport.iterations = 1;
+        lastReport.converged = true;
+        return lastReport;
+    }
+
+    /**
+     * @brief Differentiate every stream flow by the given feed flows with forward-mode dual numbers.
+     *
+     * Call after a solve: devices are differentiated at the current flows. Every sweep runs
+     * the generic device kernels on duals carrying DUAL_DIRECTIONS feeds at once, so a plant
+     * without recycles takes one sweep per DUAL_DIRECTIONS feeds instead of two solves per
+     * feed. With recycles the sweeps repeat until the derivatives of the tear streams
+     * change by less than the tolerance.
+     * @param feeds Streams no device produces.
+     */
+    Jacobian sensitivities(const vector<StreamHandle>& feeds) {
+        if (!compiled) compile();
+        for (StreamHandle s : feeds) if (s >= streams.size()) throwError(DeviceError::UnknownStream);
+
+        Jacobian jacobian;
+        jacobian.feedCount = feeds.size();
+        jacobian.values.assign(streams.size() * feeds.size(), 0.0);
+        jacobian.converged = true;
+        const double* flows = streams.data();
+        vector<FlowDual> duals(streams.size());
+        vector<FlowDual> previous(tears.size());
+        for (size_t first = 0; first < feeds.size(); first += DUAL_DIRECTIONS) {
+          size_t width = min(DUAL_DIRECTIONS, feeds.size() - first);
+          for (StreamHandle s = 0; s < streams.size(); s++) duals[s] = FlowDual(flows[s]);
+          for (size_t k = 0; k < width; k++) duals[feeds[first + k]].d[k] = 1.0;
+
+          bool settled = tears.empty();
+          size_t sweeps = 0;
+          do {
+            for (size_t t = 0; t < tears.size(); t++) previous[t] = duals[tears[t]];
+            for (size_t k = 0; k < planDevices.size(); k++) {
+              planDevices[k]->evaluateDual(duals.data(), inHandles.data() + inOffsets[k], inOffsets[k + 1] - inOffsets[k],
+                                           outHandles.data() + outOffsets[k], outOffsets[k + 1] - outOffsets[k]);
+            }
+            sweeps++;
+            double residual = 0;
+            for (size_t t = 0; t < tears.size(); t++) {
+              for (size_t k = 0; k < width; k++) residual = max(residual, abs(duals[tears[t]].d[k] - previous[t].d[k]));
+            }
+            if (!tears.empty()) settled = residual <= tolerance;
+          } while (!settled && sweeps < maxIterations);
+
+          jacobian.sweeps += sweeps;
+          jacobian.converged = jacobian.converged && settled;
+          for (StreamHandle s = 0; s < streams.size(); s++) {
+            for (size_t k = 0; k < width; k++) jacobian.values[s * feeds.size() + first + k] = duals[s].d[k];
+          }
+        }
+        return jacobian;
+    }
+
+    /**
+     * @brief Step the flowsheet through a time series of feed flows and record every step.
+     *
+     * Devices hold no inventory, so every step settles to the steady state of its feeds.
+     * Each solve starts from the flows of the previous step, which keeps recycle iterations
+     * low. Steps use solveLinear() once factorLinear() succeeded and solve() otherwise.
+     * @param feeds Streams whose flows follow the profile.
+     * @param steps Number of time steps.
+     * @param profile Fills values with the flow of every feed at a step.
+     * @param history Receives the mass flow of every stream after every step; flushed at the end.
+     */
+    SimulationReport simulate(const vector<StreamHandle>& feeds, size_t steps,
+                              const function<void(size_t, double*)>& profile, HistoryWriter& history) {
+        if (history.streamCount() != streams.size()) throwError(DeviceError::HistoryMismatch);
+        for (StreamHandle s : feeds) if (s >= streams.size()) throwError(DeviceError::UnknownStream);
+
+        SimulationReport report;
+        vector<double> values(feeds.size());
+        for (size_t t = 0; t < steps; t++) {
+          profile(t, values.data());
+          for (size_t i = 0; i < feeds.size(); i++) setMassFlow(feeds[i], values[i]);
+          const ConvergenceReport& step = isFactored() ? solveLinear() : solve();
+          report.steps++;
+          report.iterations += step.iterations;
+          report.unconvergedSteps += !step.converged;
+          report.worstResidual = max(report.worstResidual, step.residual);
+          history.append(streams.data());
+        }
+        history.flush();
+        return report;
+    }
+
+    /**
+     * @brief Simulate a feed series held in memory.
+     * @param series Step-major feed flows: feeds.size() values per time step.
+     */
+    SimulationReport simulate(const vector<StreamHandle>& feeds, const vector<double>& series, HistoryWriter& history) {
+        if (feeds.empty() || series.size() % feeds.size() != 0) throwError(DeviceError::FeedSeriesShape);
+        return simulate(feeds, series.size() / feeds.size(), [&](size_t t, double* values) {
+          memcpy(values, series.data() + t * feeds.size(), feeds.size() * sizeof(double));
+        }, history);
+    }
+
+    /**
+     * @brief Write the topology, device parameters and stream values to a binary snapshot.
+     *
+     * Only built-in devices (those with a typeId) can be saved.
+     * @param path The snapshot file to create.
+     */
+    void saveSnapshot(const string& path) {
+        trySaveSnapshot(path).orThrow();
+    }
+
+    /**
+     * @brief saveSnapshot() that reports devices without a typeId and write errors.
+     */
+    Status trySaveSnapshot(const string& path) {
+        if (!compiled) compile();
+        SnapshotHeader h{};
+        memcpy(h.magic, SnapshotHeader::MAGIC, sizeof(h.magic));
+        h.version = SnapshotHeader::VERSION;
+        h.byteOrder = 0x01020304;
+        h.streamCount = streams.size();
+        h.deviceCount = devices.size();
+        h.inPortCount = inHandles.size();
+        h.outPortCount = outHandles.size();
+        h.tearCount = tears.size();
+        h.levelCount = levelOffsets.size() - 1;
+        h.componentCount = streams.componentCount();
+        vector<uint32_t> nameStarts(1, 0);
+        string nameChars;
+        for (StreamHandle s = 0; s < streams.size(); s++) {
+          nameChars.append(streams.getName(s));
+          nameStarts.push_back(nameChars.size());
+        }
+        h.nameBytes = nameChars.size();
+
+        vector<uint32_t> types(devices.size());
+        vector<uint32_t> parameters(devices.size());
+        vector<uint32_t> parameterOffsets(1, 0);
+        vector<double> parameterValues;
+        for (size_t d = 0; d < devices.size(); d++) {
+          types[d] = devices[d]->typeId();
+          parameters[d] = devices[d]->typeParameter();
+          if (types[d] == 0) return DeviceError::UnsavableDevice;
+          devices[d]->saveParameters(parameterValues);
+          parameterOffsets.push_back(parameterValues.size());
+        }
+        h.parameterCount = parameterValues.size();
+
+        SnapshotLayout layout(h);
+        vector<char> image(layout.total, 0);
+        auto put = [&](uint64_t offset, const void* data, size_t bytes) {
+          if (bytes) memcpy(image.data() + offset, data, bytes);
+        };
+        put(0, &h, sizeof(h));
+        put(layout.flows, streams.data(), streams.size() * sizeof(double));
+        put(layout.nameStarts, nameStarts.data(), nameStarts.size() * sizeof(uint32_t));
+        put(layout.nameChars, nameChars.data(), nameChars.size());
+        put(layout.types, types.data(), types.size() * sizeof(uint32_t));
+        put(layout.parameters, parameters.data(), parameters.size() * sizeof(uint32_t));
+        put(layout.order, order.data(), order.size() * sizeof(uint32_t));
+        put(layout.inOffsets, inOffsets.data(), inOffsets.size() * sizeof(uint32_t));
+        put(layout.inHandles, inHandles.data(), inHandles.size() * sizeof(uint32_t));
+        put(layout.outOffsets, outOffsets.data(), outOffsets.size() * sizeof(uint32_t));
+        put(layout.outHandles, outHandles.data(), outHandles.size() * sizeof(uint32_t));
+        put(layout.tears, tears.data(), tears.size() * sizeof(uint32_t));
+        put(layout.consumerOffsets, consumerOffsets.data(), consumerOffsets.size() * sizeof(uint32_t));
+        put(layout.consumers, streamConsumers.data(), streamConsumers.size() * sizeof(uint32_t));
+        put(layout.levelOffsets, levelOffsets.data(), levelOffsets.size() * sizeof(uint32_t));
+        put(layout.levelEntries, levelEntries.data(), levelEntries.size() * sizeof(uint32_t));
+        put(layout.compositions, streams.compositionData(), streams.size() * h.componentCount * sizeof(double));
+        put(layout.parameterOffsets, parameterOffsets.data(), parameterOffsets.size() * sizeof(uint32_t));
+        put(layout.parameterValues, parameterValues.data(), parameterValues.size() * sizeof(double));
+
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(image.data(), image.size());
+        if (!file) return DeviceError::CannotWriteSnapshot;
+        return {};
+    }
+
+    /**
+     * @brief Load a mapped snapshot into this empty flowsheet.
+     *
+     * The compiled plan and its indexes, which MappedSnapshot has validated, are copied
+     * from the mapping into the flowsheet, so nothing is sorted or recomputed. Every
+     * device is recreated in the device arena, so each can be re-parameterised on its own.
+     * Generated stream names continue after the loaded streams.
+     */
+    void loadSnapshot(const MappedSnapshot& snapshot) {
+        tryLoadSnapshot(snapshot).orThrow();
+    }
+
+    /**
+     * @brief loadSnapshot() that reports a non-empty flowsheet, unknown device types and
+     * device parameters that do not fit their type.
+     *
+     * On failure the flowsheet is left unchanged.
+     */
+    Status tryLoadSnapshot(const MappedSnapshot& snapshot) {
+        if (!devices.empty() || streams.size() != 0) return DeviceError::SnapshotTargetNotEmpty;
+        if (!snapshot.isMapped()) return DeviceError::NotSnapshot;
+        const SnapshotHeader& h = snapshot.header();
+        vector<shared_ptr<Device>> loaded(h.deviceCount);
+        for (size_t d = 0; d < h.deviceCount; d++) {
+          Status status = makeBuiltinDevice(deviceArena, snapshot.types()[d], snapshot.parameters()[d],
+                                            snapshot.parametersOf(d), loaded[d]);
+          if (!status) return status;
+        }
+        devices = std::move(loaded);
+        streams.assign(snapshot.flows(), h.streamCount, snapshot.nameStarts(), snapshot.nameChars());
+        streams.setComponentCount(h.componentCount);
+        copy_n(snapshot.compositions(), h.streamCount * h.componentCount, streams.compositionData());
+        streamIds = int(h.streamCount);
+
+        order.assign(snapshot.order(), snapshot.order() + h.deviceCount);
+        inOffsets.assign(snapshot.inOffsets(), snapshot.inOffsets() + h.deviceCount + 1);
+        inHandles.assign(snapshot.inHandles(), snapshot.inHandles() + h.inPortCount);
+        outOffsets.assign(snapshot.outOffsets(), snapshot.outOffsets() + h.deviceCount + 1);
+        outHandles.assign(snapshot.outHandles(), snapshot.outHandles() + h.outPortCount);
+        tears.assign(snapshot.tears(), snapshot.tears() + h.tearCount);
+        inputCounts.assign(h.deviceCount, 0);
+        outputCounts.assign(h.deviceCount, 0);
+        planDevices.resize(h.deviceCount);
+        for (size_t k = 0; k < h.deviceCount; k++) {
+          planDevices[k] = devices[order[k]].get();
+          inputCounts[order[k]] = inOffsets[k + 1] - inOffsets[k];
+          outputCounts[order[k]] = outOffsets[k + 1] - outOffsets[k];
+        }
+
+        consumerOffsets.assign(snapshot.consumerOffsets(), snapshot.consumerOffsets() + h.streamCount + 1);
+        streamConsumers.assign(snapshot.consumers(), snapshot.consumers() + h.inPortCount);
+        levelOffsets.assign(snapshot.levelOffsets(), snapshot.levelOffsets() + h.levelCount + 1);
+        levelEntries.assign(snapshot.levelEntries(), snapshot.levelEntries() + h.deviceCount);
+        dirty.assign(h.deviceCount, 0);
+        dirtyQueue.clear();
+        allDirty = true;
+
+        edgesFromPlan = true;
+        compiled = true;
+        frozen = false;
+        factored = false;
+        singular = false;
+        return {};
+    }
+
+    /**
+     * @brief Get the number of devices waiting for recomputation.
+     */
+    size_t dirtyCount() const {return allDirty ? devices.size() : dirtyQueue.size();}
+
+    /**
+     * @brief Recompute only the devices downstream of streams changed with setMassFlow.
+     *
+     * Dirty devices run in topological order. A device's consumers are only marked
+     * when one of its outputs actually changes, so recomputation stops where the
+     * change dies out. Falls back to a full solve after wiring changes, when components
+     * are tracked, and when the plant has recycles, which have to be converged as a whole.
+     * @return The number of devices that were recomputed.
+     */
+    size_t updateDirty() {
+        if (!compiled || allDirty || !tears.empty() || streams.componentCount()) {
+          solve();
+          return planDevices.size();
+        }
+
+        double* flows = streams.data();
+        size_t recomputed = 0;
+        while (!dirtyQueue.empty()) {
+          pop_heap(dirtyQueue.begin(), dirtyQueue.end(), greater<uint32_t>());
+          uint32_t k = dirtyQueue.back();
+          dirtyQueue.pop_back();
+          dirty[k] = 0;
+
+          previousOutputs.clear();
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) previousOutputs.push_back(flows[outHandles[i]]);
+          evaluateEntry(k, flows);
+          for (uint32_t i = outOffsets[k]; i < outOffsets[k + 1]; i++) {
+            if (flows[outHandles[i]] != previousOutputs[i - outOffsets[k]]) markConsumers(outHandles[i]);
+          }
+          recomputed++;
+        }
+        if (publisher && recomputed) publisher->publish(flows, streams.size());
+        return recomputed;
+    }
+};
+
+void shouldInternStreamNames() {
+    StreamTable t;
+    StreamHandle s1 = t.add("feed");
+    StreamHandle s2 = t.add("product");
+    StreamHandle s3 = t.add("feed");
+    t.setMassFlow(s2, 4.0);
+
+    if (s1 == 0 && s2 == 1 && s3 == 2 && t.nameCount() == 2 && t.getName(s3) == "feed"
+        && abs(t.data()[s2] - 4.0) < POSSIBLE_ERROR) {
+      cout << "StreamTable test 1 passed"s << endl;
+    } else {
+      cout << "StreamTable test 1 failed"s << endl;
+    }
+}
+
+void shouldSolveChainInTopologicalOrder() {
+    streamcounter=0;
+    Flowsheet f;
+
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    StreamHandle s4 = f.addStream();
+    StreamHandle s5 = f.addStream();
+    f.setMassFlow(s1, 10.0);
+    f.setMassFlow(s2, 5.0);
+
+    // Added downstream first, so the flowsheet has to reorder them.
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    f.addInput(r, s3);
+    f.addOutput(r, s4);
+    f.addOutput(r, s5);
+    f.addInput(m, s1);
+    f.addInput(m, s2);
+    f.addOutput(m, s3);
+
+    f.solve();
+
+    if (abs(f.getMassFlow(s4) - 7.5) < POSSIBLE_ERROR && abs(f.getMassFlow(s5) - 7.5) < POSSIBLE_ERROR) {
+      cout << "Flowsheet test 1 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 1 failed"s << endl;
+    }
+}
+
+void shouldKeepOrderUntilWiringChanges() {
+    streamcounter=0;
+    Flowsheet f;
+
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    f.addInput(m, s1);
+    f.addOutput(m, s3);
+
+    f.solve();
+    bool cachedAfterSolve = f.isCompiled();
+    f.addInput(m, s2);
+    bool invalidatedByWiring = !f.isCompiled();
+
+    if (cachedAfterSolve && invalidatedByWiring) {
+      cout << "Flowsheet test 2 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 2 failed"s << endl;
+    }
+}
+
+void shouldReportNonConvergingRecycle() {
+    streamcounter=0;
+    Flowsheet f;
+
+    // Full recycle with a constant feed never settles.
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice<Reactor>(false);
+    f.addInput(m, s1);
+    f.addInput(m, s3);
+    f.addOutput(m, s2);
+    f.addInput(r, s2);
+    f.addOutput(r, s3);
+    f.setMassFlow(s1, 1.0);
+    f.setConvergence(ConvergenceMethod::SuccessiveSubstitution, POSSIBLE_ERROR, 50);
+
+    const ConvergenceReport& report = f.solve();
+
+    if (!report.converged && report.iterations == 50 && f.getTearStreams().size() == 1) {
+      cout << "Flowsheet test 3 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 3 failed"s << endl;
+    }
+}
+
+void shouldRecomputeOnlyDownstreamCone() {
+    streamcounter=0;
+    Flowsheet f;
+
+    // Two independent trains: m1 -> r1 and m2.
+    StreamHandle a1 = f.addStream();
+    StreamHandle a2 = f.addStream();
+    StreamHandle a3 = f.addStream();
+    StreamHandle a4 = f.addStream();
+    StreamHandle b1 = f.addStream();
+    StreamHandle b2 = f.addStream();
+    DeviceHandle m1 = f.addDevice<Mixer>(2);
+    DeviceHandle r1 = f.addDevice<Reactor>(false);
+    DeviceHandle m2 = f.addDevice<Mixer>(1);
+    f.addInput(m1, a1);
+    f.addInput(m1, a2);
+    f.addOutput(m1, a3);
+    f.addInput(r1, a3);
+    f.addOutput(r1, a4);
+    f.addInput(m2, b1);
+    f.addOutput(m2, b2);
+    f.setMassFlow(a1, 1.0);
+    f.setMassFlow(a2, 2.0);
+    f.setMassFlow(b1, 3.0);
+    f.updateDirty();
+
+    f.setMassFlow(a1, 4.0);
+    size_t recomputed = f.updateDirty();
+
+    if (recomputed == 2 && f.dirtyCount() == 0 && abs(f.getMassFlow(a4) - 6.0) < POSSIBLE_ERROR
+        && abs(f.getMassFlow(b2) - 3.0) < POSSIBLE_ERROR) {
+      cout << "Flowsheet test 4 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 4 failed"s << endl;
+    }
+}
+
+void shouldStopPropagationWhenOutputUnchanged() {
+    streamcounter=0;
+    Flowsheet f;
+
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    StreamHandle s4 = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice<Reactor>(false);
+    f.addInput(m, s1);
+    f.addInput(m, s2);
+    f.addOutput(m, s3);
+    f.addInput(r, s3);
+    f.addOutput(r, s4);
+    f.setMassFlow(s1, 1.0);
+    f.setMassFlow(s2, 2.0);
+    f.solve();
+
+    // Same total, so the reactor does not need to run again.
+    f.setMassFlow(s1, 2.0);
+    f.setMassFlow(s2, 1.0);
+    size_t recomputed = f.updateDirty();
+
+    if (recomputed == 1 && abs(f.getMassFlow(s4) - 3.0) < POSSIBLE_ERROR) {
+      cout << "Flowsheet test 5 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 5 failed"s << endl;
+    }
+}
+
+/**
+ * @brief Build feed -> mixer -> reactor with half of the reactor output recycled to the mixer.
+ * @return The product stream; at steady state it carries the whole feed.
+ */
+StreamHandle buildHalfRecycle(Flowsheet& f, double feed) {
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle product = f.addStream();
+    StreamHandle recycle = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    f.addInput(m, s1);
+    f.addInput(m, recycle);
+    f.addOutput(m, s2);
+    f.addInput(r, s2);
+    f.addOutput(r, product);
+    f.addOutput(r, recycle);
+    f.setMassFlow(s1, feed);
+    return product;
+}
+
+void shouldConvergeRecycleWithEveryMethod() {
+    bool passed = true;
+    size_t iterations[3];
+    ConvergenceMethod methods[3] = {ConvergenceMethod::SuccessiveSubstitution, ConvergenceMethod::Wegstein,
+                                    ConvergenceMethod::Anderson};
+    for (int i = 0; i < 3; i++) {
+      streamcounter=0;
+      Flowsheet f;
+      StreamHandle product = buildHalfRecycle(f, 10.0);
+      f.setConvergence(methods[i]);
+      const ConvergenceReport& report = f.solve();
+      passed = passed && report.converged && abs(f.getMassFlow(product) - 10.0) < POSSIBLE_ERROR
+               && report.residuals.size() == report.iterations;
+      iterations[i] = report.iterations;
+    }
+
+    if (passed && iterations[1] < iterations[0] && iterations[2] < iterations[0]) {
+      cout << "Flowsheet test 6 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 6 failed"s << endl;
+    }
+}
+
+void shouldMatchSerialResultsInParallel() {
+    bool passed = true;
+    vector<double> results[2];
+    WorkStealingPool pool(4);
+    for (int run = 0; run < 2; run++) {
+      streamcounter=0;
+      Flowsheet f;
+      for (int train = 0; train < 300; train++) {
+        StreamHandle feed1 = f.addStream();
+        StreamHandle feed2 = f.addStream();
+        StreamHandle mixed = f.addStream();
+        StreamHandle out1 = f.addStream();
+        StreamHandle out2 = f.addStream();
+        DeviceHandle m = f.addDevice<Mixer>(2);
+        DeviceHandle r = f.addDevice<Reactor>(true);
+        f.addInput(m, feed1);
+        f.addInput(m, feed2);
+        f.addOutput(m, mixed);
+        f.addInput(r, mixed);
+        f.addOutput(r, out1);
+        f.addOutput(r, out2);
+        f.setMassFlow(feed1, 0.1 * train);
+        f.setMassFlow(feed2, 1.0 / (train + 1));
+      }
+      buildHalfRecycle(f, 10.0);
+      if (run == 1) f.setExecutor(&pool, 16);
+      passed = passed && f.solve().converged && f.levelCount() == 2;
+      results[run].assign(f.getStreams().data(), f.getStreams().data() + f.getStreams().size());
+    }
+
+    if (passed && results[0] == results[1]) {
+      cout << "Flowsheet test 7 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 7 failed"s << endl;
+    }
+}
+
+void shouldReportPortErrorsWithoutThrowing() {
+    streamcounter = 0;
+    Mixer m(1);
+    Status first = m.tryAddInput(make_shared<Stream>(++streamcounter));
+    Status second = m.tryAddInput(make_shared<Stream>(++streamcounter));
+    Status update = m.tryUpdateOutputs();
+
+    Reactor r(true);
+    r.addInput(make_shared<Stream>(++streamcounter));
+    r.addOutput(make_shared<Stream>(++streamcounter));
+
+    if (first && second.error() == DeviceError::MixerInputLimit && second.message() == "Too much inputs"s &&
+        update.error() == DeviceError::NoOutputs && r.validate().error() == DeviceError::UnconnectedPorts) {
+      cout << "Status test 1 passed"s << endl;
+    } else {
+      cout << "Status test 1 failed"s << endl;
+    }
+}
+
+void shouldValidateFlowsheetWithoutThrowing() {
+    streamcounter = 0;
+    Flowsheet f;
+    StreamHandle a = f.addStream();
+    StreamHandle b = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(1);
+    DeviceHandle r = f.addDevice<Reactor>(false);
+
+    bool passed = bool(f.tryAddInput(m, a));
+    passed = passed && f.tryAddInput(m, b).error() == DeviceError::MixerInputLimit;
+    passed = passed && f.tryAddInput(7, a).error() == DeviceError::UnknownDevice;
+    passed = passed && f.tryAddOutput(m, 7).error() == DeviceError::UnknownStream;
+
+    DeviceHandle offender = 99;
+    passed = passed && f.validate(&offender).error() == DeviceError::NoOutputs && offender == m;
+
+    f.addOutput(m, b);
+    f.addInput(r, b);
+    f.addOutput(r, b);
+    passed = passed && f.validate(&offender).error() == DeviceError::SeveralProducers && offender == r;
+
+    // The flowsheet reports the same error as the device itself.
+    try {
+      f.addInput(m, b);
+      passed = false;
+    } catch (const string ex) {
+      passed = passed && ex == "Too much inputs"s;
+    }
+
+    if (passed) {
+      cout << "Status test 2 passed"s << endl;
+    } else {
+      cout << "Status test 2 failed"s << endl;
+    }
+}
+
+void shouldReportParameterErrorsWithoutThrowing() {
+    streamcounter = 0;
+    Reactor r(true);
+    bool passed = r.trySetSplitRatios({1.0}).error() == DeviceError::SplitRatioCount;
+    passed = passed && r.trySetSplitRatios({-1.0, 2.0}).error() == DeviceError::NegativeSplitRatio;
+    passed = passed && r.getSplitRatios() == vector<double>{0.5, 0.5};
+    passed = passed && r.trySetStoichiometry({1.0, 0.0, 0.0}, 2).error() == DeviceError::StoichiometryShape;
+
+    MappedSnapshot snapshot;
+    passed = passed && snapshot.map("no_such_flowsheet_snapshot.bin").error() == DeviceError::CannotOpenSnapshot;
+    passed = passed && !snapshot.isMapped();
+    Flowsheet f;
+    passed = passed && f.tryLoadSnapshot(snapshot).error() == DeviceError::NotSnapshot;
+    f.addStream();
+    passed = passed && f.tryLoadSnapshot(snapshot).error() == DeviceError::SnapshotTargetNotEmpty;
+
+    if (passed) {
+      cout << "Status test 3 passed"s << endl;
+    } else {
+      cout << "Status test 3 failed"s << endl;
+    }
+}
+
+void shouldWireDevicePortsInBulk() {
+    streamcounter = 0;
+    vector<shared_ptr<Stream>> feeds;
+    for (int i = 0; i < 3; i++) feeds.push_back(make_shared<Stream>(++streamcounter));
+    for (int i = 0; i < 3; i++) feeds[i]->setMassFlow(i + 1.0);
+    Mixer m(3);
+    m.addInput(feeds[0]);
+    Status overflow = m.tryAddInputs(feeds);
+    Status fits = m.tryAddInputs(span(feeds).subspan(1));
+    m.addOutput(make_shared<Stream>(++streamcounter));
+    m.updateOutputs();
+
+    Reactor r(true);
+    vector<shared_ptr<Stream>> products = {make_shared<Stream>(++streamcounter), make_shared<Stream>(++streamcounter)};
+    r.addInput(feeds[2]);
+    r.addOutputs(products);
+    r.updateOutputs();
+
+    if (overflow.error() == DeviceError::MixerInputLimit && fits && m.getInputs().size() == 3
+        && m.getOutputs()[0]->getMassFlow() == 6.0 && products[1]->getMassFlow() == 1.5) {
+      cout << "Bulk wiring test 1 passed"s << endl;
+    } else {
+      cout << "Bulk wiring test 1 failed"s << endl;
+    }
+}
+
+void shouldKeepFewPortsInline() {
+    streamcounter = 0;
+    auto feed = make_shared<Stream>(++streamcounter);
+    PortList<2> ports;
+    ports.push_back(feed);
+    ports.push_back(feed);
+    const Stream* inlineFirst = ports.begin()->get();
+    bool passed = (const void*)ports.begin() >= (const void*)&ports
+                  && (const void*)ports.end() <= (const void*)(&ports + 1) && inlineFirst == feed.get();
+
+    for (int i = 0; i < 30; i++) {
+      ports.push_back(make_shared<Stream>(++streamcounter));
+      ports[i + 2]->setMassFlow(0.0);
+    }
+    PortList<2> copied = ports;
+    PortList<2> moved = std::move(ports);
+    passed = passed && moved.size() == 32 && copied.size() == 32 && ports.empty() && feed.use_count() == 5
+             && moved[31]->getName() == "s31" && copied.at(0) == feed;
+    moved = copied;
+    copied = PortList<2>();
+    passed = passed && moved.size() == 32 && copied.empty() && feed.use_count() == 3;
+
+    Mixer wide(40);
+    for (const auto& p : moved) wide.addInput(p);
+    wide.addOutput(make_shared<Stream>(++streamcounter));
+    feed->setMassFlow(1.0);
+    wide.updateOutputs();
+    passed = passed && wide.getOutputs()[0]->getMassFlow() == 2.0;
+
+    if (passed) {
+      cout << "Port list test 1 passed"s << endl;
+    } else {
+      cout << "Port list test 1 failed"s << endl;
+    }
+}
+
+void shouldWireFlowsheetPortsInBulk() {
+    Flowsheet f;
+    const size_t width = 1000;
+    vector<StreamHandle> feeds(width);
+    for (size_t i = 0; i < width; i++) {
+      feeds[i] = f.addStream();
+      f.setMassFlow(feeds[i], 1.0);
+    }
+    StreamHandle mixed = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(width);
+
+    vector<StreamHandle> unknown = {feeds[0], 12345};
+    bool passed = f.tryAddInputs(m, unknown).error() == DeviceError::UnknownStream;
+    passed = passed && f.tryAddInputs(7, feeds).error() == DeviceError::UnknownDevice;
+    f.addInputs(m, span(feeds).first(10));
+    passed = passed && f.tryAddInputs(m, feeds).error() == DeviceError::MixerInputLimit;
+    f.addInputs(m, span(feeds).subspan(10));
+    f.addOutputs(m, vector<StreamHandle>{mixed});
+    f.solve();
+
+    if (passed && f.getMassFlow(mixed) == width) {
+      cout << "Bulk wiring test 2 passed"s << endl;
+    } else {
+      cout << "Bulk wiring test 2 failed"s << endl;
+    }
+}
+
+void shouldWireMixerThroughDevice() {
+    streamcounter = 0;
+    Mixer m(2);
+    Device& device = m;
+    vector<shared_ptr<Stream>> feeds = {make_shared<Stream>(++streamcounter), make_shared<Stream>(++streamcounter)};
+    feeds[0]->setMassFlow(1.0);
+    feeds[1]->setMassFlow(2.0);
+    vector<shared_ptr<Stream>> products = {make_shared<Stream>(++streamcounter), make_shared<Stream>(++streamcounter)};
+
+    Status inputsFit = device.tryAddInputs(feeds);
+    Status inputOverflow = device.tryAddInput(feeds[0]);
+    Status outputOverflow = m.tryAddOutputs(products);
+    m.addOutputs(span(products).first(1));
+    device.updateOutputs();
+
+    bool passed = inputsFit && inputOverflow.error() == DeviceError::MixerInputLimit
+                  && outputOverflow.error() == DeviceError::MixerOutputLimit && device.maxInputs() == 2
+                  && m.getOutputs().size() == 1 && products[0]->getMassFlow() == 3.0;
+    try {
+      device.addOutput(products[1]);
+      passed = false;
+    } catch (const string ex) {
+      passed = passed && ex == "Too much outputs"s;
+    }
+
+    if (passed) {
+      cout << "Bulk wiring test 3 passed"s << endl;
+    } else {
+      cout << "Bulk wiring test 3 failed"s << endl;
+    }
+}
+
+/**
+ * @class FlowsheetLoader
+ * @brief Builds a flowsheet from a text/CSV plant definition in a single streaming pass.
+ *
+ * The input is read line by line into one reused buffer, so memory grows with the plant
+ * being built, not with the size of the file. Each record is validated as it is read:
+ * port limits are checked by the flowsheet and errors name the offending line.
+ * Records, one per line, with fields separated by commas:
+ *
+ *     stream,<name>,<mass flow>
+ *     mixer,<name>,<inputs count>
+ *     reactor,<name>,<outputs count: 1 or 2>
+ *     input,<device name>,<stream name>
+ *     output,<device name>,<stream name>
+ *
+ * Blank lines and lines starting with '#' are skipped. Streams may be referenced before
+ * their stream record; they start with zero mass flow. Devices must be declared before
+ * they are wired.
+ */
+class FlowsheetLoader
+{
+private:
+    Flowsheet& flowsheet;
+    unordered_map<string, StreamHandle> streamsByName;
+    unordered_map<string, DeviceHandle> devicesByName;
+    string key;  ///< Reused lookup key, so lookups of known names do not allocate.
+    size_t line = 0;
+
+    [[noreturn]] void fail(const string& message) const {
+        throw "Line "s + std::to_string(line) + ": "s + message;
+    }
+
+    static string_view trim(string_view text) {
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.front()))) text.remove_prefix(1);
+        while (!text.empty() && isspace(static_cast<unsigned char>(text.back()))) text.remove_suffix(1);
+        return text;
+    }
+
+    template <class T>
+    T number(string_view text) const {
+        T value{};
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        if (result.ec != errc() || result.ptr != text.data() + text.size()) fail("Bad number '"s + string(text) + "'"s);
+        return value;
+    }
+
+    StreamHandle stream(string_view name) {
+        key.assign(name);
+        auto it = streamsByName.find(key);
+        if (it != streamsByName.end()) return it->second;
+        StreamHandle s = flowsheet.addStream(name);
+        streamsByName.emplace(key, s);
+        return s;
+    }
+
+    DeviceHandle device(string_view name) {
+        key.assign(name);
+        auto it = devicesByName.find(key);
+        if (it == devicesByName.end()) fail("Unknown device '"s + key + "'"s);
+        return it->second;
+    }
+
+    template <class T, class... Args>
+    void declareDevice(string_view name, Args&&... args) {
+        key.assign(name);
+        if (devicesByName.count(key)) fail("Duplicate device '"s + key + "'"s);
+        devicesByName.emplace(key, flowsheet.addDevice<T>(std::forward<Args>(args)...));
+    }
+
+public:
+    explicit FlowsheetLoader(Flowsheet& f) : flowsheet(f) {}
+
+    /**
+     * @brief Read records until the end of the input.
+     */
+    void load(istream& in) {
+        string buffer;
+        while (getline(in, buffer)) loadLine(buffer);
+    }
+
+    /**
+     * @brief Read records from a file.
+     */
+    void loadFile(const string& path) {
+        ifstream in(path);
+        if (!in) throw "Cannot open "s + path;
+        load(in);
+    }
+
+    /**
+     * @brief Apply one record.
+     */
+    void loadLine(string_view text) {
+        line++;
+        text = trim(text);
+        if (text.empty() || text.front() == '#') return;
+
+        string_view fields[3];
+        size_t count = 0;
+        while (count < 3) {
+          size_t comma = text.find(',');
+          fields[count++] = trim(text.substr(0, comma));
+          if (comma == string_view::npos) {
+            text = string_view();
+            break;
+          }
+          text.remove_prefix(comma + 1);
+        }
+        if (count != 3 || !text.empty()) fail("Expected 3 fields"s);
+        if (fields[1].empty()) fail("Empty name"s);
+
+        string_view kind = fields[0];
+        if (kind == "stream") {
+          flowsheet.setMassFlow(stream(fields[1]), number<double>(fields[2]));
+        } else if (kind == "mixer") {
+          int inputs = number<int>(fields[2]);
+          if (inputs <= 0) fail("Mixer needs at least one input"s);
+          declareDevice<Mixer>(fields[1], inputs);
+        } else if (kind == "reactor") {
+          int outputs = number<int>(fields[2]);
+          if (outputs != 1 && outputs != 2) fail("Reactor has 1 or 2 outputs"s);
+          declareDevice<Reactor>(fields[1], outputs == 2);
+        } else if (kind == "input") {
+          DeviceHandle d = device(fields[1]);
+          Status status = flowsheet.tryAddInput(d, stream(fields[2]));
+          if (!status) fail(status.message());
+        } else if (kind == "output") {
+          DeviceHandle d = device(fields[1]);
+          Status status = flowsheet.tryAddOutput(d, stream(fields[2]));
+          if (!status) fail(status.message());
+        } else {
+          fail("Unknown record '"s + string(kind) + "'"s);
+        }
+    }
+
+    /**
+     * @brief Get the number of lines read so far.
+     */
+    size_t linesRead() const {return line;}
+};
+
+/**
+ * @struct WorkloadSpec
+ * @brief Shape of a synthetic Mixer/Reactor flowsheet for scaling and regression runs.
+ */
+struct WorkloadSpec
+{
+    size_t devices = 1000;       ///< Devices to create, rounded down to whole mixer/reactor units.
+    size_t fanIn = 2;            ///< Forward inputs of every mixer.
+    double recycleDensity = 0;   ///< Share of reactors that send their side product back upstream.
+    size_t depth = 10;           ///< Layers between the feeds and the products.
+    uint64_t seed = 1;           ///< Same seed, same flowsheet.
+};
+
+/**
+ * @brief Build a reproducible synthetic flowsheet into an empty flowsheet.
+ *
+ * Every unit is a mixer feeding a double reactor. Units are stacked in depth layers;
+ * each mixer takes fanIn forward streams, drawn at random from the first reactor
+ * outputs of the previous layer and topped up with fresh feeds. With probability
+ * recycleDensity the second reactor output goes back to a spare input of a random mixer
+ * in the same or an earlier layer; otherwise it leaves as a product. Each mixer takes at
+ * most one recycle, so loop gains stay below one and every recycle converges.
+ * @return The feed streams, in creation order.
+ */
+vector<StreamHandle> buildSyntheticFlowsheet(Flowsheet& f, const WorkloadSpec& spec) {
+    uint64_t state = spec.seed;
+    auto random = [&]() {
+        // splitmix64: small, fast and identical on every platform.
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    };
+    auto chance = [&]() {return (random() >> 11) * 0x1.0p-53;};
+
+    size_t fanIn = max<size_t>(1, spec.fanIn);
+    size_t depth = max<size_t>(1, spec.depth);
+    size_t units = spec.devices / 2;
+    size_t perLayer = max<size_t>(1, units / depth);
+    f.reserve(units * (fanIn + 3), 2 * units, units * (fanIn + 3));
+
+    vector<StreamHandle> feeds, pool, next;
+    vector<DeviceHandle> openMixers; ///< Mixers whose spare input is still free.
+    for (size_t built = 0; built < units;) {
+      size_t layerUnits = min(perLayer, units - built);
+      next.clear();
+      for (size_t u = 0; u < layerUnits; u++, built++) {
+        DeviceHandle m = f.addDevice<Mixer>(fanIn + 1);
+        DeviceHandle r = f.addDevice<Reactor>(true);
+        for (size_t i = 0; i < fanIn; i++) {
+          StreamHandle in;
+          if (pool.empty()) {
+            in = f.addStream();
+            f.setMassFlow(in, 1.0 + random() % 10);
+            feeds.push_back(in);
+          } else {
+            size_t pick = random() % pool.size();
+            in = pool[pick];
+            pool[pick] = pool.back();
+            pool.pop_back();
+          }
+          f.addInput(m, in);
+        }
+        openMixers.push_back(m);
+        StreamHandle mixed = f.addStream();
+        StreamHandle forward = f.addStream();
+        StreamHandle side = f.addStream();
+        f.addOutput(m, mixed);
+        f.addInput(r, mixed);
+        f.addOutput(r, forward);
+        f.addOutput(r, side);
+        next.push_back(forward);
+        if (chance() < spec.recycleDensity && !openMixers.empty()) {
+          size_t pick = random() % openMixers.size();
+          f.addInput(openMixers[pick], side);
+          openMixers[pick] = openMixers.back();
+          openMixers.pop_back();
+        }
+      }
+      pool.swap(next);
+    }
+    return feeds;
+}
+
+void shouldGenerateReproducibleWorkloads() {
+    WorkloadSpec spec;
+    spec.devices = 400;
+    spec.fanIn = 3;
+    spec.recycleDensity = 0.3;
+    spec.depth = 8;
+    Flowsheet first, second, other;
+    vector<StreamHandle> feeds = buildSyntheticFlowsheet(first, spec);
+    buildSyntheticFlowsheet(second, spec);
+    spec.seed = 2;
+    buildSyntheticFlowsheet(other, spec);
+
+    bool passed = first.solve().converged && second.solve().converged && first.deviceCount() == 400
+                  && !first.getTearStreams().empty() && first.getTearStreams() == second.getTearStreams()
+                  && first.getTearStreams() != other.getTearStreams()
+                  && first.auditMassBalance().violations == 0 && feeds.size() > 0;
+    const StreamTable& a = first.getStreams();
+    const StreamTable& b = second.getStreams();
+    passed = passed && a.size() == b.size() && equal(a.data(), a.data() + a.size(), b.data());
+
+    if (passed) {
+      cout << "Workload test 1 passed"s << endl;
+    } else {
+      cout << "Workload test 1 failed"s << endl;
+    }
+}
+
+void shouldLoadFlowsheetFromText() {
+    Flowsheet f;
+    istringstream text(
+        "# feed section\n"
+        "mixer, m1, 2\n"
+        "reactor, r1, 2\n"
+        "input, m1, feed1\n"
+        "input, m1, feed2\n"
+        "output, m1, mixed\n"
+        "input, r1, mixed\n"
+        "output, r1, top\n"
+        "output, r1, bottom\n"
+        "\n"
+        "stream, feed1, 10\n"
+        "stream, feed2, 5.0\n");
+    FlowsheetLoader loader(f);
+    loader.load(text);
+    f.solve();
+
+    if (loader.linesRead() == 12 && f.deviceCount() == 2 && f.getStreams().size() == 5
+        && abs(f.getMassFlow(3) - 7.5) < POSSIBLE_ERROR && f.getStreams().getName(4) == "bottom") {
+      cout << "Loader test 1 passed"s << endl;
+    } else {
+      cout << "Loader test 1 failed"s << endl;
+    }
+}
+
+void shouldReportLineOfPortLimitViolation() {
+    Flowsheet f;
+    istringstream text(
+        "mixer,m1,1\n"
+        "input,m1,a\n"
+        "input,m1,b\n"
+        "stream,a,1\n");
+    FlowsheetLoader loader(f);
+
+    try {
+      loader.load(text);
+    } catch (const string ex) {
+      if (ex == "Line 3: Too much inputs"s && loader.linesRead() == 3) {
+        cout << "Loader test 2 passed"s << endl;
+
+        return;
+      }
+    }
+
+    cout << "Loader test 2 failed"s << endl;
+}
+
+/**
+ * @class MixerBank
+ * @brief A bank of identical mixers evaluated in one call over structure-of-arrays ports.
+ *
+ * Port k of all mixers is stored as one contiguous row, so the bank sums its inputs
+ * lane-wise with SIMD instead of calling updateOutputs once per mixer.
+ */
+class MixerBank
+{
+private:
+    size_t mixers;
+    size_t inputsPerMixer;
+    size_t outputsPerMixer;
+    vector<double> inputs;  ///< inputsPerMixer rows of mixer inputs.
+    vector<double> outputs; ///< outputsPerMixer rows of mixer outputs.
+
+public:
+    /**
+     * @brief Create a bank of mixers with zero input flows.
+     * @param count Number of mixers.
+     * @param inputs_count Input streams of every mixer.
+     * @param outputs_count Output streams of every mixer.
+     */
+    MixerBank(size_t count, int inputs_count, int outputs_count = MIXER_OUTPUTS)
+        : mixers(count), inputsPerMixer(inputs_count), outputsPerMixer(outputs_count) {
+        if (outputs_count <= 0) throwError(DeviceError::NoOutputs);
+        if (outputs_count > MIXER_OUTPUTS) throwError(DeviceError::MixerOutputLimit);
+        inputs.assign(inputsPerMixer * mixers, 0.0);
+        outputs.assign(outputsPerMixer * mixers, 0.0);
+    }
+
+    size_t size() const {return mixers;}
+
+    /**
+     * @brief Get the row of input port k across all mixers.
+     */
+    double* inputRow(size_t k) {return inputs.data() + k * mixers;}
+    const double* outputRow(size_t j) const {return outputs.data() + j * mixers;}
+
+    void setInput(size_t mixer, size_t port, double m) {inputs[port * mixers + mixer] = m;}
+    double getOutput(size_t mixer, size_t port) const {return outputs[port * mixers + mixer];}
+
+    /**
+     * @brief Update the outputs of every mixer.
+     * @param path Instruction set to use.
+     */
+    void updateOutputs(SimdPath path) {
+        sumRows(path, inputs.data(), inputsPerMixer, mixers, outputsPerMixer, outputs.data());
+        for (size_t j = 1; j < outputsPerMixer; j++) {
+          memcpy(outputs.data() + j * mixers, outputs.data(), mixers * sizeof(double));
+        }
+    }
+
+    /**
+     * @brief Update the outputs of every mixer with the widest supported instruction set.
+     */
+    void updateOutputs() {
+        updateOutputs(activeSimdPath());
+    }
+};
+
+/**
+ * @class SplitterBank
+ * @brief A bank of splitters sharing one set of ratios, evaluated with the SIMD kernels.
+ *
+ * The feeds of all splitters form one contiguous row and output port j of all splitters
+ * another, so every output row is the feed row times one ratio.
+ */
+class SplitterBank
+{
+private:
+    size_t splitters;
+    vector<double> ratios;
+    vector<double> inputs;  ///< Feed of every splitter.
+    vector<double> outputs; ///< One row per output port.
+
+public:
+    /**
+     * @brief Create a bank of splitters with zero feeds.
+     * @param count Number of splitters.
+     * @param r One ratio per output; scaled to sum to 1.
+     */
+    SplitterBank(size_t count, vector<double> r)
+        : splitters(count), ratios(normalizedRatios(std::move(r))) {
+        inputs.assign(splitters, 0.0);
+        outputs.assign(ratios.size() * splitters, 0.0);
+    }
+
+    size_t size() const {return splitters;}
+
+    double* inputRow() {return inputs.data();}
+    const double* outputRow(size_t j) const {return outputs.data() + j * splitters;}
+
+    void setInput(size_t splitter, double m) {inputs[splitter] = m;}
+    double getOutput(size_t splitter, size_t port) const {return outputs[port * splitters + splitter];}
+
+    /**
+     * @brief Update the outputs of every splitter.
+     * @param path Instruction set to use.
+     */
+    void updateOutputs(SimdPath path) {
+        splitRows(path, inputs.data(), splitters, ratios.data(), ratios.size(), outputs.data());
+    }
+
+    /**
+     * @brief Update the outputs of every splitter with the widest supported instruction set.
+     */
+    void updateOutputs() {
+        updateOutputs(activeSimdPath());
+    }
+};
+
+void shouldBuildFlowsheetInArena() {
+    streamcounter=0;
+    Flowsheet f;
+    const size_t trains = 10000;
+    f.reserve(3 * trains, trains, 2 * trains);
+    StreamHandle first = f.addStream();
+    StreamHandle previous = first;
+    f.setMassFlow(first, 1.0);
+    for (size_t i = 0; i < trains; i++) {
+      StreamHandle feed = f.addStream();
+      StreamHandle mixed = f.addStream();
+      DeviceHandle m = f.addDevice<Mixer>(2);
+      f.addInput(m, previous);
+      f.addInput(m, feed);
+      f.addOutput(m, mixed);
+      f.setMassFlow(feed, 1.0);
+      previous = mixed;
+    }
+    f.solve();
+
+    Arena arena;
+    shared_ptr<Stream> s1 = arena.makeShared<Stream>(1);
+    size_t expectedBlocks = (sizeof(Mixer) + 64) * trains / (1 << 16) + 2;
+
+    if (f.arenaBlockCount() <= expectedBlocks && abs(f.getMassFlow(previous) - (trains + 1)) < POSSIBLE_ERROR
+        && arena.blockCount() == 1 && s1->getName() == "s1") {
+      cout << "Flowsheet test 8 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 8 failed"s << endl;
+    }
+}
+
+void shouldSolveFrozenFlowsheetLikeChecked() {
+    streamcounter=0;
+    Flowsheet checked, frozen;
+    StreamHandle product = buildHalfRecycle(checked, 10.0);
+    buildHalfRecycle(frozen, 10.0);
+    checked.solve();
+
+    bool passed = bool(frozen.freeze()) && frozen.isFrozen();
+    passed = passed && frozen.solve().converged && frozen.getMassFlow(product) == checked.getMassFlow(product);
+
+    StreamHandle extra = frozen.addStream();
+    DeviceHandle m = frozen.addDevice<Mixer>(1);
+    frozen.addInput(m, extra);
+    passed = passed && !frozen.isFrozen() && frozen.freeze().error() == DeviceError::NoOutputs;
+
+    if (passed && abs(checked.getMassFlow(product) - 10.0) < POSSIBLE_ERROR) {
+      cout << "Flowsheet test 9 passed"s << endl;
+    } else {
+      cout << "Flowsheet test 9 failed"s << endl;
+    }
+}
+
+void shouldMixAndReactCompositions() {
+    streamcounter=0;
+    const size_t n = 37;
+    Flowsheet f;
+    f.setComponentCount(n);
+    StreamHandle a = f.addStream();
+    StreamHandle b = f.addStream();
+    StreamHandle mixed = f.addStream();
+    StreamHandle product = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice<Reactor>(false);
+    f.addInput(m, a);
+    f.addInput(m, b);
+    f.addOutput(m, mixed);
+    f.addInput(r, mixed);
+    f.addOutput(r, product);
+
+    // Component i turns into component i + 1 with 50% conversion; the last one is inert.
+    vector<double> matrix(n * n, 0.0);
+    for (size_t c = 0; c + 1 < n; c++) {
+      matrix[c * n + c] = 0.5;
+      matrix[c * n + c + 1] = 0.5;
+    }
+    matrix[(n - 1) * n + n - 1] = 1.0;
+    static_cast<Reactor&>(f.getDevice(r)).setStoichiometry(matrix, n);
+
+    vector<double> feedA(n), feedB(n);
+    for (size_t i = 0; i < n; i++) {
+      feedA[i] = i;
+      feedB[i] = 2.0 * i;
+    }
+    f.setComposition(a, feedA.data());
+    f.setComposition(b, feedB.data());
+    f.solve();
+
+    bool passed = abs(f.getMassFlow(product) - f.getMassFlow(a) - f.getMassFlow(b)) < POSSIBLE_ERROR;
+    const double* out = f.getComposition(product);
+    for (size_t i = 0; i < n; i++) {
+      double expected = 0.5 * 3.0 * i + (i > 0 ? 0.5 * 3.0 * (i - 1) : 0.0) + (i == n - 1 ? 0.5 * 3.0 * i : 0.0);
+      passed = passed && abs(out[i] - expected) < POSSIBLE_ERROR;
+    }
+
+    vector<double> scalar(n);
+    matVecScalar(matrix.data(), feedA.data(), n, 1.0, scalar.data());
+    vector<double> dispatched(n);
+    matVec(matrix.data(), feedA.data(), n, 1.0, dispatched.data());
+
+    if (passed && scalar == dispatched) {
+      cout << "Composition test 1 passed"s << endl;
+    } else {
+      cout << "Composition test 1 failed"s << endl;
+    }
+}
+
+void shouldConvergeRecycleOnCompositions() {
+    streamcounter=0;
+    const size_t n = 20;
+    Flowsheet f;
+    f.setComponentCount(n);
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    vector<double> feed(n);
+    for (size_t i = 0; i < n; i++) feed[i] = 1.0 + i;
+    f.setComposition(0, feed.data());
+
+    bool passed = f.solve().converged;
+    const double* out = f.getComposition(product);
+    for (size_t i = 0; i < n; i++) passed = passed && abs(out[i] - feed[i]) < POSSIBLE_ERROR;
+
+    if (passed && abs(f.getMassFlow(product) - n * (n + 1) / 2.0) < n * POSSIBLE_ERROR) {
+      cout << "Composition test 2 passed"s << endl;
+    } else {
+      cout << "Composition test 2 failed"s << endl;
+    }
+}
+
+void shouldFindWorstMassBalanceOffender() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 10.0);
+    f.solve();
+    BalanceReport balanced = f.auditMassBalance();
+
+    f.setMassFlow(product, f.getMassFlow(product) + 1.0);
+    BalanceReport broken = f.auditMassBalance();
+
+    WorkStealingPool pool(3);
+    f.setExecutor(&pool, 1);
+    BalanceReport parallel = f.auditMassBalance();
+
+    bool passed = balanced.violations == 0 && balanced.offenders.empty() && balanced.worstResidual < POSSIBLE_ERROR;
+    passed = passed && broken.violations == 1 && broken.offenders.size() == 1 && broken.offenders[0].first == 1;
+    passed = passed && abs(broken.offenders[0].second + 1.0) < POSSIBLE_ERROR;
+    passed = passed && parallel.violations == 1 && parallel.worstResidual == broken.worstResidual;
+
+    if (passed) {
+      cout << "Balance test 1 passed"s << endl;
+    } else {
+      cout << "Balance test 1 failed"s << endl;
+    }
+}
+
+#ifdef DEVICE_PROFILE
+void shouldCountDeviceEvaluations() {
+    streamcounter=0;
+    Flowsheet f;
+    buildHalfRecycle(f, 10.0);
+    size_t sweeps = f.solve().iterations;
+    vector<DeviceCounters> serial = f.getProfile();
+
+    f.resetProfile();
+    WorkStealingPool pool(3);
+    f.setExecutor(&pool, 1);
+    size_t parallelSweeps = f.solve().iterations;
+    vector<DeviceCounters> parallel = f.getProfile();
+
+    bool passed = serial.size() == 2 && parallel.size() == 2;
+    for (size_t d = 0; passed && d < 2; d++) {
+      passed = serial[d].calls == sweeps && serial[d].recycleCalls == sweeps && parallel[d].calls == parallelSweeps;
+    }
+
+    if (passed) {
+      cout << "Profile test 1 passed"s << endl;
+    } else {
+      cout << "Profile test 1 failed"s << endl;
+    }
+}
+#endif
+
+void shouldPublishConsistentTables() {
+    streamcounter=0;
+    Flowsheet f;
+    const size_t length = 2000;
+    StreamHandle feed = f.addStream();
+    StreamHandle previous = feed;
+    for (size_t i = 0; i < length; i++) {
+      DeviceHandle m = f.addDevice<Mixer>(1);
+      StreamHandle next = f.addStream();
+      f.addInput(m, previous);
+      f.addOutput(m, next);
+      previous = next;
+    }
+    PublishedStreams published(f.getStreams().size());
+    f.setPublisher(&published);
+
+    atomic<bool> done{false};
+    atomic<bool> consistent{true};
+    thread reader([&]{
+      vector<double> table;
+      while (!done.load()) {
+        published.read(table);
+        for (double m : table) {
+          if (m != table[0]) consistent = false;
+        }
+      }
+    });
+    for (int i = 1; i <= 200; i++) {
+      f.setMassFlow(feed, i);
+      f.solve();
+    }
+    done = true;
+    reader.join();
+
+    vector<double> last;
+    if (consistent && published.read(last) == 200 && last.size() == length + 1 && last[length] == 200.0) {
+      cout << "Publish test 1 passed"s << endl;
+    } else {
+      cout << "Publish test 1 failed"s << endl;
+    }
+}
+
+/**
+ * @brief Splits its feed in half after asking a slow external model, used by the async tests.
+ */
+class SlowSplitter : public AsyncDevice
+{
+public:
+    mutable atomic<int>* active;  ///< Calls currently waiting on the model.
+    mutable atomic<int>* peak;    ///< Most calls seen waiting at once.
+    mutable mutex callersLock;
+    mutable vector<thread::id> callers; ///< Distinct threads that ran the model.
+
+    SlowSplitter(atomic<int>* a, atomic<int>* p): active(a), peak(p) {
+        inputAmount = 1;
+        outputAmount = 2;
+    }
+
+    void updateOutputs() override {}
+
+    DeviceTask evaluateAsync(double* flows, const StreamHandle* in, size_t inCount,
+                             const StreamHandle* out, size_t outCount) const override {
+        double fraction = 0;
+        co_await callExternal([&] {
+          int now = ++*active;
+          int seen = peak->load();
+          while (seen < now && !peak->compare_exchange_weak(seen, now)) {}
+          this_thread::sleep_for(chrono::milliseconds(40));
+          fraction = 0.5;
+          {
+            lock_guard<mutex> guard(callersLock);
+            if (find(callers.begin(), callers.end(), this_thread::get_id()) == callers.end()) {
+              callers.push_back(this_thread::get_id());
+            }
+          }
+          --*active;
+        });
+        for (size_t i = 0; i < outCount; i++) flows[out[i]] = flows[in[0]] * fraction;
+    }
+
+    void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                         const StreamHandle* out, size_t outCount) const override {
+        for (size_t i = 0; i < outCount; i++) {
+          for (size_t j = 0; j < lanes; j++) values[out[i] * stride + j] = values[in[0] * stride + j] * 0.5;
+        }
+    }
+};
+
+void shouldOverlapSlowDevices() {
+    streamcounter=0;
+    atomic<int> active{0}, peak{0};
+    Flowsheet f;
+    vector<StreamHandle> products;
+    for (int branch = 0; branch < 4; branch++) {
+      StreamHandle feed = f.addStream();
+      StreamHandle mixed = f.addStream();
+      DeviceHandle m = f.addDevice<Mixer>(1);
+      DeviceHandle s = f.addDevice<SlowSplitter>(&active, &peak);
+      f.addInput(m, feed);
+      f.addOutput(m, mixed);
+      f.addInput(s, mixed);
+      f.addOutput(s, f.addStream());
+      products.push_back(f.addStream());
+      f.addOutput(s, products.back());
+      f.setMassFlow(feed, branch + 1.0);
+    }
+
+    f.solveAsync(4);
+    bool passed = peak == 4;
+    for (int branch = 0; branch < 4; branch++) passed = passed && f.getMassFlow(products[branch]) == (branch + 1.0) / 2;
+
+    peak = 0;
+    f.solveAsync(2);
+    passed = passed && peak == 2;
+
+    if (passed) {
+      cout << "Async test 1 passed"s << endl;
+    } else {
+      cout << "Async test 1 failed"s << endl;
+    }
+}
+
+void shouldConvergeRecycleThroughAsyncDevice() {
+    streamcounter=0;
+    atomic<int> active{0}, peak{0};
+    Flowsheet serial, async;
+    for (Flowsheet* f : {&serial, &async}) {
+      StreamHandle feed = f->addStream();
+      StreamHandle mixed = f->addStream();
+      StreamHandle product = f->addStream();
+      StreamHandle recycle = f->addStream();
+      DeviceHandle m = f->addDevice<Mixer>(2);
+      DeviceHandle s = f->addDevice<SlowSplitter>(&active, &peak);
+      f->addInput(m, feed);
+      f->addInput(m, recycle);
+      f->addOutput(m, mixed);
+      f->addInput(s, mixed);
+      f->addOutput(s, product);
+      f->addOutput(s, recycle);
+      f->setMassFlow(feed, 10.0);
+      f->setConvergence(ConvergenceMethod::Wegstein);
+    }
+    const ConvergenceReport& a = async.solveAsync(1);
+    const ConvergenceReport& b = serial.solve();
+    // Every sweep of the recycle reuses the one worker thread.
+    const SlowSplitter& slow = static_cast<const SlowSplitter&>(async.getDevice(1));
+
+    if (a.converged && a.iterations == b.iterations && a.iterations > 1 && slow.callers.size() == 1
+        && async.getMassFlow(2) == serial.getMassFlow(2)) {
+      cout << "Async test 2 passed"s << endl;
+    } else {
+      cout << "Async test 2 failed"s << endl;
+    }
+}
+
+void shouldReuseCachedEvaluations() {
+    streamcounter=0;
+    EvaluationCache cache;
+    Flowsheet f;
+    StreamHandle feed = f.addStream();
+    StreamHandle mixed = f.addStream();
+    StreamHandle product = f.addStream();
+    StreamHandle other = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(1);
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    f.addInput(m, feed);
+    f.addOutput(m, mixed);
+    f.addInput(r, mixed);
+    f.addOutput(r, product);
+    f.addOutput(r, other);
+    f.setCache(&cache);
+
+    f.setMassFlow(feed, 10.0);
+    f.solve();
+    f.solve();
+    bool passed = cache.stats().hits == 2 && cache.stats().misses == 2 && f.getMassFlow(product) == 5.0;
+
+    f.setMassFlow(feed, 10.001);
+    f.solve();
+    passed = passed && cache.stats().hits == 4 && f.getMassFlow(product) == 5.0;
+
+    EvaluationCache exact(2, 0.0);
+    f.setCache(&exact);
+    f.solve();
+    passed = passed && exact.stats().misses == 2 && f.getMassFlow(product) == 10.001 / 2;
+
+    EvaluationCache tiny(4, 0.0);
+    Mixer mixer(1);
+    auto in = make_shared<Stream>(++streamcounter);
+    auto out = make_shared<Stream>(++streamcounter);
+    mixer.addInput(in);
+    mixer.addOutput(out);
+    for (int i = 0; i < 100; i++) {
+      in->setMassFlow(i);
+      mixer.updateOutputsCached(tiny);
+    }
+    in->setMassFlow(99);
+    mixer.updateOutputsCached(tiny);
+    passed = passed && tiny.capacity() == 4 && tiny.stats().evictions > 0 && tiny.stats().hits == 1 && out->getMassFlow() == 99;
+
+    if (passed) {
+      cout << "Cache test 1 passed"s << endl;
+    } else {
+      cout << "Cache test 1 failed"s << endl;
+    }
+}
+
+void shouldInvalidateCachedEvaluations() {
+    streamcounter=0;
+    EvaluationCache cache;
+    Flowsheet f;
+    StreamHandle feed = f.addStream();
+    StreamHandle product = f.addStream();
+    StreamHandle other = f.addStream();
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    f.addInput(r, feed);
+    f.addOutput(r, product);
+    f.addOutput(r, other);
+    f.setCache(&cache);
+
+    // Buckets are relative, so small flows are not all rounded to one result.
+    f.setMassFlow(feed, 0.001);
+    f.solve();
+    f.setMassFlow(feed, 0.004);
+    f.solve();
+    bool passed = cache.stats().hits == 0 && f.getMassFlow(product) == 0.002;
+
+    // New parameters must not reuse results of the old ones.
+    static_cast<Reactor&>(f.getDevice(r)).setSplitRatios({0.25, 0.75});
+    f.solve();
+    passed = passed && cache.stats().hits == 0 && f.getMassFlow(product) == 0.001;
+    f.solve();
+    passed = passed && cache.stats().hits == 1;
+
+    f.invalidateCache();
+    f.solve();
+    passed = passed && cache.stats().hits == 1 && f.getMassFlow(product) == 0.001;
+
+    if (passed) {
+      cout << "Cache test 2 passed"s << endl;
+    } else {
+      cout << "Cache test 2 failed"s << endl;
+    }
+}
+
+void shouldSolveAcrossPartitions() {
+    streamcounter=0;
+    Flowsheet serial, split;
+    vector<StreamHandle> products;
+    for (Flowsheet* f : {&serial, &split}) {
+      products.clear();
+      StreamHandle previous = f->addStream();
+      f->setMassFlow(previous, 1.0);
+      for (int i = 0; i < 30; i++) {
+        StreamHandle feed = f->addStream();
+        StreamHandle mixed = f->addStream();
+        StreamHandle next = f->addStream();
+        DeviceHandle m = f->addDevice<Mixer>(2);
+        DeviceHandle r = f->addDevice<Reactor>(true);
+        f->addInput(m, previous);
+        f->addInput(m, feed);
+        f->addOutput(m, mixed);
+        f->addInput(r, mixed);
+        f->addOutput(r, next);
+        products.push_back(f->addStream());
+        f->addOutput(r, products.back());
+        f->setMassFlow(feed, 1.0 + i % 3);
+        previous = next;
+      }
+    }
+    serial.solve();
+    Partitioning parts = split.partition(3);
+    LoopbackTransport transport;
+    const ConvergenceReport& report = split.solvePartitioned(parts, transport);
+
+    bool passed = parts.cutStreams.size() == 2 && report.converged;
+    for (StreamHandle s : products) passed = passed && abs(split.getMassFlow(s) - serial.getMassFlow(s)) < POSSIBLE_ERROR;
+
+    if (passed) {
+      cout << "Partition test 1 passed"s << endl;
+    } else {
+      cout << "Partition test 1 failed"s << endl;
+    }
+}
+
+void shouldConvergeRecycleAcrossPartitions() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 10.0);
+    Partitioning parts;
+    parts.parts = 2;
+    parts.partOf = {0, 1};
+    parts.cutStreams = {1, 3};
+    LoopbackTransport transport;
+    const ConvergenceReport& report = f.solvePartitioned(parts, transport);
+
+    if (report.converged && abs(f.getMassFlow(product) - 10.0) < 2 * POSSIBLE_ERROR && transport.messageCount() > 0) {
+      cout << "Partition test 2 passed"s << endl;
+    } else {
+      cout << "Partition test 2 failed"s << endl;
+    }
+}
+
+void shouldBuildFlowsheetsConcurrently() {
+    const size_t builders = 4;
+    const size_t count = 1000;
+    vector<Flowsheet> own(builders), shared(builders);
+    AtomicIdAllocator ids;
+    vector<thread> threads;
+    for (size_t t = 0; t < builders; t++) {
+      threads.emplace_back([&, t]{
+        shared[t].shareStreamIds(&ids);
+        for (size_t i = 0; i < count; i++) {
+          own[t].addStream();
+          shared[t].addStream();
+        }
+      });
+    }
+    for (thread& t : threads) t.join();
+
+    bool passed = ids.current() == builders * count;
+    vector<uint8_t> seen(builders * count + 1, 0);
+    for (size_t t = 0; t < builders; t++) {
+      passed = passed && own[t].getStreams().getName(count - 1) == "s"s + to_string(count)
+               && own[t].getStreamIds().current() == count;
+      for (StreamHandle s = 0; s < count; s++) {
+        int id = stoi(string(shared[t].getStreams().getName(s).substr(1)));
+        passed = passed && id > 0 && id <= builders * count && !seen[id];
+        seen[id] = 1;
+      }
+    }
+
+    if (passed) {
+      cout << "Stream id test 1 passed"s << endl;
+    } else {
+      cout << "Stream id test 1 failed"s << endl;
+    }
+}
+
+void shouldSplitInFlowsheet() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle feed = f.addStream();
+    vector<StreamHandle> parts;
+    DeviceHandle s = f.addDevice<Splitter>(vector<double>{0.5, 0.25, 0.25});
+    f.addInput(s, feed);
+    for (int i = 0; i < 3; i++) {
+      parts.push_back(f.addStream());
+      f.addOutput(s, parts.back());
+    }
+    f.setMassFlow(feed, 12.0);
+    f.solve();
+    bool passed = f.getMassFlow(parts[0]) == 6.0 && f.getMassFlow(parts[2]) == 3.0;
+
+    passed = passed && bool(f.freeze());
+    f.setMassFlow(feed, 4.0);
+    f.solve();
+    passed = passed && f.getMassFlow(parts[1]) == 1.0 && f.auditMassBalance().violations == 0;
+
+    ScenarioBatch batch = f.makeScenarios(100);
+    for (size_t j = 0; j < 100; j++) batch.column(feed)[j] = j;
+    f.solveScenarios(batch);
+    passed = passed && batch.column(parts[0])[99] == 49.5;
+
+    try {
+      Splitter({0.0, 0.0});
+      passed = false;
+    } catch (const string ex) {
+      passed = passed && ex == "Split ratios must sum to a positive value"s;
+    }
+
+    if (passed) {
+      cout << "Splitter test 2 passed"s << endl;
+    } else {
+      cout << "Splitter test 2 failed"s << endl;
+    }
+}
+
+void shouldRefactorAfterNewRatios() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle feed = f.addStream();
+    StreamHandle product = f.addStream();
+    StreamHandle other = f.addStream();
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    f.addInput(r, feed);
+    f.addOutput(r, product);
+    f.addOutput(r, other);
+    f.setMassFlow(feed, 10.0);
+    bool passed = bool(f.factorLinear());
+    f.solveLinear();
+    passed = passed && f.getMassFlow(product) == 5.0;
+
+    static_cast<Reactor&>(f.getDevice(r)).setSplitRatios({0.2, 0.8});
+    passed = passed && !f.isFactored();
+    f.solveLinear();
+    passed = passed && f.isFactored() && abs(f.getMassFlow(product) - 2.0) < POSSIBLE_ERROR;
+
+    if (passed) {
+      cout << "Splitter test 3 passed"s << endl;
+    } else {
+      cout << "Splitter test 3 failed"s << endl;
+    }
+}
+
+/**
+ * @class TemporaryFile
+ * @brief A unique file under /tmp for one test, removed when the test leaves its scope.
+ */
+class TemporaryFile
+{
+private:
+    string name;
+
+public:
+    /**
+     * @param prefix Start of the file name; mkstemp() makes the rest unique.
+     */
+    explicit TemporaryFile(const string& prefix) : name("/tmp/" + prefix + "XXXXXX") {
+        int fd = mkstemp(name.data());
+        if (fd < 0) throw "Cannot create temporary file"s;
+        close(fd);
+    }
+    TemporaryFile(const TemporaryFile&) = delete;
+    TemporaryFile& operator=(const TemporaryFile&) = delete;
+    ~TemporaryFile() {remove(name.c_str());}
+
+    const string& path() const {return name;}
+};
+
+void shouldRoundTripSnapshot() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 10.0);
+    f.solve();
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    f.saveSnapshot(path);
+
+    bool passed;
+    {
+      MappedSnapshot snapshot(path);
+      Flowsheet g;
+      g.loadSnapshot(snapshot);
+      passed = g.isCompiled() && g.getTearStreams() == f.getTearStreams() && g.getStreams().getName(product) == "s3"
+               && g.getMassFlow(product) == f.getMassFlow(product) && snapshot.flows()[product] == f.getMassFlow(product);
+
+      // The loaded plant behaves like the original after a feed change and after rewiring.
+      f.setMassFlow(0, 20.0);
+      g.setMassFlow(0, 20.0);
+      f.solve();
+      g.solve();
+      passed = passed && g.getMassFlow(product) == f.getMassFlow(product);
+      StreamHandle extra = g.addStream();
+      DeviceHandle r = g.addDevice<Reactor>(false);
+      g.addInput(r, product);
+      g.addOutput(r, extra);
+      g.solve();
+      passed = passed && abs(g.getMassFlow(extra) - 20.0) < POSSIBLE_ERROR && g.getStreams().getName(extra) == "s5";
+    }
+
+    if (passed) {
+      cout << "Snapshot test 1 passed"s << endl;
+    } else {
+      cout << "Snapshot test 1 failed"s << endl;
+    }
+}
+
+void shouldLoadSnapshotDevicesSeparately() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle feed = f.addStream();
+    StreamHandle a = f.addStream();
+    StreamHandle b = f.addStream();
+    StreamHandle c = f.addStream();
+    StreamHandle d = f.addStream();
+    DeviceHandle first = f.addDevice<Reactor>(true);
+    DeviceHandle second = f.addDevice<Reactor>(true);
+    f.addInput(first, feed);
+    f.addOutput(first, a);
+    f.addOutput(first, b);
+    f.addInput(second, a);
+    f.addOutput(second, c);
+    f.addOutput(second, d);
+    f.setMassFlow(feed, 10.0);
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    f.saveSnapshot(path);
+
+    bool passed;
+    {
+      MappedSnapshot snapshot(path);
+      Flowsheet g;
+      g.loadSnapshot(snapshot);
+      // Re-parameterising one loaded reactor must leave its twin alone.
+      static_cast<Reactor&>(g.getDevice(first)).setSplitRatios({0.2, 0.8});
+      g.solve();
+      passed = &g.getDevice(first) != &g.getDevice(second) && abs(g.getMassFlow(a) - 2.0) < POSSIBLE_ERROR
+               && abs(g.getMassFlow(c) - 1.0) < POSSIBLE_ERROR && abs(g.getMassFlow(d) - 1.0) < POSSIBLE_ERROR;
+    }
+
+    if (passed) {
+      cout << "Snapshot test 4 passed"s << endl;
+    } else {
+      cout << "Snapshot test 4 failed"s << endl;
+    }
+}
+
+void shouldRoundTripCompositionSnapshot() {
+    streamcounter=0;
+    const size_t n = 3;
+    Flowsheet f;
+    f.setComponentCount(n);
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    vector<double> feed{1.0, 2.0, 3.0};
+    f.setComposition(0, feed.data());
+    f.solve();
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    f.saveSnapshot(path);
+
+    MappedSnapshot snapshot(path);
+    Flowsheet g;
+    g.loadSnapshot(snapshot);
+    bool passed = g.componentCount() == n;
+    for (size_t i = 0; i < n; i++) passed = passed && g.getComposition(product)[i] == f.getComposition(product)[i];
+
+    // The loaded plant keeps solving on compositions.
+    feed[2] = 6.0;
+    f.setComposition(0, feed.data());
+    g.setComposition(0, feed.data());
+    f.solve();
+    g.solve();
+    passed = passed && abs(g.getComposition(product)[2] - 6.0) < POSSIBLE_ERROR
+             && g.getMassFlow(product) == f.getMassFlow(product);
+
+    if (passed) {
+      cout << "Snapshot test 5 passed"s << endl;
+    } else {
+      cout << "Snapshot test 5 failed"s << endl;
+    }
+}
+
+void shouldRoundTripDeviceParameters() {
+    streamcounter=0;
+    Flowsheet f;
+    f.setComponentCount(2);
+    StreamHandle feed = f.addStream();
+    StreamHandle a = f.addStream();
+    StreamHandle b = f.addStream();
+    StreamHandle c = f.addStream();
+    StreamHandle d = f.addStream();
+    StreamHandle e = f.addStream();
+    DeviceHandle splitter = f.addDevice<Splitter>(vector<double>{1.0, 3.0});
+    DeviceHandle split = f.addDevice<Reactor>(true);
+    DeviceHandle swap = f.addDevice<Reactor>(false);
+    f.addInput(splitter, feed);
+    f.addOutputs(splitter, vector<StreamHandle>{a, b});
+    f.addInput(split, a);
+    f.addOutputs(split, vector<StreamHandle>{c, d});
+    f.addInput(swap, b);
+    f.addOutput(swap, e);
+    static_cast<Reactor&>(f.getDevice(split)).setSplitRatios({0.2, 0.8});
+    static_cast<Reactor&>(f.getDevice(swap)).setStoichiometry({0.0, 1.0, 1.0, 0.0}, 2);
+    vector<double> composition{4.0, 8.0};
+    f.setComposition(feed, composition.data());
+    f.solve();
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    bool passed = bool(f.trySaveSnapshot(path));
+
+    MappedSnapshot snapshot(path);
+    Flowsheet g;
+    g.loadSnapshot(snapshot);
+    composition = {2.0, 6.0};
+    f.setComposition(feed, composition.data());
+    g.setComposition(feed, composition.data());
+    f.solve();
+    g.solve();
+    passed = passed && g.getDevice(splitter).typeId() == SPLITTER_TYPE
+             && static_cast<Splitter&>(g.getDevice(splitter)).getSplitRatios() == vector<double>{0.25, 0.75}
+             && static_cast<Reactor&>(g.getDevice(split)).getSplitRatios() == vector<double>{0.2, 0.8};
+    for (StreamHandle s : {c, d, e}) {
+      passed = passed && g.getComposition(s)[0] == f.getComposition(s)[0] && g.getComposition(s)[1] == f.getComposition(s)[1];
+    }
+    // The stoichiometry swaps the components of the larger splitter share.
+    passed = passed && abs(g.getComposition(e)[0] - 4.5) < POSSIBLE_ERROR;
+
+    if (passed) {
+      cout << "Snapshot test 6 passed"s << endl;
+    } else {
+      cout << "Snapshot test 6 failed"s << endl;
+    }
+}
+
+void shouldRejectForeignSnapshot() {
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    {
+      ofstream file(path, ios::binary);
+      file << "definitely not a snapshot, just some text that is long enough for a header";
+    }
+
+    try {
+      MappedSnapshot snapshot(path);
+    } catch (const string ex) {
+        if (ex == "Not a flowsheet snapshot"s) {
+        cout << "Snapshot test 2 passed"s << endl;
+
+        return;
+      }
+    }
+
+    cout << "Snapshot test 2 failed"s << endl;
+}
+
+void shouldRejectCorruptSnapshot() {
+    streamcounter=0;
+    Flowsheet f;
+    buildHalfRecycle(f, 10.0);
+    f.solve();
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    f.saveSnapshot(path);
+    string image;
+    {
+      ifstream file(path, ios::binary);
+      image.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+    SnapshotHeader h;
+    memcpy(&h, image.data(), sizeof(h));
+    SnapshotLayout layout(h);
+
+    // Each corruption alone must be rejected by the constructor, before any array is read.
+    auto rejects = [&](const function<void(string&)>& corrupt) {
+      string copy = image;
+      corrupt(copy);
+      {
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(copy.data(), copy.size());
+      }
+      try {
+        MappedSnapshot snapshot(path);
+      } catch (const string ex) {
+        return ex == "Corrupt snapshot"s;
+      }
+      return false;
+    };
+    auto put = [](string& copy, uint64_t offset, auto value) {memcpy(copy.data() + offset, &value, sizeof(value));};
+
+    bool passed = !rejects([](string&) {});
+    passed = passed && rejects([&](string& c) {put(c, offsetof(SnapshotHeader, streamCount), uint64_t(1) << 61);});
+    passed = passed && rejects([&](string& c) {put(c, layout.tears, uint32_t(1000));});
+    passed = passed && rejects([&](string& c) {put(c, layout.consumers, uint32_t(h.deviceCount));});
+    passed = passed && rejects([&](string& c) {put(c, layout.levelEntries, uint32_t(h.deviceCount));});
+    passed = passed && rejects([&](string& c) {put(c, layout.inOffsets + sizeof(uint32_t), uint32_t(h.inPortCount + 1));});
+    passed = passed && rejects([&](string& c) {put(c, layout.order, uint32_t(h.deviceCount > 1 ? 1 : 0));
+                                               put(c, layout.order + sizeof(uint32_t), uint32_t(1));});
+
+    if (passed) {
+      cout << "Snapshot test 3 passed"s << endl;
+    } else {
+      cout << "Snapshot test 3 failed"s << endl;
+    }
+}
+
+void shouldSaveStreamsAddedAfterSolve() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle product = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    f.addInputs(m, vector<StreamHandle>{s1, s2});
+    f.addOutput(m, product);
+    f.setMassFlow(s1, 1.0);
+    f.setMassFlow(s2, 2.0);
+    f.solve();
+    // The new stream is not in the plan of the solve, so saving has to compile again.
+    StreamHandle extra = f.addStream();
+    f.setMassFlow(extra, 5.0);
+    TemporaryFile snapshotFile("flowsheet_snapshot_");
+    const string& path = snapshotFile.path();
+    f.saveSnapshot(path);
+
+    bool passed = false;
+    try {
+      MappedSnapshot snapshot(path);
+      Flowsheet g;
+      g.loadSnapshot(snapshot);
+      g.solve();
+      passed = abs(g.getMassFlow(product) - 3.0) < POSSIBLE_ERROR && g.getMassFlow(extra) == 5.0;
+    } catch (const string ex) {
+    }
+
+    if (passed) {
+      cout << "Snapshot test 7 passed"s << endl;
+    } else {
+      cout << "Snapshot test 7 failed"s << endl;
+    }
+}
+
+void shouldSolveScenariosLikeSingleSolves() {
+    streamcounter=0;
+    Flowsheet f;
+
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    StreamHandle s4 = f.addStream();
+    StreamHandle s5 = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice<Reactor>(true);
+    f.addInput(m, s1);
+    f.addInput(m, s2);
+    f.addOutput(m, s3);
+    f.addInput(r, s3);
+    f.addOutput(r, s4);
+    f.addOutput(r, s5);
+
+    const size_t scenarios = 1000;
+    ScenarioBatch batch = f.makeScenarios(scenarios);
+    for (size_t j = 0; j < scenarios; j++) {
+      batch.setMassFlow(s1, j, 0.01 * j);
+      batch.setMassFlow(s2, j, 1.0 / (j + 1));
+    }
+    bool passed = f.solveScenarios(batch).converged;
+
+    for (size_t j = 0; j < scenarios; j += 37) {
+      f.setMassFlow(s1, 0.01 * j);
+      f.setMassFlow(s2, 1.0 / (j + 1));
+      f.solve();
+      passed = passed && batch.getMassFlow(s4, j) == f.getMassFlow(s4) && batch.getMassFlow(s5, j) == f.getMassFlow(s5);
+    }
+
+    if (passed) {
+      cout << "Scenario test 1 passed"s << endl;
+    } else {
+      cout << "Scenario test 1 failed"s << endl;
+    }
+}
+
+void shouldConvergeRecycleForEveryScenario() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    StreamHandle feed = 0;
+
+    const size_t scenarios = 700;
+    ScenarioBatch batch = f.makeScenarios(scenarios);
+    for (size_t j = 0; j < scenarios; j++) batch.setMassFlow(feed, j, j);
+    const ConvergenceReport& report = f.solveScenarios(batch);
+
+    bool passed = report.converged;
+    for (size_t j = 0; j < scenarios; j++) passed = passed && abs(batch.getMassFlow(product, j) - j) < POSSIBLE_ERROR;
+
+    if (passed) {
+      cout << "Scenario test 2 passed"s << endl;
+    } else {
+      cout << "Scenario test 2 failed"s << endl;
+    }
+}
+
+void shouldSolveLinearFlowsheetDirectly() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 10.0);
+    StreamHandle feed = 0;
+    StreamHandle recycle = 3;
+    DeviceHandle bleed = f.addDevice<Splitter>(vector<double>{1.0, 3.0});
+    StreamHandle purge = f.addStream();
+    StreamHandle rest = f.addStream();
+    f.addInput(bleed, product);
+    f.addOutput(bleed, purge);
+    f.addOutput(bleed, rest);
+
+    f.solve();
+    double iterated = f.getMassFlow(recycle);
+    bool factoredOnce = f.factorLinear() && f.isFactored();
+    const ConvergenceReport& report = f.solveLinear();
+    bool passed = report.converged && report.iterations == 1 && abs(f.getMassFlow(recycle) - iterated) < POSSIBLE_ERROR
+                  && abs(f.getMassFlow(purge) - 2.5) < POSSIBLE_ERROR;
+
+    // A new feed only changes the right-hand side.
+    f.setMassFlow(feed, 4.0);
+    f.solveLinear();
+    passed = passed && f.isFactored() && abs(f.getMassFlow(product) - 4.0) < POSSIBLE_ERROR
+             && abs(f.getMassFlow(rest) - 3.0) < POSSIBLE_ERROR && abs(f.getMassFlow(recycle) - 4.0) < POSSIBLE_ERROR;
+
+    if (factoredOnce && passed) {
+      cout << "Linear solve test 1 passed"s << endl;
+    } else {
+      cout << "Linear solve test 1 failed"s << endl;
+    }
+}
+
+void shouldSolveLinearScenariosAndRejectOtherBalances() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    StreamHandle feed = 0;
+
+    const size_t scenarios = 37;
+    ScenarioBatch batch = f.makeScenarios(scenarios);
+    for (size_t j = 0; j < scenarios; j++) batch.setMassFlow(feed, j, j);
+    f.solveLinearScenarios(batch);
+    bool passed = true;
+    for (size_t j = 0; j < scenarios; j++) passed = passed && abs(batch.getMassFlow(product, j) - j) < POSSIBLE_ERROR;
+
+    Flowsheet closed;
+    StreamHandle s1 = closed.addStream();
+    StreamHandle s2 = closed.addStream();
+    StreamHandle s3 = closed.addStream();
+    DeviceHandle m = closed.addDevice<Mixer>(2);
+    DeviceHandle r = closed.addDevice<Reactor>(false);
+    closed.addInput(m, s1);
+    closed.addInput(m, s3);
+    closed.addOutput(m, s2);
+    closed.addInput(r, s2);
+    closed.addOutput(r, s3);
+    Status singular = closed.factorLinear();
+
+    f.setComponentCount(2);
+    Status components = f.factorLinear();
+
+    if (passed && singular.error() == DeviceError::SingularBalance && components.error() == DeviceError::NotLinear
+        && !f.isFactored()) {
+      cout << "Linear solve test 2 passed"s << endl;
+    } else {
+      cout << "Linear solve test 2 failed"s << endl;
+    }
+}
+
+void shouldFallBackToIterationForNearTotalRecycles() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 1.0);
+    DeviceHandle r = 1;
+    static_cast<Reactor&>(f.getDevice(r)).setSplitRatios({1e-11, 1.0 - 1e-11});
+    f.setConvergence(ConvergenceMethod::Anderson);
+
+    // The pivot of the recycle row is 1e-11 of its row, below the relative threshold, so the
+    // solve iterates; the recycle carries 1e11 times the feed, which bounds the accuracy.
+    Status status = f.factorLinear();
+    const ConvergenceReport& report = f.solveLinear();
+    bool passed = status.error() == DeviceError::SingularBalance && !f.isFactored() && report.converged
+                  && report.iterations > 1 && abs(f.getMassFlow(product) - 1.0) < 1e-3;
+
+    // A better conditioned split is factored again.
+    static_cast<Reactor&>(f.getDevice(r)).setSplitRatios({0.5, 0.5});
+    f.solveLinear();
+    passed = passed && f.isFactored() && abs(f.getMassFlow(product) - 1.0) < POSSIBLE_ERROR;
+
+    if (passed) {
+      cout << "Linear solve test 3 passed"s << endl;
+    } else {
+      cout << "Linear solve test 3 failed"s << endl;
+    }
+}
+
+void shouldScreenScenariosInFloat() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    StreamHandle feed = 0;
+
+    const size_t scenarios = 1500;
+    ScreeningBatch screen = f.makeScenarios<float>(scenarios);
+    for (size_t j = 0; j < scenarios; j++) screen.setMassFlow(feed, j, 1.0 + j % 50);
+    const ConvergenceReport& screened = f.solveScenarios(screen);
+    bool passed = screened.converged && sizeof(*screen.data()) == sizeof(float);
+    for (size_t j = 0; j < scenarios; j++) {
+      passed = passed && abs(screen.getMassFlow(product, j) - (1.0 + j % 50)) < POSSIBLE_ERROR;
+    }
+    size_t screenedIterations = screened.iterations;
+
+    // Verified in double from the screened values, the recycles are nearly converged already.
+    ScenarioBatch verified = screen.converted<double>();
+    const ConvergenceReport& refined = f.solveScenarios(verified);
+    passed = passed && refined.converged && refined.iterations < screenedIterations;
+    for (size_t j = 0; j < scenarios; j++) {
+      passed = passed && abs(verified.getMassFlow(product, j) - (1.0 + j % 50)) < POSSIBLE_ERROR;
+    }
+
+    if (passed) {
+      cout << "Screening test 1 passed"s << endl;
+    } else {
+      cout << "Screening test 1 failed"s << endl;
+    }
+}
+
+void shouldDifferentiateWithDualNumbers() {
+    Dual<2> x(3.0), y(2.0);
+    x.d[0] = 1.0;
+    y.d[1] = 1.0;
+    Dual<2> q = x * y / (x + y);
+    // q = xy / (x + y): dq/dx = y^2 / (x + y)^2, dq/dy = x^2 / (x + y)^2.
+    bool passed = abs(q.value - 1.2) < 1e-12 && abs(q.d[0] - 0.16) < 1e-12 && abs(q.d[1] - 0.36) < 1e-12;
+
+    Flowsheet f;
+    StreamHandle a = f.addStream();
+    StreamHandle b = f.addStream();
+    StreamHandle mixed = f.addStream();
+    StreamHandle light = f.addStream();
+    StreamHandle heavy = f.addStream();
+    DeviceHandle m = f.addDevice<Mixer>(2);
+    DeviceHandle r = f.addDevice(make_shared<Reactor>(true));
+    static_cast<Reactor&>(f.getDevice(r)).setSplitRatios({0.2, 0.8});
+    f.addInputs(m, vector<StreamHandle>{a, b});
+    f.addOutput(m, mixed);
+    f.addInput(r, mixed);
+    f.addOutputs(r, vector<StreamHandle>{light, heavy});
+    f.setMassFlow(a, 3.0);
+    f.setMassFlow(b, 4.0);
+    f.solve();
+
+    Jacobian j = f.sensitivities({a, b});
+    passed = passed && j.converged && j.sweeps == 1 && j.derivative(mixed, 0) == 1.0 && j.derivative(light, 1) == 0.2
+             && j.derivative(heavy, 0) == 0.8 && j.derivative(a, 1) == 0.0;
+
+    if (passed) {
+      cout << "Sensitivity test 1 passed"s << endl;
+    } else {
+      cout << "Sensitivity test 1 failed"s << endl;
+    }
+}
+
+void shouldDifferentiateRecyclesAndManyFeeds() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 10.0);
+    StreamHandle feed = 0;
+    StreamHandle recycle = 3;
+    f.solve();
+    Jacobian loop = f.sensitivities({feed});
+
+    // More feeds than one dual carries: the feeds are swept in chunks.
+    Flowsheet wide;
+    const size_t count = DUAL_DIRECTIONS * 2 + 3;
+    vector<StreamHandle> feeds(count);
+    for (size_t i = 0; i < count; i++) feeds[i] = wide.addStream();
+    StreamHandle total = wide.addStream();
+    DeviceHandle m = wide.addDevice<Mixer>(count);
+    wide.addInputs(m, feeds);
+    wide.addOutput(m, total);
+    wide.solve();
+    Jacobian chunked = wide.sensitivities(feeds);
+
+    bool passed = loop.converged && abs(loop.derivative(product, 0) - 1.0) < POSSIBLE_ERROR
+                  && abs(loop.derivative(recycle, 0) - 1.0) < POSSIBLE_ERROR && chunked.sweeps == 3;
+    for (size_t i = 0; i < count; i++) passed = passed && chunked.derivative(total, i) == 1.0;
+
+    if (passed) {
+      cout << "Sensitivity test 2 passed"s << endl;
+    } else {
+      cout << "Sensitivity test 2 failed"s << endl;
+    }
+}
+
+void shouldStreamHistoryInChunks() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle product = buildHalfRecycle(f, 0.0);
+    StreamHandle feed = 0;
+    TemporaryFile historyFile("flowsheet_history_");
+    const string& path = historyFile.path();
+
+    const size_t steps = 250;
+    SimulationReport report;
+    {
+      FileSink sink(path);
+      HistoryWriter history(sink, f.getStreams().size(), 64, 2);
+      report = f.simulate({feed}, steps, [](size_t t, double* values) { values[0] = 1.0 + t % 10; }, history);
+    }
+
+    ifstream in(path, ios::binary);
+    HistoryChunkHeader header;
+    vector<double> values;
+    vector<size_t> sizes;
+    bool passed = report.steps == steps && report.unconvergedSteps == 0;
+    while (readHistoryChunk(in, header, values)) {
+      passed = passed && header.firstStep == 64 * sizes.size() && header.streamCount == 4;
+      for (size_t j = 0; j < header.steps; j++) {
+        double expected = 1.0 + (header.firstStep + j) % 10;
+        passed = passed && values[feed * header.steps + j] == expected
+                 && abs(values[product * header.steps + j] - expected) < POSSIBLE_ERROR;
+      }
+      sizes.push_back(header.steps);
+    }
+    in.close();
+
+    if (passed && sizes == vector<size_t>{64, 64, 64, 58}) {
+      cout << "History test 1 passed"s << endl;
+    } else {
+      cout << "History test 1 failed"s << endl;
+    }
+}
+
+/**
+ * @brief Sink that accepts a fixed number of writes and then fails like a closed socket.
+ */
+class FailingSink : public HistorySink
+{
+public:
+    size_t allowed;
+    size_t bytes = 0;
+    explicit FailingSink(size_t writes): allowed(writes) {}
+    void write(const char* data, size_t size) override {
+        if (allowed == 0) throwError(DeviceError::CannotWriteHistory);
+        allowed--;
+        bytes += size;
+    }
+};
+
+void shouldReportFailingHistorySink() {
+    streamcounter=0;
+    Flowsheet f;
+    buildHalfRecycle(f, 0.0);
+    FailingSink sink(2);
+    HistoryWriter history(sink, f.getStreams().size(), 16, 2);
+
+    string error;
+    try {
+      f.simulate({0}, vector<double>(100, 1.0), history);
+    } catch (const string& e) {
+      error = e;
+    }
+
+    if (error == "Cannot write stream history" && sink.bytes == sizeof(HistoryChunkHeader) + 4 * 16 * sizeof(double)) {
+      cout << "History test 2 passed"s << endl;
+    } else {
+      cout << "History test 2 failed"s << endl;
+    }
+}
+
+void shouldRejectOversizedHistoryChunk() {
+    HistoryChunkHeader header;
+    memcpy(header.magic, HistoryChunkHeader::MAGIC, sizeof(header.magic));
+    header.byteOrder = 0x01020304;
+    header.firstStep = 0;
+
+    // Sizes whose product overflows or would allocate far beyond any written chunk.
+    bool passed = true;
+    for (auto [streamCount, steps] : {pair<uint64_t, uint32_t>{uint64_t(1) << 61, 16}, {uint64_t(1) << 20, 1u << 20}}) {
+      header.streamCount = streamCount;
+      header.steps = steps;
+      istringstream in(string(reinterpret_cast<const char*>(&header), sizeof(header)));
+      vector<double> values;
+      string error;
+      try {
+        readHistoryChunk(in, header, values);
+      } catch (const string& e) {
+        error = e;
+      }
+      passed = passed && error == "Not a stream history" && values.empty();
+    }
+
+    if (passed) {
+      cout << "History test 3 passed"s << endl;
+    } else {
+      cout << "History test 3 failed"s << endl;
+    }
+}
+
+void shouldMatchScalarMixersInBank() {
+    streamcounter=0;
+    const size_t count = 37;
+    MixerBank bank(count, 3);
+    vector<double> expected(count);
+    for (size_t i = 0; i < count; i++) {
+      Mixer d1 = Mixer(3);
+      shared_ptr<Stream> out(new Stream(++streamcounter));
+      for (size_t k = 0; k < 3; k++) {
+        shared_ptr<Stream> in(new Stream(++streamcounter));
+        in->setMassFlow(0.1 * i + 1.0 / (k + 3));
+        bank.setInput(i, k, in->getMassFlow());
+        d1.addInput(in);
+      }
+      d1.addOutput(out);
+      d1.updateOutputs();
+      expected[i] = out->getMassFlow();
+    }
+
+    bool passed = true;
+    SimdPath best = bestSimdPath();
+    for (SimdPath path : {SimdPath::Scalar, SimdPath::Avx2, SimdPath::Avx512}) {
+      if (path > best) continue;
+      bank.updateOutputs(path);
+      for (size_t i = 0; i < count; i++) passed = passed && bank.getOutput(i, 0) == expected[i];
+    }
+
+    if (passed) {
+      cout << "Mixer bank test 1 passed"s << endl;
+    } else {
+      cout << "Mixer bank test 1 failed"s << endl;
+    }
+}
+
+void shouldMatchScalarSplittersInBank() {
+    streamcounter=0;
+    const size_t count = 37;
+    vector<double> ratios = {0.5, 0.3, 0.2};
+    SplitterBank bank(count, ratios);
+    vector<array<double, 3>> expected(count);
+    for (size_t i = 0; i < count; i++) {
+      Splitter splitter(ratios);
+      shared_ptr<Stream> in(new Stream(++streamcounter));
+      in->setMassFlow(0.1 * i + 1.0 / 3);
+      bank.setInput(i, in->getMassFlow());
+      splitter.addInput(in);
+      vector<shared_ptr<Stream>> outs;
+      for (size_t j = 0; j < 3; j++) {
+        outs.push_back(shared_ptr<Stream>(new Stream(++streamcounter)));
+        splitter.addOutput(outs.back());
+      }
+      splitter.updateOutputs();
+      for (size_t j = 0; j < 3; j++) expected[i][j] = outs[j]->getMassFlow();
+    }
+
+    bool passed = true;
+    SimdPath best = bestSimdPath();
+    for (SimdPath path : {SimdPath::Scalar, SimdPath::Avx2, SimdPath::Avx512}) {
+      if (path > best) continue;
+      bank.updateOutputs(path);
+      for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < 3; j++) passed = passed && bank.getOutput(i, j) == expected[i][j];
+      }
+    }
+
+    if (passed) {
+      cout << "Splitter bank test 1 passed"s << endl;
+    } else {
+      cout << "Splitter bank test 1 failed"s << endl;
+    }
+}
+
+/**
+ * @class StaticDevice
+ * @brief CRTP base for devices with port counts fixed at compile time.
+ *
+ * Derived classes provide a constexpr static compute() from an array of input flows to
+ * an array of output flows. Calls to it are resolved statically, so chains of static
+ * devices inline and unroll completely. Through the Device interface a static device
+ * can still be wired with streams or placed in a Flowsheet.
+ */
+template <class Derived, size_t Inputs, size_t Outputs>
+class StaticDevice : public Device
+{
+public:
+    static constexpr size_t INPUTS = Inputs;   ///< Number of input streams.
+    static constexpr size_t OUTPUTS = Outputs; ///< Number of output streams.
+
+    StaticDevice() {
+        inputAmount = Inputs;
+        outputAmount = Outputs;
+    }
+
+    Status checkPorts(size_t inCount, size_t outCount) const override {
+        if (inCount != Inputs || outCount != Outputs) return DeviceError::UnconnectedPorts;
+        return {};
+    }
+
+    bool isDeterministic() const override {return true;}
+
+    void updateOutputs() override {
+        if (inputs.size() != Inputs || outputs.size() != Outputs) {
+          throwError(DeviceError::UnconnectedPorts);
+        }
+        array<double, Inputs> in;
+        for (size_t i = 0; i < Inputs; i++) in[i] = inputs[i]->getMassFlow();
+        array<double, Outputs> out = Derived::compute(in);
+        for (size_t i = 0; i < Outputs; i++) outputs[i]->setMassFlow(out[i]);
+    }
+
+    void evaluate(double* flows, const StreamHandle* in, size_t inCount,
+                  const StreamHandle* out, size_t outCount) const override {
+        if (inCount != Inputs || outCount != Outputs) {
+          throwError(DeviceError::UnconnectedPorts);
+        }
+        array<double, Inputs> x;
+        for (size_t i = 0; i < Inputs; i++) x[i] = flows[in[i]];
+        array<double, Outputs> y = Derived::compute(x);
+        for (size_t i = 0; i < Outputs; i++) flows[out[i]] = y[i];
+    }
+
+    void evaluateColumns(double* values, size_t stride, size_t lanes, const StreamHandle* in, size_t inCount,
+                         const StreamHandle* out, size_t outCount) const override {
+        if (inCount != Inputs || outCount != Outputs) {
+          throwError(DeviceError::UnconnectedPorts);
+        }
+        for (size_t j = 0; j < lanes; j++) {
+          array<double, Inputs> x;
+          for (size_t i = 0; i < Inputs; i++) x[i] = values[in[i] * stride + j];
+          array<double, Outputs> y = Derived::compute(x);
+          for (size_t i = 0; i < Outputs; i++) values[out[i] * stride + j] = y[i];
+        }
+    }
+};
+
+/**
+ * @class StaticMixer
+ * @brief Mixer with N inputs known at compile time.
+ */
+template <size_t N>
+class StaticMixer : public StaticDevice<StaticMixer<N>, N, MIXER_OUTPUTS>
+{
+public:
+    static constexpr array<double, MIXER_OUTPUTS> compute(const array<double, N>& in) {
+        double sum_mass_flow = 0;
+        for (size_t i = 0; i < N; i++) sum_mass_flow += in[i];
+        array<double, MIXER_OUTPUTS> out{};
+        for (size_t i = 0; i < MIXER_OUTPUTS; i++) out[i] = sum_mass_flow / MIXER_OUTPUTS;
+        return out;
+    }
+};
+
+/**
+ * @class StaticReactor
+ * @brief Reactor splitting its input equally into a compile-time number of outputs.
+ */
+template <size_t Outputs>
+class StaticReactor : public StaticDevice<StaticReactor<Outputs>, 1, Outputs>
+{
+public:
+    static_assert(Outputs > 0, "Reactor needs at least one output");
+
+    static constexpr array<double, Outputs> compute(const array<double, 1>& in) {
+        array<double, Outputs> out{};
+        for (size_t i = 0; i < Outputs; i++) out[i] = in[0] * (1.0/Outputs);
+        return out;
+    }
+};
+
+/**
+ * @brief Composition of static stages; the outputs of each stage feed the inputs of the next in order.
+ */
+template <class First, class... Rest>
+struct StaticChain
+{
+    using Tail = StaticChain<Rest...>;
+    static_assert(First::OUTPUTS == Tail::INPUTS, "Stage outputs must match the inputs of the next stage");
+    static constexpr size_t INPUTS = First::INPUTS;
+    static constexpr size_t OUTPUTS = Tail::OUTPUTS;
+
+    static constexpr array<double, OUTPUTS> compute(const array<double, INPUTS>& in) {
+        return Tail::compute(First::compute(in));
+    }
+};
+
+template <class Last>
+struct StaticChain<Last>
+{
+    static constexpr size_t INPUTS = Last::INPUTS;
+    static constexpr size_t OUTPUTS = Last::OUTPUTS;
+
+    static constexpr array<double, OUTPUTS> compute(const array<double, INPUTS>& in) {
+        return Last::compute(in);
+    }
+};
+
+/**
+ * @class StaticPipeline
+ * @brief A fixed flowsheet section evaluated as one device with no virtual dispatch inside.
+ *
+ * Example: StaticPipeline<StaticMixer<2>, StaticReactor<2>> mixes two feeds and splits the mix in two.
+ */
+template <class... Stages>
+class StaticPipeline : public StaticDevice<StaticPipeline<Stages...>, StaticChain<Stages...>::INPUTS,
+                                           StaticChain<Stages...>::OUTPUTS>
+{
+public:
+    using Chain = StaticChain<Stages...>;
+
+    static constexpr array<double, Chain::OUTPUTS> compute(const array<double, Chain::INPUTS>& in) {
+        return Chain::compute(in);
+    }
+};
+
+static_assert(StaticPipeline<StaticMixer<2>, StaticReactor<2>>::compute({10.0, 5.0})[1] == 7.5);
+
+void shouldMatchDynamicDevicesInStaticPipeline() {
+    streamcounter=0;
+    Mixer d1 = Mixer(2);
+    Reactor d2(true);
+    StaticPipeline<StaticMixer<2>, StaticReactor<2>> pipeline;
+
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    shared_ptr<Stream> s4(new Stream(++streamcounter));
+    shared_ptr<Stream> s5(new Stream(++streamcounter));
+    shared_ptr<Stream> s6(new Stream(++streamcounter));
+    shared_ptr<Stream> s7(new Stream(++streamcounter));
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+    d2.addInput(s3);
+    d2.addOutput(s4);
+    d2.addOutput(s5);
+    pipeline.addInput(s1);
+    pipeline.addInput(s2);
+    pipeline.addOutput(s6);
+    pipeline.addOutput(s7);
+
+    d1.updateOutputs();
+    d2.updateOutputs();
+    pipeline.updateOutputs();
+
+    if (s6->getMassFlow() == s4->getMassFlow() && s7->getMassFlow() == s5->getMassFlow()) {
+      cout << "Static pipeline test 1 passed"s << endl;
+    } else {
+      cout << "Static pipeline test 1 failed"s << endl;
+    }
+}
+
+void shouldRunStaticPipelineInFlowsheet() {
+    streamcounter=0;
+    Flowsheet f;
+
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    StreamHandle s4 = f.addStream();
+    StreamHandle s5 = f.addStream();
+    DeviceHandle p = f.addDevice<StaticPipeline<StaticMixer<2>, StaticReactor<2>>>();
+    DeviceHandle m = f.addDevice<StaticMixer<2>>();
+    f.addInput(p, s1);
+    f.addInput(p, s2);
+    f.addOutput(p, s3);
+    f.addOutput(p, s4);
+    f.addInput(m, s3);
+    f.addInput(m, s4);
+    f.addOutput(m, s5);
+    f.setMassFlow(s1, 10.0);
+    f.setMassFlow(s2, 5.0);
+
+    f.solve();
+
+    try {
+      f.addInput(m, s1);
+    } catch (const string ex) {
+      if (ex == "INPUT STREAM LIMIT!"s && abs(f.getMassFlow(s5) - 15.0) < POSSIBLE_ERROR) {
+        cout << "Static pipeline test 2 passed"s << endl;
+
+        return;
+      }
+    }
+
+    cout << "Static pipeline test 2 failed"s << endl;
+}
+
+void shouldScreenDevicesWithoutFloatKernels() {
+    streamcounter=0;
+    Flowsheet f;
+    StreamHandle s1 = f.addStream();
+    StreamHandle s2 = f.addStream();
+    StreamHandle s3 = f.addStream();
+    StreamHandle s4 = f.addStream();
+    DeviceHandle p = f.addDevice<StaticPipeline<StaticMixer<2>, StaticReactor<2>>>();
+    f.addInputs(p, vector<StreamHandle>{s1, s2});
+    f.addOutputs(p, vector<StreamHandle>{s3, s4});
+
+    const size_t scenarios = 100;
+    ScreeningBatch screen = f.makeScenarios<float>(scenarios);
+    ScenarioBatch exact = f.makeScenarios(scenarios);
+    for (size_t j = 0; j < scenarios; j++) {
+      screen.setMassFlow(s1, j, 0.1 * j);
+      screen.setMassFlow(s2, j, 3.0);
+      exact.setMassFlow(s1, j, 0.1 * j);
+      exact.setMassFlow(s2, j, 3.0);
+    }
+    f.solveScenarios(screen);
+    f.solveScenarios(exact);
+
+    bool passed = true;
+    for (size_t j = 0; j < scenarios; j++) {
+      passed = passed && abs(screen.getMassFlow(s3, j) - exact.getMassFlow(s3, j)) < 1e-5
+               && abs(screen.getMassFlow(s4, j) - exact.getMassFlow(s4, j)) < 1e-5;
+    }
+
+    if (passed) {
+      cout << "Screening test 2 passed"s << endl;
+    } else {
+      cout << "Screening test 2 failed"s << endl;
+    }
+}
+
+void tests(){
+    testInputEqualOutput();
     testTooManyOutputStreams();
     testTooManyInputStreams();
     
     shouldSetOutputsCorrectlyWithOneOutput();
     shouldCorrectOutputs();
     shouldCorrectInputs();
+
+    shouldSplitByRatios();
+
+    shouldInternStreamNames();
+    shouldSolveChainInTopologicalOrder();
+    shouldKeepOrderUntilWiringChanges();
+    shouldReportNonConvergingRecycle();
+    shouldRecomputeOnlyDownstreamCone();
+    shouldStopPropagationWhenOutputUnchanged();
+    shouldConvergeRecycleWithEveryMethod();
+    shouldMatchSerialResultsInParallel();
+    shouldReportPortErrorsWithoutThrowing();
+    shouldValidateFlowsheetWithoutThrowing();
+    shouldReportParameterErrorsWithoutThrowing();
+    shouldWireDevicePortsInBulk();
+    shouldKeepFewPortsInline();
+    shouldWireFlowsheetPortsInBulk();
+    shouldWireMixerThroughDevice();
+    shouldBuildFlowsheetInArena();
+    shouldSolveFrozenFlowsheetLikeChecked();
+    shouldMixAndReactCompositions();
+    shouldConvergeRecycleOnCompositions();
+    shouldFindWorstMassBalanceOffender();
+    shouldPublishConsistentTables();
+    shouldOverlapSlowDevices();
+    shouldConvergeRecycleThroughAsyncDevice();
+    shouldReuseCachedEvaluations();
+    shouldInvalidateCachedEvaluations();
+    shouldSolveAcrossPartitions();
+    shouldConvergeRecycleAcrossPartitions();
+    shouldSplitInFlowsheet();
+    shouldRefactorAfterNewRatios();
+    shouldBuildFlowsheetsConcurrently();
+#ifdef DEVICE_PROFILE
+    shouldCountDeviceEvaluations();
+#endif
+    shouldRoundTripSnapshot();
+    shouldRejectForeignSnapshot();
+    shouldRejectCorruptSnapshot();
+    shouldSaveStreamsAddedAfterSolve();
+    shouldLoadSnapshotDevicesSeparately();
+    shouldRoundTripCompositionSnapshot();
+    shouldRoundTripDeviceParameters();
+    shouldSolveScenariosLikeSingleSolves();
+    shouldConvergeRecycleForEveryScenario();
+    shouldSolveLinearFlowsheetDirectly();
+    shouldSolveLinearScenariosAndRejectOtherBalances();
+    shouldFallBackToIterationForNearTotalRecycles();
+    shouldScreenScenariosInFloat();
+    shouldDifferentiateWithDualNumbers();
+    shouldDifferentiateRecyclesAndManyFeeds();
+    shouldStreamHistoryInChunks();
+    shouldReportFailingHistorySink();
+    shouldRejectOversizedHistoryChunk();
+
+    shouldLoadFlowsheetFromText();
+    shouldGenerateReproducibleWorkloads();
+    shouldReportLineOfPortLimitViolation();
+
+    shouldMatchScalarMixersInBank();
+    shouldMatchScalarSplittersInBank();
+
+    shouldMatchDynamicDevicesInStaticPipeline();
+    shouldRunStaticPipelineInFlowsheet();
+    shouldScreenDevicesWithoutFloatKernels();
+}
+
+#ifdef DEVICE_BENCHMARK
+/**
+ * @brief Print one benchmark result as a CSV row: benchmark,units,repetitions,ns_per_unit.
+ */
+void reportBenchmark(const string& name, size_t units, size_t repetitions, double seconds) {
+    printf("%s,%zu,%zu,%.3f\n", name.c_str(), units, repetitions, seconds * 1e9 / (double(units) * repetitions));
+}
+
+/**
+ * @brief Run f() repeatedly and return the elapsed wall time in seconds.
+ */
+template <class F>
+double timeBenchmark(size_t repetitions, F f) {
+    auto start = chrono::steady_clock::now();
+    for (size_t r = 0; r < repetitions; r++) f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+double benchmarkSink; ///< Keeps benchmarked results observable.
+
+/**
+ * @brief Build a plant of mixer/reactor pairs; each mixer takes a fresh feed and the previous reactor's first output.
+ * @param units Number of devices, rounded down to an even count.
+ */
+void buildBenchmarkPlant(Flowsheet& f, size_t units) {
+    size_t pairs = units / 2;
+    f.reserve(3 * pairs + 1, 2 * pairs, 3 * pairs);
+    StreamHandle previous = f.addStream();
+    f.setMassFlow(previous, 1.0);
+    for (size_t i = 0; i < pairs; i++) {
+      StreamHandle feed = f.addStream();
+      StreamHandle mixed = f.addStream();
+      StreamHandle next = f.addStream();
+      StreamHandle product = f.addStream();
+      DeviceHandle m = f.addDevice<Mixer>(2);
+      DeviceHandle r = f.addDevice<Reactor>(true);
+      f.addInput(m, previous);
+      f.addInput(m, feed);
+      f.addOutput(m, mixed);
+      f.addInput(r, mixed);
+      f.addOutput(r, next);
+      f.addOutput(r, product);
+      f.setMassFlow(feed, 1.0 + i % 7);
+      previous = next;
+    }
+}
+
+void benchmarkDeviceCalls() {
+    const size_t calls = 10000000;
+    streamcounter = 0;
+    shared_ptr<Stream> s1(new Stream(++streamcounter));
+    shared_ptr<Stream> s2(new Stream(++streamcounter));
+    shared_ptr<Stream> s3(new Stream(++streamcounter));
+    shared_ptr<Stream> s4(new Stream(++streamcounter));
+    s2->setMassFlow(5.0);
+
+    Mixer mixer(2);
+    mixer.addInput(s1);
+    mixer.addInput(s2);
+    mixer.addOutput(s3);
+    Device& mixerDevice = mixer;
+    double seconds = timeBenchmark(calls, [&]{
+      s1->setMassFlow(benchmarkSink);
+      mixerDevice.updateOutputs();
+      benchmarkSink = s3->getMassFlow() * 0.5;
+    });
+    reportBenchmark("mixer_update_outputs", 1, calls, seconds);
+
+    Reactor reactor(true);
+    reactor.addInput(s1);
+    reactor.addOutput(s3);
+    reactor.addOutput(s4);
+    Device& reactorDevice = reactor;
+    seconds = timeBenchmark(calls, [&]{
+      s1->setMassFlow(benchmarkSink + 1.0);
+      reactorDevice.updateOutputs();
+      benchmarkSink = s4->getMassFlow();
+    });
+    reportBenchmark("reactor_update_outputs", 1, calls, seconds);
+}
+
+void benchmarkConstruction() {
+    for (size_t n : {1000, 100000, 1000000}) {
+      size_t repetitions = max<size_t>(1, 1000000 / n);
+      double seconds = timeBenchmark(repetitions, [&]{
+        streamcounter = 0;
+        vector<shared_ptr<Stream>> streams;
+        for (size_t i = 0; i < n; i++) streams.push_back(shared_ptr<Stream>(new Stream(++streamcounter)));
+        benchmarkSink += streams.size();
+      });
+      reportBenchmark("legacy_stream_construction", n, repetitions, seconds);
+
+      seconds = timeBenchmark(repetitions, [&]{
+        streamcounter = 0;
+        StreamTable table;
+        table.reserve(n, 8 * n);
+        for (size_t i = 0; i < n; i++) table.addUnique("s"+std::to_string(++streamcounter));
+        benchmarkSink += table.size();
+      });
+      reportBenchmark("stream_table_construction", n, repetitions, seconds);
+
+      seconds = timeBenchmark(repetitions, [&]{
+        streamcounter = 0;
+        Flowsheet f;
+        buildBenchmarkPlant(f, n);
+        benchmarkSink += f.deviceCount();
+      });
+      reportBenchmark("flowsheet_construction", n, repetitions, seconds);
+    }
+}
+
+void benchmarkBulkWiring() {
+    const size_t ports = 1000000;
+    const size_t repetitions = 5;
+    for (bool bulk : {false, true}) {
+      // Streams and devices are created up front so only the wiring is timed.
+      vector<Flowsheet> sheets(repetitions);
+      vector<StreamHandle> feeds(ports);
+      for (Flowsheet& f : sheets) {
+        f.reserve(ports + 1, 1, ports);
+        for (size_t i = 0; i < ports; i++) feeds[i] = f.addStream();
+        f.addDevice<Mixer>(ports);
+      }
+      size_t next = 0;
+      double seconds = timeBenchmark(repetitions, [&]{
+        Flowsheet& f = sheets[next++];
+        if (bulk) {
+          f.addInputs(0, feeds);
+        } else {
+          for (StreamHandle s : feeds) f.addInput(0, s);
+        }
+      });
+      reportBenchmark(bulk ? "wide_mixer_bulk_wiring" : "wide_mixer_port_wiring", ports, repetitions, seconds);
+    }
+}
+
+void benchmarkSolves() {
+    for (size_t n : {1000, 10000, 100000, 1000000}) {
+      size_t repetitions = max<size_t>(3, 10000000 / n);
+      streamcounter = 0;
+      Flowsheet f;
+      buildBenchmarkPlant(f, n);
+
+      double seconds = timeBenchmark(1, [&]{ f.solve(); });
+      reportBenchmark("flowsheet_first_solve", n, 1, seconds);
+      seconds = timeBenchmark(repetitions, [&]{ f.solve(); });
+      reportBenchmark("flowsheet_solve", n, repetitions, seconds);
+      seconds = timeBenchmark(repetitions, [&]{ benchmarkSink += f.auditMassBalance().worstResidual; });
+      reportBenchmark("mass_balance_audit", n, repetitions, seconds);
+      benchmarkSink += f.getMassFlow(0);
+    }
+}
+
+void benchmarkLinearSolve() {
+    for (size_t n : {1000, 10000}) {
+      size_t repetitions = max<size_t>(3, 1000000 / n);
+      streamcounter = 0;
+      Flowsheet f;
+      // A chain of recycle loops: every mixer sends 30% of its product back to itself.
+      StreamHandle feed = f.addStream();
+      f.setMassFlow(feed, 1.0);
+      for (size_t i = 0; i < n; i++) {
+        DeviceHandle m = f.addDevice<Mixer>(2);
+        DeviceHandle s = f.addDevice<Splitter>(vector<double>{0.7, 0.3});
+        StreamHandle mixed = f.addStream();
+        StreamHandle next = f.addStream();
+        StreamHandle recycle = f.addStream();
+        f.addInput(m, feed);
+        f.addInput(m, recycle);
+        f.addOutput(m, mixed);
+        f.addInput(s, mixed);
+        f.addOutput(s, next);
+        f.addOutput(s, recycle);
+        feed = next;
+      }
+
+      double seconds = timeBenchmark(repetitions, [&]{ f.solve(); });
+      reportBenchmark("recycle_iterative_solve", n, repetitions, seconds);
+      seconds = timeBenchmark(1, [&]{ f.factorLinear().orThrow(); });
+      reportBenchmark("recycle_linear_factor", n, 1, seconds);
+      seconds = timeBenchmark(repetitions, [&]{ f.solveLinear(); });
+      reportBenchmark("recycle_linear_solve", n, repetitions, seconds);
+      benchmarkSink += f.getMassFlow(feed);
+    }
+}
+
+void benchmarkSensitivities() {
+    const size_t units = 100000;
+    const size_t repetitions = 5;
+    streamcounter = 0;
+    Flowsheet f;
+    buildBenchmarkPlant(f, units);
+    f.solve();
+    vector<StreamHandle> feeds = {0};
+    for (size_t i = 0; i < 15; i++) feeds.push_back(1 + 4 * i);
+
+    // Central differences: two solves per feed, filling the same dense Jacobian.
+    size_t streamCount = f.getStreams().size();
+    vector<double> jacobian(streamCount * feeds.size()), plus(streamCount);
+    double seconds = timeBenchmark(repetitions, [&]{
+      for (size_t j = 0; j < feeds.size(); j++) {
+        double m = f.getMassFlow(feeds[j]);
+        f.setMassFlow(feeds[j], m + 1e-6);
+        f.solve();
+        memcpy(plus.data(), f.getStreams().data(), streamCount * sizeof(double));
+        f.setMassFlow(feeds[j], m - 1e-6);
+        f.solve();
+        const double* minus = f.getStreams().data();
+        for (size_t s = 0; s < streamCount; s++) jacobian[s * feeds.size() + j] = (plus[s] - minus[s]) / 2e-6;
+        f.setMassFlow(feeds[j], m);
+      }
+    });
+    benchmarkSink += jacobian[0];
+    reportBenchmark("jacobian_finite_difference", units, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ benchmarkSink += f.sensitivities(feeds).values[0]; });
+    reportBenchmark("jacobian_dual", units, repetitions, seconds);
+}
+
+void benchmarkScreening() {
+    const size_t units = 2000;
+    const size_t scenarios = 8192;
+    const size_t repetitions = 5;
+    streamcounter = 0;
+    Flowsheet f;
+    buildBenchmarkPlant(f, units);
+    ScenarioBatch exact = f.makeScenarios(scenarios);
+    ScreeningBatch screen = f.makeScenarios<float>(scenarios);
+    double seconds = timeBenchmark(repetitions, [&]{ f.solveScenarios(exact); });
+    reportBenchmark("scenarios_double", units * scenarios, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ f.solveScenarios(screen); });
+    reportBenchmark("scenarios_float_screening", units * scenarios, repetitions, seconds);
+    benchmarkSink += exact.getMassFlow(1, 0) + screen.getMassFlow(1, 0);
+}
+
+void benchmarkHistory() {
+    const size_t units = 10000;
+    const size_t steps = 1000;
+    streamcounter = 0;
+    Flowsheet f;
+    buildBenchmarkPlant(f, units);
+    FileSink sink("/dev/null");
+    HistoryWriter history(sink, f.getStreams().size());
+    double seconds = timeBenchmark(1, [&]{
+      f.simulate({0}, steps, [](size_t t, double* values) { values[0] = t; }, history);
+    });
+    reportBenchmark("history_simulate_step", units, steps, seconds);
+    benchmarkSink += history.steps();
+}
+
+void benchmarkSnapshot() {
+    const size_t units = 1000000;
+    TemporaryFile snapshotFile("bench_snapshot_");
+    const string& path = snapshotFile.path();
+    {
+      streamcounter = 0;
+      Flowsheet f;
+      buildBenchmarkPlant(f, units);
+      double seconds = timeBenchmark(1, [&]{ f.saveSnapshot(path); });
+      reportBenchmark("snapshot_save", units, 1, seconds);
+    }
+    double seconds = timeBenchmark(1, [&]{
+      MappedSnapshot snapshot(path);
+      Flowsheet f;
+      f.loadSnapshot(snapshot);
+      benchmarkSink += f.deviceCount();
+    });
+    reportBenchmark("snapshot_load", units, 1, seconds);
+}
+
+void benchmarkMixerBank() {
+    const size_t mixers = 100000;
+    const size_t repetitions = 200;
+    MixerBank bank(mixers, 4);
+    streamcounter = 0;
+    Flowsheet f;
+    f.reserve(5 * mixers, mixers, 4 * mixers);
+    for (size_t i = 0; i < mixers; i++) {
+      DeviceHandle m = f.addDevice<Mixer>(4);
+      for (size_t k = 0; k < 4; k++) {
+        StreamHandle in = f.addStream();
+        f.setMassFlow(in, i + k);
+        bank.setInput(i, k, i + k);
+        f.addInput(m, in);
+      }
+      f.addOutput(m, f.addStream());
+    }
+    f.solve();
+
+    double seconds = timeBenchmark(repetitions, [&]{ f.solve(); });
+    reportBenchmark("mixer_flowsheet_evaluate", mixers, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ bank.updateOutputs(SimdPath::Scalar); });
+    reportBenchmark("mixer_bank_scalar", mixers, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ bank.updateOutputs(); });
+    reportBenchmark("mixer_bank_best_simd", mixers, repetitions, seconds);
+    benchmarkSink += bank.getOutput(0, 0);
+}
+
+void benchmarkSplitterBank() {
+    const size_t splitters = 100000;
+    const size_t repetitions = 200;
+    vector<double> ratios = {0.5, 0.3, 0.2};
+    SplitterBank bank(splitters, ratios);
+    streamcounter = 0;
+    Flowsheet f;
+    f.reserve(4 * splitters, splitters, 4 * splitters);
+    for (size_t i = 0; i < splitters; i++) {
+      DeviceHandle s = f.addDevice<Splitter>(ratios);
+      StreamHandle in = f.addStream();
+      f.setMassFlow(in, i);
+      bank.setInput(i, i);
+      f.addInput(s, in);
+      for (size_t j = 0; j < ratios.size(); j++) f.addOutput(s, f.addStream());
+    }
+    f.solve();
+
+    double seconds = timeBenchmark(repetitions, [&]{ f.solve(); });
+    reportBenchmark("splitter_flowsheet_evaluate", splitters, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ bank.updateOutputs(SimdPath::Scalar); });
+    reportBenchmark("splitter_bank_scalar", splitters, repetitions, seconds);
+    seconds = timeBenchmark(repetitions, [&]{ bank.updateOutputs(); });
+    reportBenchmark("splitter_bank_best_simd", splitters, repetitions, seconds);
+    benchmarkSink += bank.getOutput(0, 0);
+}
+
+void benchmarkCompositions() {
+    const size_t units = 10000;
+    for (size_t n : {20, 200}) {
+      streamcounter = 0;
+      Flowsheet f;
+      buildBenchmarkPlant(f, units);
+      f.setComponentCount(n);
+      vector<double> matrix(n * n, 0.0);
+      for (size_t c = 0; c < n; c++) matrix[c * n + (c + 1) % n] = 1.0;
+      for (DeviceHandle d = 0; d < f.deviceCount(); d++) {
+        if (f.getDevice(d).typeId() == REACTOR_TYPE) static_cast<Reactor&>(f.getDevice(d)).setStoichiometry(matrix, n);
+      }
+      vector<double> feed(n, 1.0);
+      for (StreamHandle s = 0; s < f.getStreams().size(); s++) f.setComposition(s, feed.data());
+      f.solve();
+
+      size_t repetitions = max<size_t>(3, 2000 / n);
+      double seconds = timeBenchmark(repetitions, [&]{ f.solve(); });
+      reportBenchmark("composition_solve_"s + std::to_string(n), units * n, repetitions, seconds);
+      benchmarkSink += f.getMassFlow(1);
+    }
+}
+
+/**
+ * @brief Benchmark entry point: prints CSV rows to stdout.
+ * @return 0 on successful execution.
+ */
+int main()
+{
+    printf("benchmark,units,repetitions,ns_per_unit\n");
+    benchmarkDeviceCalls();
+    benchmarkConstruction();
+    benchmarkBulkWiring();
+    benchmarkSolves();
+    benchmarkLinearSolve();
+    benchmarkScreening();
+    benchmarkHistory();
+    benchmarkSensitivities();
+    benchmarkSnapshot();
+    benchmarkMixerBank();
+    benchmarkSplitterBank();
+    benchmarkCompositions();
+    fprintf(stderr, "sink %g\n", benchmarkSink);
+    return 0;
+}
+#elif defined(DEVICE_SCALING)
+/**
+ * @brief Peak resident set size of the process so far, in kilobytes.
+ */
+long peakRssKb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * @brief Fastest of several runs of f, in seconds.
+ */
+template <class F>
+double bestTime(size_t repetitions, F f) {
+    double best = numeric_limits<double>::max();
+    for (size_t r = 0; r < repetitions; r++) {
+      auto start = chrono::steady_clock::now();
+      f();
+      best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
 }
 
+double scalingSink; ///< Keeps measured results observable.
+
+/**
+ * @class ScalingHarness
+ * @brief Times every solve mode on synthetic workloads across thread counts and prints CSV rows.
+ *
+ * Speedups are relative to the same mode and scaling curve on one thread: for strong
+ * scaling the workload is fixed, for weak scaling it grows with the thread count, so 1.0
+ * there is perfect scaling.
+ */
+class ScalingHarness
+{
+private:
+    static constexpr size_t REPETITIONS = 3;
+    static constexpr size_t SCENARIOS = 64;
+    unordered_map<string, double> oneThread; ///< Seconds on one thread of every curve and mode.
+
+    void report(const string& curve, const string& mode, size_t threads, size_t devices, double seconds) {
+        string key = curve + "/" + mode;
+        if (threads == 1) oneThread[key] = seconds;
+        double speedup = oneThread.count(key) ? oneThread[key] / seconds : 0;
+        printf("%s,%s,%zu,%zu,%.6f,%.3f,%ld\n", curve.c_str(), mode.c_str(), threads, devices, seconds, speedup,
+               peakRssKb());
+        fflush(stdout);
+    }
+
+public:
+    /**
+     * @brief Measure the serial, level-parallel, incremental and batched-scenario modes.
+     * @param curve "strong" or "weak".
+     */
+    void measure(const string& curve, const WorkloadSpec& spec, size_t threads) {
+        WorkStealingPool pool(threads);
+        Flowsheet f;
+        vector<StreamHandle> feeds = buildSyntheticFlowsheet(f, spec);
+        f.solve();
+        // Every timed solve starts from a changed feed, so recycles have to converge again.
+        size_t changes = 0;
+        auto solveChanged = [&]{
+          changes++;
+          f.setMassFlow(feeds[changes % feeds.size()], 1.0 + changes % 10);
+          f.solve();
+        };
+
+        if (threads == 1) {
+          report(curve, "serial", threads, spec.devices, bestTime(REPETITIONS, solveChanged));
+
+          // Incremental recomputation needs an acyclic plant; recycles make it a full solve.
+          WorkloadSpec acyclic = spec;
+          acyclic.recycleDensity = 0;
+          Flowsheet g;
+          vector<StreamHandle> acyclicFeeds = buildSyntheticFlowsheet(g, acyclic);
+          g.solve();
+          size_t step = 0;
+          report(curve, "incremental", threads, spec.devices, bestTime(REPETITIONS, [&]{
+            step++;
+            g.setMassFlow(acyclicFeeds[step % acyclicFeeds.size()], 1.0 + step % 10);
+            scalingSink += g.updateDirty();
+          }));
+        }
+
+        f.setExecutor(&pool);
+        report(curve, "level_parallel", threads, spec.devices, bestTime(REPETITIONS, solveChanged));
+
+        ScenarioBatch batch = f.makeScenarios(SCENARIOS);
+        for (size_t j = 0; j < SCENARIOS; j++) batch.setMassFlow(feeds[0], j, j);
+        report(curve, "scenarios", threads, spec.devices, bestTime(REPETITIONS, [&]{ f.solveScenarios(batch); }));
+        scalingSink += batch.getMassFlow(feeds[0], 1) + f.getMassFlow(feeds[0]);
+    }
+};
+
+/**
+ * @brief Scaling entry point: prints strong and weak scaling curves as CSV to stdout.
+ * @return 0 on successful execution.
+ */
+int main()
+{
+    size_t cores = max(1u, thread::hardware_concurrency());
+    vector<size_t> threadCounts;
+    for (size_t t = 1; t < cores; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(cores);
+
+    WorkloadSpec spec;
+    spec.fanIn = 2;
+    spec.recycleDensity = 0.05;
+    spec.depth = 50;
+
+    ScalingHarness harness;
+    printf("scaling,mode,threads,devices,seconds,speedup,peak_rss_kb\n");
+    for (size_t threads : threadCounts) {
+      spec.devices = 100000;
+      harness.measure("strong", spec, threads);
+    }
+    for (size_t threads : threadCounts) {
+      spec.devices = 25000 * threads;
+      harness.measure("weak", spec, threads);
+    }
+    fprintf(stderr, "sink %g\n", scalingSink);
+    return 0;
+}
+#else
 /**
  * @brief The entry point of the program.
  * @return 0 on successful execution.
@@ -345,3 +8376,4 @@ int main()
 
     return 0;
 }
+#endif